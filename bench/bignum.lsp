@@ -0,0 +1,19 @@
+;;; bignum: factorials and exact rational sums far past machine words
+
+(define (fact n)
+  (if (= n 0)
+      1
+      (* n (fact (- n 1)))))
+
+(define (harmonic n)
+  (if (= n 0)
+      0
+      (+ (/ 1 n) (harmonic (- n 1)))))
+
+(define (digit-sum n)
+  (if (= n 0)
+      0
+      (+ (remainder n 10) (digit-sum (quotient n 10)))))
+
+(define (run)
+  (+ (digit-sum (fact 500)) (harmonic 400)))
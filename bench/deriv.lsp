@@ -0,0 +1,35 @@
+;;; deriv: symbolic differentiation, quoted symbols and list building
+
+(define (cadr* l) (car (cdr l)))
+(define (caddr* l) (car (cdr (cdr l))))
+
+(define (map-deriv l)
+  (if (null? l)
+      '()
+      (cons (deriv (car l)) (map-deriv (cdr l)))))
+
+(define (map-quotient l)
+  (if (null? l)
+      '()
+      (cons (list '/ (deriv (car l)) (car l)) (map-quotient (cdr l)))))
+
+(define (deriv a)
+  (cond ((not (pair? a)) (if (eq? a 'x) 1 0))
+        ((eq? (car a) '+) (cons '+ (map-deriv (cdr a))))
+        ((eq? (car a) '-) (cons '- (map-deriv (cdr a))))
+        ((eq? (car a) '*) (list '* a (cons '+ (map-quotient (cdr a)))))
+        ((eq? (car a) '/)
+         (list '-
+               (list '/ (deriv (cadr* a)) (caddr* a))
+               (list '/ (cadr* a)
+                     (list '* (caddr* a) (caddr* a) (deriv (caddr* a))))))
+        (else 0)))
+
+(define expr '(+ (* 3 x x) (* a x x) (* b x) 5))
+
+(define (repeat n)
+  (if (= n 0)
+      (deriv expr)
+      (begin (deriv expr) (repeat (- n 1)))))
+
+(define (run) (repeat 2000))
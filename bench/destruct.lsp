@@ -0,0 +1,40 @@
+;;; destruct: destructive list surgery with set-car! and set-cdr!
+
+(define (make-list* n x)
+  (if (= n 0)
+      '()
+      (cons x (make-list* (- n 1) x))))
+
+(define (make-rows n m)
+  (if (= n 0)
+      '()
+      (cons (make-list* m n) (make-rows (- n 1) m))))
+
+(define (last-pair* l)
+  (if (null? (cdr l)) l (last-pair* (cdr l))))
+
+;; Splice the tail of every row onto the next one, then refill the rows
+(define (splice rows)
+  (if (null? (cdr rows))
+      rows
+      (begin
+        (set-cdr! (last-pair* (car rows)) (cdr (car (cdr rows))))
+        (set-car! (car (cdr rows)) (car (car rows)))
+        (splice (cdr rows)))))
+
+(define (refill rows m)
+  (if (null? rows)
+      rows
+      (begin
+        (set-car! rows (make-list* m (car (car rows))))
+        (refill (cdr rows) m))))
+
+(define (destruct rows n)
+  (if (= n 0)
+      (car (car rows))
+      (begin
+        (splice rows)
+        (refill rows 10)
+        (destruct rows (- n 1)))))
+
+(define (run) (destruct (make-rows 100 10) 100))
@@ -0,0 +1,8 @@
+;;; fib: doubly recursive Fibonacci, closure calls and small arithmetic
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (run) (fib 20))
@@ -0,0 +1,366 @@
+/**
+ * Interpreter primitive microbenchmarks
+ *
+ * Each benchmark runs a fixed number of operations per round. After a
+ * warm up round the median of ROUNDS rounds is reported, tab separated:
+ * nanoseconds and TSC cycles per operation, and MB/s for the ones that
+ * consume or produce text.
+ *
+ * Usage: microbench [substring of benchmark names]
+ */
+#include <fcntl.h>
+#include <gmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "builtin.h"
+#include "env.h"
+#include "eval.h"
+#include "memory.h"
+#include "numbers.h"
+#include "parser.h"
+#include "reader.h"
+#include "value.h"
+
+#define ROUNDS 7
+
+typedef struct {
+  const char *name;
+  size_t ops;          // per round
+  void (*setup)(void); // once, before the warm up
+  void (*run)(size_t ops);
+  double bytes_per_op; // text read or written, 0 if not a text benchmark
+} microbench;
+
+// Results go here so the work is not optimized away
+static volatile uintptr_t sink;
+
+static env global;
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static value number(long n) {
+  mpq_ptr q = num_exact_new();
+
+  mpq_set_si(q, n, 1);
+  return value_new_exact(q);
+}
+
+static value list2(value a, value b) {
+  return value_new_cons(a, value_new_cons(b, value_new_nil()));
+}
+
+/**
+ * Allocation
+ */
+static void run_alloc(size_t ops) {
+  for (size_t i = 0; i < ops; i++)
+    sink = (uintptr_t)value_alloc(TYPE_CONS);
+}
+
+static void run_cons(size_t ops) {
+  value nil = value_new_nil();
+
+  for (size_t i = 0; i < ops; i++)
+    sink = (uintptr_t)value_new_cons(nil, nil);
+}
+
+/**
+ * Environment lookup of a binding depth frames out
+ */
+static env nested;
+
+static void nest(size_t depth) {
+  char name[32];
+
+  nested = env_new(NULL);
+  env_set(nested, value_new_symbol("target"), number(1));
+
+  for (size_t i = 0; i < depth; i++) {
+    snprintf(name, sizeof(name), "local-%zu", i);
+    nested = env_new(nested);
+    env_set(nested, value_new_symbol(name), number(i));
+  }
+}
+
+static void setup_env_1(void) { nest(1); }
+static void setup_env_16(void) { nest(16); }
+static void setup_env_256(void) { nest(256); }
+
+static void run_env_lookup(size_t ops) {
+  for (size_t i = 0; i < ops; i++)
+    sink = (uintptr_t)env_lookup(nested, "target");
+}
+
+/**
+ * Special form dispatch, early and late in the table
+ */
+static value quote_args, let_args;
+
+static void setup_special(void) {
+  quote_args = value_new_cons(value_new_symbol("x"), value_new_nil());
+  let_args = value_new_cons(value_new_nil(), value_new_nil());
+}
+
+static void run_special_quote(size_t ops) {
+  value head = value_new_symbol("quote");
+
+  for (size_t i = 0; i < ops; i++)
+    sink = (uintptr_t)eval_special(head, quote_args, global);
+}
+
+static void run_special_let(size_t ops) {
+  value head = value_new_symbol("let");
+
+  for (size_t i = 0; i < ops; i++)
+    sink = (uintptr_t)eval_special(head, let_args, global);
+}
+
+/**
+ * Addition through the + builtin
+ */
+static value small_args, large_args;
+
+static void setup_add(void) {
+  small_args = list2(number(1), number(2));
+
+  mpq_ptr big = num_exact_new();
+
+  mpz_ui_pow_ui(mpq_numref(big), 2, 256);
+  large_args = list2(value_new_exact(big), value_new_exact(big));
+}
+
+static void run_add(function add, value args, size_t ops) {
+  for (size_t i = 0; i < ops; i++)
+    sink = (uintptr_t)add(args, global);
+}
+
+static void run_add_small(size_t ops) {
+  run_add(builtin_lookup("+"), small_args, ops);
+}
+
+static void run_add_large(size_t ops) {
+  run_add(builtin_lookup("+"), large_args, ops);
+}
+
+/**
+ * Lexing and parsing a generated source file
+ */
+static const char source_form[] =
+    "(define (fib n)\n"
+    "  (if (< n 2)\n"
+    "      n\n"
+    "      (+ (fib (- n 1)) (fib (- n 2))))) ; comment\n"
+    "(define greeting \"hello, world\")\n";
+
+static char *source;
+static size_t source_len;
+static reader source_reader;
+
+static void setup_source(void) {
+  size_t copies = (1024 * 1024) / (sizeof(source_form) - 1);
+
+  source_len = copies * (sizeof(source_form) - 1);
+  source = malloc(source_len + 1);
+
+  for (size_t i = 0; i < copies; i++)
+    memcpy(source + i * (sizeof(source_form) - 1), source_form,
+           sizeof(source_form) - 1);
+
+  source[source_len] = '\0';
+  source_reader = reader_open_string(source, source_len);
+}
+
+static void run_lexer(size_t ops) {
+  for (size_t i = 0; i < ops; i++) {
+    token t = token_getnext(source_reader);
+
+    // Start over at the end of the input
+    if (t.type == TOK_EOF)
+      source_reader = reader_open_string(source, source_len);
+
+    sink = t.len;
+  }
+}
+
+static void run_parser(size_t ops) {
+  for (size_t i = 0; i < ops; i++) {
+    value form = parse_expression(source_reader);
+
+    if (!form) {
+      source_reader = reader_open_string(source, source_len);
+      form = parse_expression(source_reader);
+    }
+
+    sink = (uintptr_t)form;
+  }
+}
+
+/**
+ * Printing a 100 element list to /dev/null
+ */
+static value printed;
+
+static void setup_print(void) {
+  printed = value_new_nil();
+
+  for (long i = 100; i > 0; i--)
+    printed = value_new_cons(i & 1 ? number(i * 7919)
+                                   : value_new_symbol("element"),
+                             printed);
+}
+
+static void run_print(size_t ops) {
+  for (size_t i = 0; i < ops; i++)
+    value_print(printed);
+}
+
+static microbench benchmarks[] = {
+    {"value-alloc", 1000000, NULL, run_alloc, 0},
+    {"value-new-cons", 1000000, NULL, run_cons, 0},
+    {"env-lookup-depth-1", 1000000, setup_env_1, run_env_lookup, 0},
+    {"env-lookup-depth-16", 1000000, setup_env_16, run_env_lookup, 0},
+    {"env-lookup-depth-256", 100000, setup_env_256, run_env_lookup, 0},
+    {"eval-special-quote", 1000000, setup_special, run_special_quote, 0},
+    {"eval-special-let", 1000000, setup_special, run_special_let, 0},
+    {"builtin-add-small", 1000000, setup_add, run_add_small, 0},
+    {"builtin-add-large", 1000000, setup_add, run_add_large, 0},
+    {"token-getnext", 2000000, setup_source, run_lexer, 0},
+    {"parse-expression", 200000, setup_source, run_parser, 0},
+    {"value-print", 10000, setup_print, run_print, 0},
+    {NULL, 0, NULL, NULL, 0}};
+
+/**
+ * Harness
+ */
+static int by_value(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double median(double *samples) {
+  qsort(samples, ROUNDS, sizeof(double), by_value);
+  return samples[ROUNDS / 2];
+}
+
+// Text throughput is measured on what one round actually reads or writes
+static double text_bytes(microbench *b) {
+  if (b->run == run_lexer || b->run == run_parser) {
+    reader r = reader_open_string(source, source_len);
+    size_t units = 0;
+
+    if (b->run == run_lexer)
+      while (token_getnext(r).type != TOK_EOF)
+        units++;
+    else
+      while (parse_expression(r))
+        units++;
+
+    return (double)source_len / units;
+  }
+
+  if (b->run == run_print) {
+    FILE *tmp = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+
+    fflush(stdout);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    value_print(printed);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    double bytes = lseek(fileno(tmp), 0, SEEK_END);
+
+    fclose(tmp);
+    return bytes;
+  }
+
+  return 0;
+}
+
+static void measure(microbench *b) {
+  double ns[ROUNDS], cyc[ROUNDS];
+
+  if (b->setup)
+    b->setup();
+
+  b->bytes_per_op = text_bytes(b);
+
+  // Printing goes to /dev/null, results go to the real stdout
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+
+  fflush(stdout);
+  dup2(null, STDOUT_FILENO);
+
+  b->run(b->ops / 10);
+
+  for (int r = 0; r < ROUNDS; r++) {
+    uint64_t t0 = now_ns(), c0 = cycles();
+
+    b->run(b->ops);
+
+    uint64_t c1 = cycles(), t1 = now_ns();
+
+    ns[r] = (double)(t1 - t0) / b->ops;
+    cyc[r] = (double)(c1 - c0) / b->ops;
+  }
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(null);
+
+  double ns_op = median(ns);
+
+  printf("%s\t%zu\t%.2f\t%.1f\t", b->name, b->ops, ns_op, median(cyc));
+
+  if (b->bytes_per_op > 0)
+    printf("%.1f\n", b->bytes_per_op / ns_op * 1e3);
+  else
+    printf("-\n");
+
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  mem_options opts;
+
+  mem_options_init(&opts);
+  mem_startup(&opts);
+
+  global = env_new(NULL);
+  global = builtins_startup(global);
+  global = special_startup(global);
+
+  printf("benchmark\tops\tns/op\tcycles/op\tMB/s\n");
+
+  for (microbench *b = benchmarks; b->name; b++)
+    if (argc < 2 || strstr(b->name, argv[1]))
+      measure(b);
+
+  return EXIT_SUCCESS;
+}
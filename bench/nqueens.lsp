@@ -0,0 +1,30 @@
+;;; nqueens: count the solutions to the eight queens problem
+
+(define (iota1 n)
+  (if (= n 0)
+      '()
+      (cons n (iota1 (- n 1)))))
+
+(define (append2 a b)
+  (if (null? a)
+      b
+      (cons (car a) (append2 (cdr a) b))))
+
+(define (ok? row dist placed)
+  (if (null? placed)
+      #t
+      (and (not (= (car placed) (+ row dist)))
+           (not (= (car placed) (- row dist)))
+           (ok? row (+ dist 1) (cdr placed)))))
+
+(define (try-it x y z)
+  (if (null? x)
+      (if (null? y) 1 0)
+      (+ (if (ok? (car x) 1 z)
+             (try-it (append2 (cdr x) y) '() (cons (car x) z))
+             0)
+         (try-it (cdr x) (cons (car x) y) z))))
+
+(define (queens n) (try-it (iota1 n) '() '()))
+
+(define (run) (queens 8))
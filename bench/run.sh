@@ -0,0 +1,58 @@
+#!/bin/sh
+# Run every benchmark in a directory and report medians
+#
+# Usage: run.sh LETLISP REPEAT DIR [NAME...]
+#
+# Each benchmark file defines (run). It is loaded, then (time (run)) is
+# evaluated REPEAT times, each in a fresh process. Output is tab separated,
+# one header line then one line per benchmark: median wall and cpu time in
+# milliseconds, and the bytes allocated and collections of the median run.
+
+letlisp=$1
+repeat=$2
+dir=$3
+shift 3
+
+names=$*
+
+if [ -z "$names" ]; then
+  for file in "$dir"/*.lsp; do
+    names="$names $(basename "$file" .lsp)"
+  done
+fi
+
+printf 'benchmark\truns\twall-ms\tcpu-ms\tallocated-bytes\tcollections\n'
+
+status=0
+
+for name in $names; do
+  times=""
+  i=0
+
+  while [ $i -lt "$repeat" ]; do
+    # ;; time: W ms wall, C ms cpu, B bytes allocated, N collections
+    line=$("$letlisp" -e "(load \"$dir/$name.lsp\")" -e '(time (run))' \
+      2>&1 >/dev/null | grep '^;; time:')
+
+    if [ -z "$line" ]; then
+      printf '%s\terror\n' "$name"
+      status=1
+      break
+    fi
+
+    times="$times$line
+"
+    i=$((i + 1))
+  done
+
+  [ $i -lt "$repeat" ] && continue
+
+  printf '%s' "$times" | sort -n -k 3 | awk -v name="$name" -v runs="$repeat" '
+    { wall[NR] = $3; cpu[NR] = $6; bytes[NR] = $9; gcs[NR] = $12 }
+    END {
+      m = int((NR + 1) / 2)
+      printf "%s\t%d\t%s\t%s\t%s\t%s\n", name, runs, wall[m], cpu[m], bytes[m], gcs[m]
+    }'
+done
+
+exit $status
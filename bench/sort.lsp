@@ -0,0 +1,34 @@
+;;; sort: merge sort of a pseudo random list
+
+(define (random-list n seed)
+  (if (= n 0)
+      '()
+      (cons seed (random-list (- n 1) (remainder (+ (* seed 1103) 12345) 65536)))))
+
+(define (merge a b)
+  (cond ((null? a) b)
+        ((null? b) a)
+        ((< (car b) (car a)) (cons (car b) (merge a (cdr b))))
+        (else (cons (car a) (merge (cdr a) b)))))
+
+(define (evens l)
+  (if (null? l)
+      '()
+      (cons (car l) (odds (cdr l)))))
+
+(define (odds l)
+  (if (null? l)
+      '()
+      (evens (cdr l))))
+
+(define (msort l)
+  (if (or (null? l) (null? (cdr l)))
+      l
+      (merge (msort (evens l)) (msort (odds l)))))
+
+(define (repeat n l)
+  (if (= n 1)
+      (msort l)
+      (begin (msort l) (repeat (- n 1) l))))
+
+(define (run) (car (repeat 10 (random-list 500 42))))
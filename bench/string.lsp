@@ -0,0 +1,13 @@
+;;; string: string building with string-append and number->string
+
+(define (digits n acc)
+  (if (= n 0)
+      acc
+      (digits (- n 1) (string-append acc (number->string n) " "))))
+
+(define (total n len)
+  (if (= n 0)
+      len
+      (total (- n 1) (+ len (string-length (digits 300 ""))))))
+
+(define (run) (total 30 0))
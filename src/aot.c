@@ -0,0 +1,832 @@
+#include <dlfcn.h>
+#include <gmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aot.h"
+#include "builtin.h"
+#include "env.h"
+#include "eval.h"
+#include "jit.h"
+#include "memory.h"
+#include "numbers.h"
+#include "parser.h"
+#include "reader.h"
+#include "repl.h"
+#include "value.h"
+
+#ifndef LETLISP_CC
+#define LETLISP_CC "cc"
+#endif
+
+#ifndef LETLISP_INCLUDE
+#define LETLISP_INCLUDE "."
+#endif
+
+#ifndef LETLISP_BUILD_INCLUDE
+#define LETLISP_BUILD_INCLUDE LETLISP_INCLUDE
+#endif
+
+#ifndef LETLISP_CC_FLAGS
+#define LETLISP_CC_FLAGS ""
+#endif
+
+/**
+ * Runtime of generated code
+ */
+
+// Whatever loaded modules point to from their static data
+static value aot_roots;
+
+static value aot_keep(value v) {
+  aot_roots = value_new_cons(v, aot_roots ? aot_roots : value_new_nil());
+  return v;
+}
+
+value aot_site(const char *name) {
+  return aot_keep(value_new_cons(value_new_symbol(name), value_new_nil()));
+}
+
+value aot_datum(const char *text) {
+  reader in = reader_open_string(text, strlen(text));
+  value v = parse_expression(in);
+
+  reader_close(in);
+
+  if (!v)
+    repl_error("compiled module: missing datum");
+
+  // Forms are evaluated, quoted data is just bigger as code
+  return aot_keep(value_code(v));
+}
+
+value aot_define(env e, const char *name, function fn) {
+  value v = value_new_function(strdup(name), fn);
+
+  env_define(e, value_new_symbol(name), v);
+  return aot_keep(v);
+}
+
+void aot_args(value args, long n, value *argv, const char *name) {
+  for (long i = 0; i < n; i++, args = cdr(args)) {
+    if (args->type != TYPE_CONS)
+      repl_error("%s: expects %ld arguments", name, n);
+
+    argv[i] = car(args);
+  }
+}
+
+static value list_of(long n, value *argv) {
+  value list = value_new_nil();
+
+  while (n--)
+    list = value_new_cons(argv[n], list);
+
+  return list;
+}
+
+env aot_scope(env e, value params, long n, value *argv) {
+  return env_extend(e, params, list_of(n, argv));
+}
+
+value aot_apply(value fn, long n, value *argv, env e) {
+  return eval_apply(fn, list_of(n, argv), e);
+}
+
+value aot_apply2(value fn, value a, value b, env e) {
+  if (fn->type == TYPE_FUNCTION) {
+    jit_op op = jit_fast_op(fn->fn);
+
+    if (op)
+      return op(a, b, e, fn);
+  }
+
+  return aot_apply(fn, 2, (value[]){a, b}, e);
+}
+
+/**
+ * Loading
+ */
+int aot_is_shared(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+
+  return ext && strcmp(ext, ".so") == 0;
+}
+
+// A shared object has its statics once per process, so each environment
+// a module is loaded into gets a copy of the file opened on its own
+typedef struct aot_instance_s *aot_instance;
+
+struct aot_instance_s {
+  void *origin; // handle of the file as loaded
+  void *lib;    // of the copy for e, origin for the first
+  env e;
+  aot_instance next;
+};
+
+static aot_instance instances;
+
+// A private copy of the module in filename, opened, NULL on failure
+static void *aot_copy(const char *filename) {
+  const char *dir = getenv("TMPDIR");
+  char *copy = gcx_malloc(strlen(dir && *dir ? dir : "/tmp") +
+                          sizeof("/letlisp-XXXXXX.so"));
+
+  sprintf(copy, "%s/letlisp-XXXXXX.so", dir && *dir ? dir : "/tmp");
+
+  int fd = mkstemps(copy, 3);
+
+  if (fd < 0)
+    return NULL;
+
+  FILE *in = fopen(filename, "rb");
+  FILE *out = fdopen(fd, "wb");
+  int ok = in && out;
+  char buf[BUFSIZ];
+  size_t n;
+
+  while (ok && (n = fread(buf, 1, sizeof buf, in)) > 0)
+    ok = fwrite(buf, 1, n, out) == n;
+
+  ok = ok && !ferror(in);
+
+  if (in)
+    fclose(in);
+
+  if (out)
+    ok = fclose(out) == 0 && ok;
+  else
+    close(fd);
+
+  // Opened or not, the copy is not needed by name any more
+  void *lib = ok ? dlopen(copy, RTLD_NOW | RTLD_LOCAL) : NULL;
+
+  unlink(copy);
+  return lib;
+}
+
+value aot_load(const char *filename, env e) {
+  // dlopen searches the library path for names without a slash
+  char *path = gcx_malloc(strlen(filename) + 3);
+
+  sprintf(path, "%s%s", strchr(filename, '/') ? "" : "./", filename);
+
+  void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+  if (!lib)
+    repl_error("load: %s", dlerror());
+
+  const unsigned long *abi = dlsym(lib, "letlisp_abi");
+  value (*init)(env) = (value(*)(env))dlsym(lib, "letlisp_init");
+
+  if (!abi || !init) {
+    dlclose(lib);
+    repl_error("load: '%s' is not a compiled module", filename);
+  }
+
+  if (*abi != AOT_ABI) {
+    dlclose(lib);
+    repl_error("load: '%s' was compiled for another letlisp, rebuild it",
+               filename);
+  }
+
+  aot_instance found = NULL;
+  int taken = 0;
+
+  for (aot_instance i = instances; i; i = i->next)
+    if (i->origin == lib) {
+      taken = 1;
+
+      if (i->e == e)
+        found = i;
+    }
+
+  // Never closed, its functions are bound from now on
+  if (!found) {
+    found = gcx_malloc(sizeof(struct aot_instance_s));
+    found->origin = lib;
+    found->lib = taken ? aot_copy(path) : lib;
+    found->e = e;
+
+    if (!found->lib)
+      repl_error("load: could not copy '%s' for another environment",
+                 filename);
+
+    found->next = instances;
+    instances = found;
+  }
+
+  init = (value(*)(env))dlsym(found->lib, "letlisp_init");
+  return init(e);
+}
+
+/**
+ * Compiler
+ *
+ * Bodies are written as GNU C expressions, statement expressions hold
+ * the temporaries of calls so arguments are evaluated in order.
+ */
+typedef struct {
+  FILE *out;    // body being compiled
+  value sites;  // symbols, S[i] is the site of the i-th from the end
+  long nsites;
+  value data;   // texts of data and forms, K[i] likewise
+  long ndata;
+  value defs;   // (name . arity) of compiled procedures, V[i] likewise
+  long ndefs;
+  value params; // of the procedure being compiled
+  int scope;    // its body hands forms to the interpreter
+  long temps;
+} aot_ctx;
+
+static void write_form(FILE *out, value v) {
+  switch (v->type) {
+  case TYPE_CONS:
+    fputc('(', out);
+
+    for (;;) {
+      write_form(out, car(v));
+      v = cdr(v);
+
+      if (v->type != TYPE_CONS)
+        break;
+
+      fputc(' ', out);
+    }
+
+    if (v->type != TYPE_NIL) {
+      fputs(" . ", out);
+      write_form(out, v);
+    }
+
+    fputc(')', out);
+    break;
+
+  case TYPE_NIL:
+    fputs("()", out);
+    break;
+
+  case TYPE_BOOL:
+    fputs(v->boolean ? "#t" : "#f", out);
+    break;
+
+  case TYPE_NUM_EXACT:
+    gmp_fprintf(out, "%Qd", v->num_exact);
+    break;
+
+  case TYPE_STRING:
+    fprintf(out, "\"%s\"", v->string);
+    break;
+
+  case TYPE_SYMBOL:
+  case TYPE_SPECIAL:
+    fputs(v->sym, out);
+    break;
+
+  default:
+    repl_error("compile-to-c: can not write %s", value_type_name(v->type));
+  }
+}
+
+// Index of what is stored on list, added at the front if new
+static long table_index(value *list, long *count, value item, int by_eq) {
+  long i = *count;
+
+  for (value l = *list; l->type == TYPE_CONS; l = cdr(l)) {
+    i--;
+
+    if (by_eq ? car(l) == item : strcmp(car(l)->string, item->string) == 0)
+      return i;
+  }
+
+  *list = value_new_cons(item, *list);
+  return (*count)++;
+}
+
+static long site(aot_ctx *c, value sym) {
+  return table_index(&c->sites, &c->nsites, sym, 1);
+}
+
+static long datum(aot_ctx *c, value v) {
+  char *text;
+  size_t len;
+  FILE *out = open_memstream(&text, &len);
+
+  write_form(out, v);
+  fclose(out);
+
+  return table_index(&c->data, &c->ndata, value_new_string(text), 0);
+}
+
+static long list_index(value sym, value list) {
+  for (long i = 0; list->type == TYPE_CONS; list = cdr(list), i++)
+    if (car(list) == sym)
+      return i;
+
+  return -1;
+}
+
+// Position of the compiled procedure name, arity in *arity, or -1
+static long def_index(aot_ctx *c, value name, long *arity) {
+  long i = c->ndefs;
+
+  for (value d = c->defs; d->type == TYPE_CONS; d = cdr(d)) {
+    i--;
+
+    if (caar(d) == name) {
+      *arity = mpz_get_si(mpq_numref(cdar(d)->num_exact));
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int is_special(value head, const char *name) {
+  return head->type == TYPE_SPECIAL && strcmp(head->sym, name) == 0;
+}
+
+static void c_expr(aot_ctx *c, value form);
+
+static void c_sequence(aot_ctx *c, value body) {
+  if (body->type != TYPE_CONS) {
+    fputs("value_new_nil()", c->out);
+    return;
+  }
+
+  fputs("({ ", c->out);
+
+  for (; body->type == TYPE_CONS; body = cdr(body)) {
+    c_expr(c, car(body));
+    fputs("; ", c->out);
+  }
+
+  fputs("})", c->out);
+}
+
+static void c_eval(aot_ctx *c, value form) {
+  c->scope = 1;
+  fprintf(c->out, "eval(K[%ld], scope)", datum(c, form));
+}
+
+static void c_if(aot_ctx *c, value form) {
+  value args = cdr(form);
+
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS) {
+    c_eval(c, form);
+    return;
+  }
+
+  fputs("(aot_true(", c->out);
+  c_expr(c, car(args));
+  fputs(") ? ", c->out);
+  c_expr(c, cadr(args));
+  fputs(" : ", c->out);
+
+  if (cddr(args)->type == TYPE_CONS)
+    c_expr(c, car(cddr(args)));
+  else
+    fputs("value_new_nil()", c->out);
+
+  fputs(")", c->out);
+}
+
+static void c_clauses(aot_ctx *c, value clauses) {
+  if (clauses->type != TYPE_CONS) {
+    fputs("value_new_nil()", c->out);
+    return;
+  }
+
+  value clause = car(clauses);
+  value test = car(clause);
+
+  if (test->type == TYPE_SYMBOL && strcmp(test->sym, "else") == 0) {
+    c_sequence(c, cdr(clause));
+    return;
+  }
+
+  fputs("(aot_true(", c->out);
+  c_expr(c, test);
+  fputs(") ? ", c->out);
+  c_sequence(c, cdr(clause));
+  fputs(" : ", c->out);
+  c_clauses(c, cdr(clauses));
+  fputs(")", c->out);
+}
+
+static void c_cond(aot_ctx *c, value form) {
+  for (value cl = cdr(form); cl->type == TYPE_CONS; cl = cdr(cl))
+    if (car(cl)->type != TYPE_CONS) {
+      c_eval(c, form);
+      return;
+    }
+
+  c_clauses(c, cdr(form));
+}
+
+// and stops at the first false value, or at the first true one
+static void c_and_or(aot_ctx *c, value args, int is_and) {
+  if (args->type != TYPE_CONS) {
+    fprintf(c->out, "value_new_bool(%d)", is_and);
+    return;
+  }
+
+  long t = c->temps++;
+
+  fprintf(c->out, "({ value t%ld = ", t);
+  c_expr(c, car(args));
+  fprintf(c->out, "; %saot_true(t%ld) ? t%ld : ", is_and ? "!" : "", t, t);
+  c_and_or(c, cdr(args), is_and);
+  fputs("; })", c->out);
+}
+
+static void c_call(aot_ctx *c, value form) {
+  value head = car(form);
+  long n = 0;
+
+  for (value a = cdr(form); a->type == TYPE_CONS; a = cdr(a))
+    n++;
+
+  long t = c->temps;
+
+  c->temps += n + 1;
+
+  fprintf(c->out, "({ value t%ld = ", t);
+  c_expr(c, head);
+
+  long i = 0;
+
+  for (value a = cdr(form); a->type == TYPE_CONS; a = cdr(a), i++) {
+    fprintf(c->out, "; value t%ld = ", t + 1 + i);
+    c_expr(c, car(a));
+  }
+
+  fputs("; ", c->out);
+
+  long arity = -1;
+  long def = head->type == TYPE_SYMBOL && list_index(head, c->params) < 0
+                 ? def_index(c, head, &arity)
+                 : -1;
+
+  // Direct while the name still holds the procedure of this module
+  if (def >= 0 && arity == n) {
+    fprintf(c->out, "t%ld == V[%ld] ? f%ld(", t, def, def);
+
+    for (i = 0; i < n; i++)
+      fprintf(c->out, "%st%ld", i ? ", " : "", t + 1 + i);
+
+    fputs(") : ", c->out);
+  }
+
+  if (n == 2) {
+    fprintf(c->out, "aot_apply2(t%ld, t%ld, t%ld, G); })", t, t + 1, t + 2);
+    return;
+  }
+
+  fprintf(c->out, "aot_apply(t%ld, %ld, ", t, n);
+
+  if (n == 0) {
+    fputs("NULL", c->out);
+  } else {
+    fputs("(value[]){", c->out);
+
+    for (i = 0; i < n; i++)
+      fprintf(c->out, "%st%ld", i ? ", " : "", t + 1 + i);
+
+    fputs("}", c->out);
+  }
+
+  fputs(", G); })", c->out);
+}
+
+static void c_expr(aot_ctx *c, value form) {
+  switch (form->type) {
+  case TYPE_SYMBOL: {
+    long i = list_index(form, c->params);
+
+    if (i >= 0)
+      fprintf(c->out, "p%ld", i);
+    else
+      fprintf(c->out, "env_lookup_site(G, S[%ld])", site(c, form));
+
+    return;
+  }
+
+  case TYPE_CONS:
+    break;
+
+  default:
+    fprintf(c->out, "K[%ld]", datum(c, form));
+    return;
+  }
+
+  value head = car(form);
+  value args = cdr(form);
+
+  if (head->type != TYPE_SPECIAL)
+    c_call(c, form);
+  else if (is_special(head, "quote") && args->type == TYPE_CONS)
+    fprintf(c->out, "K[%ld]", datum(c, car(args)));
+  else if (is_special(head, "if"))
+    c_if(c, form);
+  else if (is_special(head, "cond"))
+    c_cond(c, form);
+  else if (is_special(head, "begin"))
+    c_sequence(c, args);
+  else if (is_special(head, "and"))
+    c_and_or(c, args, 1);
+  else if (is_special(head, "or"))
+    c_and_or(c, args, 0);
+  else
+    c_eval(c, form);
+}
+
+// Whether define appears in form other than quoted
+static int defines(value form) {
+  if (is_special(form, "define"))
+    return 1;
+
+  if (form->type != TYPE_CONS || is_special(car(form), "quote"))
+    return 0;
+
+  for (; form->type == TYPE_CONS; form = cdr(form))
+    if (defines(car(form)))
+      return 1;
+
+  return 0;
+}
+
+// (define (name . params) . body) the compiler takes, its arity or -1
+static long compiled_arity(value form) {
+  if (form->type != TYPE_CONS || !is_special(car(form), "define") ||
+      cdr(form)->type != TYPE_CONS || cadr(form)->type != TYPE_CONS ||
+      car(cadr(form))->type != TYPE_SYMBOL || defines(cddr(form)))
+    return -1;
+
+  long n = 0;
+  value p = cdr(cadr(form));
+
+  for (; p->type == TYPE_CONS; p = cdr(p), n++)
+    if (car(p)->type != TYPE_SYMBOL || list_index(car(p), cdr(p)) >= 0)
+      return -1;
+
+  return p->type == TYPE_NIL ? n : -1;
+}
+
+static void c_string(FILE *out, const char *text) {
+  fputc('"', out);
+
+  for (; *text; text++)
+    if (*text == '"' || *text == '\\')
+      fprintf(out, "\\%c", *text);
+    else if (*text == '\n')
+      fputs("\\n", out);
+    else
+      fputc(*text, out);
+
+  fputc('"', out);
+}
+
+static void c_params(FILE *out, long n) {
+  if (n == 0)
+    fputs("void", out);
+
+  for (long i = 0; i < n; i++)
+    fprintf(out, "%svalue p%ld", i ? ", " : "", i);
+}
+
+// The C function for form, defs has it already
+static void c_function(aot_ctx *c, FILE *out, value form, long index) {
+  value name = car(cadr(form));
+  value params = cdr(cadr(form));
+  long n = compiled_arity(form);
+  char *body;
+  size_t len;
+
+  c->params = params;
+  c->scope = 0;
+  c->temps = 0;
+  c->out = open_memstream(&body, &len);
+  c_sequence(c, cddr(form));
+  fclose(c->out);
+
+  fprintf(out, "// %s\nstatic value f%ld(", name->sym, index);
+  c_params(out, n);
+  fputs(") {\n", out);
+
+  if (c->scope) {
+    fprintf(out, "  env scope = aot_scope(G, K[%ld], %ld, ", datum(c, params),
+            n);
+
+    if (n == 0) {
+      fputs("NULL", out);
+    } else {
+      fputs("(value[]){", out);
+
+      for (long i = 0; i < n; i++)
+        fprintf(out, "%sp%ld", i ? ", " : "", i);
+
+      fputs("}", out);
+    }
+
+    fputs(");\n\n", out);
+  }
+
+  fprintf(out, "  return %s;\n}\n\n", body);
+  free(body);
+
+  fprintf(out, "static value f%ld_apply(value args, env e) {\n", index);
+
+  if (n == 0) {
+    fprintf(out, "  return f%ld();\n}\n\n", index);
+    return;
+  }
+
+  fprintf(out, "  value a[%ld];\n\n  aot_args(args, %ld, a, ", n, n);
+  c_string(out, name->sym);
+  fprintf(out, ");\n  return f%ld(", index);
+
+  for (long i = 0; i < n; i++)
+    fprintf(out, "%sa[%ld]", i ? ", " : "", i);
+
+  fputs(");\n}\n\n", out);
+}
+
+// Tables are built newest first, entries are written from index 0
+static void c_table(FILE *out, const char *fn, const char *table, value list,
+                    long count) {
+  if (list->type != TYPE_CONS)
+    return;
+
+  c_table(out, fn, table, cdr(list), count - 1);
+  fprintf(out, "  %s[%ld] = %s(", table, count - 1, fn);
+  c_string(out, car(list)->type == TYPE_STRING ? car(list)->string
+                                               : car(list)->sym);
+  fputs(");\n", out);
+}
+
+const char *aot_compile(const char *source, const char *target) {
+  reader in = reader_open_file(source);
+
+  if (!in)
+    repl_error("compile-to-c: could not open '%s'", source);
+
+  value forms = parse_all(in);
+
+  reader_close(in);
+
+  aot_ctx c = {.sites = value_new_nil(),
+               .data = value_new_nil(),
+               .defs = value_new_nil()};
+
+  // Every procedure first, so calls can go direct whatever the order
+  for (value f = forms; f->type == TYPE_CONS; f = cdr(f)) {
+    long n = compiled_arity(car(f));
+
+    if (n >= 0) {
+      mpq_ptr q = num_exact_new();
+
+      mpq_set_si(q, n, 1);
+      c.defs = value_new_cons(
+          value_new_cons(car(cadr(car(f))), value_new_exact(q)), c.defs);
+      c.ndefs++;
+    }
+  }
+
+  char *functions;
+  size_t len;
+  FILE *out = open_memstream(&functions, &len);
+  long def = 0;
+
+  for (value f = forms; f->type == TYPE_CONS; f = cdr(f))
+    if (compiled_arity(car(f)) >= 0)
+      c_function(&c, out, car(f), def++);
+
+  // Top level in order, once the tables are filled in
+  fputs("value letlisp_init(env e) {\n  value result = value_new_nil();\n\n"
+        "  G = e;\n  init_tables();\n\n",
+        out);
+  def = 0;
+
+  for (value f = forms; f->type == TYPE_CONS; f = cdr(f)) {
+    if (compiled_arity(car(f)) >= 0) {
+      fprintf(out, "  result = V[%ld] = aot_define(e, ", def);
+      c_string(out, car(cadr(car(f)))->sym);
+      fprintf(out, ", f%ld_apply);\n", def);
+      def++;
+      continue;
+    }
+
+    fprintf(out, "  result = eval(K[%ld], e);\n", datum(&c, car(f)));
+  }
+
+  fputs("\n  return result;\n}\n", out);
+  fclose(out);
+
+  FILE *file = fopen(target, "w");
+
+  if (!file) {
+    free(functions);
+    repl_error("compile-to-c: could not write '%s'", target);
+  }
+
+  fprintf(file, "// Compiled from %s by letlisp compile-to-c\n", source);
+  fputs("#include \"aot.h\"\n\nAOT_MODULE;\n\nstatic env G;\n", file);
+  fprintf(file, "static value S[%ld];\nstatic value K[%ld];\n", c.nsites + 1,
+          c.ndata + 1);
+  fprintf(file, "static value V[%ld];\n\n", c.ndefs + 1);
+
+  for (long i = 0; i < c.ndefs; i++) {
+    long n = 0;
+    long d = c.ndefs;
+
+    for (value l = c.defs; l->type == TYPE_CONS; l = cdr(l))
+      if (--d == i)
+        n = mpz_get_si(mpq_numref(cdar(l)->num_exact));
+
+    fprintf(file, "static value f%ld(", i);
+    c_params(file, n);
+    fputs(");\n", file);
+  }
+
+  fputs("\nstatic void init_tables(void) {\n", file);
+  c_table(file, "aot_site", "S", c.sites, c.nsites);
+  c_table(file, "aot_datum", "K", c.data, c.ndata);
+  fputs("}\n\n", file);
+
+  fputs(functions, file);
+  free(functions);
+
+  if (fclose(file) != 0)
+    repl_error("compile-to-c: could not write '%s'", target);
+
+  return target;
+}
+
+char *aot_path(const char *source, const char *ext) {
+  const char *slash = strrchr(source, '/');
+  const char *dot = strrchr(source, '.');
+  size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - source)
+                                                 : strlen(source);
+  char *path = gcx_malloc(stem + strlen(ext) + 1);
+
+  memcpy(path, source, stem);
+  strcpy(path + stem, ext);
+
+  return path;
+}
+
+// s in single quotes for the shell
+static void shell_quote(FILE *out, const char *s) {
+  fputc('\'', out);
+
+  for (; *s; s++)
+    if (*s == '\'')
+      fputs("'\\''", out);
+    else
+      fputc(*s, out);
+
+  fputc('\'', out);
+}
+
+// Headers for generated code, those of a letlisp not installed yet come
+// from the tree it was built in
+static const char *aot_include(void) {
+  const char *dir = getenv("LETLISP_INCLUDE");
+
+  if (dir && *dir)
+    return dir;
+
+  if (access(LETLISP_INCLUDE "/aot.h", R_OK) == 0)
+    return LETLISP_INCLUDE;
+
+  return LETLISP_BUILD_INCLUDE;
+}
+
+const char *aot_build(const char *source, const char *target) {
+  const char *c_file = aot_compile(source, aot_path(target, ".c"));
+  const char *cc = getenv("LETLISP_CC");
+  char *command;
+  size_t len;
+  FILE *out = open_memstream(&command, &len);
+
+  fprintf(out, "%s -shared -fPIC -O2 %s -I", cc ? cc : LETLISP_CC,
+          LETLISP_CC_FLAGS);
+  shell_quote(out, aot_include());
+  fputs(" -o ", out);
+  shell_quote(out, target);
+  fputc(' ', out);
+  shell_quote(out, c_file);
+  fclose(out);
+
+  int status = system(command);
+
+  free(command);
+
+  if (status != 0)
+    repl_error("compile: C compiler failed on '%s'", c_file);
+
+  return target;
+}
@@ -0,0 +1,83 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "env.h"
+#include "eval.h"
+#include "value.h"
+
+/**
+ * Compiled modules
+ *
+ * compile-to-c translates a source file into C for a shared object that
+ * is loaded back with load. Every (define (name . params) body...) at top
+ * level becomes a C function bound to name as a builtin, everything else
+ * at top level is evaluated by the interpreter when the module is loaded,
+ * in order with the definitions.
+ *
+ * In compiled bodies parameters are C variables, if, cond, and, or and
+ * begin are C control flow and global references go through site caches
+ * like interpreted ones. Calls of procedures of the same module still
+ * bound to them are direct C calls, two argument arithmetic and
+ * comparisons of the global builtins use the fast paths of jit.h. Forms
+ * the compiler does not handle, let and lambda among them, are evaluated
+ * by the interpreter in a scope binding the parameters. Procedures with
+ * internal defines or a rest parameter are left to the interpreter whole.
+ *
+ * A compiled procedure requires all its arguments. Its direct calls are
+ * not seen by trace or profile, and save-image refuses an environment
+ * holding one. A module loaded into another environment than before is
+ * loaded from a copy, so its globals and tables are those of the
+ * environment it was loaded into. The modules loaded are not synchronized.
+ *
+ * Generated code includes this header, installed with letlisp, and refers
+ * back to the symbols of the letlisp binary, which exports them for it.
+ * LETLISP_CC and LETLISP_INCLUDE override the compiler and the directory
+ * of the header.
+ */
+
+// Bumped whenever compiled modules must be rebuilt
+#define AOT_ABI (1000 + sizeof(struct value_s))
+
+#define AOT_MODULE const unsigned long letlisp_abi = AOT_ABI
+
+// Write C for source to target, returns target
+const char *aot_compile(const char *source, const char *target);
+
+// Compile source to C next to target, then to the shared object target
+const char *aot_build(const char *source, const char *target);
+
+// Whether filename is a shared object
+int aot_is_shared(const char *filename);
+
+// Run the definitions and forms of a compiled module in e
+value aot_load(const char *filename, env e);
+
+// source with its extension replaced by ext
+char *aot_path(const char *source, const char *ext);
+
+/**
+ * Runtime of generated code
+ */
+static inline int aot_true(value v) {
+  return v->type != TYPE_BOOL || v->boolean;
+}
+
+// Global reference site for name, kept alive with the module
+value aot_site(const char *name);
+
+// The one datum in text, kept alive with the module
+value aot_datum(const char *text);
+
+// Binds fn to name in e as a builtin, returns the value
+value aot_define(env e, const char *name, function fn);
+
+// The n arguments of a call of name into argv, or an error
+void aot_args(value args, long n, value *argv, const char *name);
+
+// Scope of params bound to argv for forms evaluated by the interpreter
+env aot_scope(env e, value params, long n, value *argv);
+
+value aot_apply(value fn, long n, value *argv, env e);
+value aot_apply2(value fn, value a, value b, env e);
+
+#endif
@@ -3,11 +3,18 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "aot.h"
 #include "builtin.h"
 #include "env.h"
+#include "eval.h"
+#include "fasl.h"
+#include "memory.h"
 #include "numbers.h"
 #include "repl.h"
+#include "thread.h"
+#include "trace.h"
 #include "value.h"
 
 /**
@@ -35,6 +42,9 @@ value builtin_add(value args, env e) {
 }
 
 value builtin_sub(value args, env e) {
+  if (args->type != TYPE_CONS)
+    repl_error("sub: expects at least one number");
+
   value first = car(args);
   value rest = cdr(args);
 
@@ -84,6 +94,9 @@ value builtin_mult(value args, env e) {
 }
 
 value builtin_div(value args, env e) {
+  if (args->type != TYPE_CONS)
+    repl_error("div: expects at least one number");
+
   value first = car(args);
   value rest = cdr(args);
 
@@ -92,8 +105,11 @@ value builtin_div(value args, env e) {
   if (first->type != TYPE_NUM_EXACT)
     repl_error("div: expects number");
 
-  // unary: negate
+  // unary: invert
   if (rest->type == TYPE_NIL) {
+    if (mpq_sgn(first->num_exact) == 0)
+      repl_error("div: division by zero");
+
     mpq_inv(result, first->num_exact);
     return value_new_exact(result);
   }
@@ -106,6 +122,9 @@ value builtin_div(value args, env e) {
     if (v->type != TYPE_NUM_EXACT)
       repl_error("div: expects number");
 
+    if (mpq_sgn(v->num_exact) == 0)
+      repl_error("div: division by zero");
+
     mpq_div(result, result, v->num_exact);
   }
 
@@ -151,7 +170,8 @@ int bool_isnumber(value args, env e) {
 }
 
 value builtin_isnumber(value args, env e) {
-  assert(args->type == TYPE_CONS);
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_NIL)
+    repl_error("number? takes exactly one argument");
 
   return value_new_bool(bool_isnumber(car(args), e));
 }
@@ -218,6 +238,42 @@ value builtin_lequ(value args, env e) {
   return value_new_bool(1);
 }
 
+// Chain test shared by < > >=, ok tells which mpq_cmp signs may continue
+static value compare_chain(value args, env e, const char *name,
+                           int (*ok)(int)) {
+  for (; args->type == TYPE_CONS; args = cdr(args)) {
+    if (!bool_isnumber(car(args), e))
+      repl_error("%s: arguments must be numbers", name);
+
+    if (cdr(args)->type != TYPE_CONS)
+      break;
+
+    if (!bool_isnumber(cadr(args), e))
+      repl_error("%s: arguments must be numbers", name);
+
+    if (!ok(mpq_cmp(car(args)->num_exact, cadr(args)->num_exact)))
+      return value_new_bool(0);
+  }
+
+  return value_new_bool(1);
+}
+
+static int is_less(int cmp) { return cmp < 0; }
+static int is_greater(int cmp) { return cmp > 0; }
+static int is_gequ(int cmp) { return cmp >= 0; }
+
+value builtin_less(value args, env e) {
+  return compare_chain(args, e, "<", is_less);
+}
+
+value builtin_greater(value args, env e) {
+  return compare_chain(args, e, ">", is_greater);
+}
+
+value builtin_gequ(value args, env e) {
+  return compare_chain(args, e, ">=", is_gequ);
+}
+
 value builtin_load(value args, env e) {
   if (args->type != TYPE_CONS)
     repl_error("load need at least one argument");
@@ -236,6 +292,56 @@ value builtin_load(value args, env e) {
   return value_new_bool(1);
 }
 
+// (compile-file source [target])
+value builtin_compile_file(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_STRING)
+    repl_error("compile-file takes a source file name");
+
+  const char *source = car(args)->string;
+  const char *target = fasl_path(source);
+
+  if (cdr(args)->type == TYPE_CONS) {
+    if (cadr(args)->type != TYPE_STRING || cddr(args)->type != TYPE_NIL)
+      repl_error("compile-file: target must be a file name");
+
+    target = cadr(args)->string;
+  }
+
+  return value_new_string((char *)fasl_compile(source, target));
+}
+
+// (compile-to-c source [target])
+value builtin_compile_to_c(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_STRING)
+    repl_error("compile-to-c takes a source file name");
+
+  const char *source = car(args)->string;
+  const char *target = aot_path(source, ".c");
+
+  if (cdr(args)->type == TYPE_CONS) {
+    if (cadr(args)->type != TYPE_STRING || cddr(args)->type != TYPE_NIL)
+      repl_error("compile-to-c: target must be a file name");
+
+    target = cadr(args)->string;
+  }
+
+  return value_new_string((char *)aot_compile(source, target));
+}
+
+value builtin_save_image(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_STRING ||
+      cdr(args)->type != TYPE_NIL)
+    repl_error("save-image takes a file name");
+
+  // The whole global environment, whatever scope we are called from
+  while (e->parent)
+    e = e->parent;
+
+  image_save(car(args)->string, e);
+
+  return car(args);
+}
+
 value builtin_cons(value args, env e) {
   if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS)
     repl_error("cons takes two arguments");
@@ -269,6 +375,24 @@ value builtin_cdr(value args, env e) {
 // Fist lisp voodo :)
 value builtin_list(value args, env e) { return args; }
 
+value builtin_set_car(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS ||
+      car(args)->type != TYPE_CONS)
+    repl_error("set-car! takes a pair and a value");
+
+  car(car(args)) = cadr(args);
+  return value_new_bool(1);
+}
+
+value builtin_set_cdr(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS ||
+      car(args)->type != TYPE_CONS)
+    repl_error("set-cdr! takes a pair and a value");
+
+  cdr(car(args)) = cadr(args);
+  return value_new_bool(1);
+}
+
 value builtin_display(value args, env e) {
   if (args->type != TYPE_CONS)
     repl_error("display need at least one argument");
@@ -287,6 +411,19 @@ value builtin_display(value args, env e) {
   return value_new_bool(1);
 }
 
+// Any values, separated by spaces, then a newline
+value builtin_print(value args, env e) {
+  for (; args->type == TYPE_CONS; args = cdr(args)) {
+    value_print(car(args));
+
+    if (cdr(args)->type == TYPE_CONS)
+      printf(" ");
+  }
+
+  printf("\n");
+  return value_new_bool(1);
+}
+
 value builtin_newline(value args, env e) {
   printf("\n");
 
@@ -311,6 +448,41 @@ value builtin_debugenv(value args, env e) {
   return value_new_bool(1);
 }
 
+// Both arguments must be integers, d non zero
+static void integer_args(value args, env e, const char *name) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS ||
+      cddr(args)->type != TYPE_NIL)
+    repl_error("%s takes exactly two arguments", name);
+
+  for (value a = args; a->type == TYPE_CONS; a = cdr(a))
+    if (!bool_isnumber(car(a), e) ||
+        mpz_cmp_ui(mpq_denref(car(a)->num_exact), 1) != 0)
+      repl_error("%s: arguments must be integers", name);
+
+  if (mpq_sgn(cadr(args)->num_exact) == 0)
+    repl_error("%s: division by zero", name);
+}
+
+value builtin_quotient(value args, env e) {
+  integer_args(args, e, "quotient");
+
+  mpq_ptr q = num_exact_new();
+
+  mpz_tdiv_q(mpq_numref(q), mpq_numref(car(args)->num_exact),
+             mpq_numref(cadr(args)->num_exact));
+  return value_new_exact(q);
+}
+
+value builtin_remainder(value args, env e) {
+  integer_args(args, e, "remainder");
+
+  mpq_ptr r = num_exact_new();
+
+  mpz_tdiv_r(mpq_numref(r), mpq_numref(car(args)->num_exact),
+             mpq_numref(cadr(args)->num_exact));
+  return value_new_exact(r);
+}
+
 value builtin_eq_pred(value args, env e) {
   if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS ||
       cddr(args)->type != TYPE_NIL)
@@ -335,8 +507,72 @@ char *base_exact_to_string(mpq_t number, int base) {
   return mpq_get_str(NULL, base, number);
 }
 
+value builtin_not(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_NIL)
+    repl_error("not takes exactly one argument");
+
+  return value_new_bool(!bool_istrue(car(args), e));
+}
+
+// Proper lists, the hare catches the tortoise on circular ones
+value builtin_list_pred(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_NIL)
+    repl_error("list? takes exactly one argument");
+
+  value slow = car(args);
+  value fast = car(args);
+
+  for (;;) {
+    if (fast->type != TYPE_CONS || cdr(fast)->type != TYPE_CONS)
+      break;
+
+    fast = cddr(fast);
+    slow = cdr(slow);
+
+    if (fast == slow)
+      return value_new_bool(0);
+  }
+
+  if (fast->type == TYPE_CONS)
+    fast = cdr(fast);
+
+  return value_new_bool(fast->type == TYPE_NIL);
+}
+
+value builtin_string_length(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_STRING ||
+      cdr(args)->type != TYPE_NIL)
+    repl_error("string-length takes one string");
+
+  mpq_ptr len = num_exact_new();
+
+  mpq_set_ui(len, strlen(car(args)->string), 1);
+  return value_new_exact(len);
+}
+
+value builtin_string_append(value args, env e) {
+  size_t len = 0;
+
+  for (value a = args; a->type == TYPE_CONS; a = cdr(a)) {
+    if (car(a)->type != TYPE_STRING)
+      repl_error("string-append takes strings as arguments");
+
+    len += strlen(car(a)->string);
+  }
+
+  char *string = gcx_malloc(len + 1);
+  char *p = string;
+
+  *p = '\0';
+
+  for (; args->type == TYPE_CONS; args = cdr(args))
+    p = stpcpy(p, car(args)->string);
+
+  return value_new_string(string);
+}
+
 value builtin_number_to_string(value args, env e) {
-  if (!bool_isnumber(car(args), e))
+  if (args->type != TYPE_CONS || !bool_isnumber(car(args), e))
     repl_error("number->string: takes 1 or 2 numbers as arguments");
 
   int base = 10;
@@ -362,45 +598,270 @@ value builtin_number_to_string(value args, env e) {
   return value_new_string(string);
 }
 
+// (name . n) for stats alists
+static value stat_pair(const char *name, unsigned long n) {
+  mpq_ptr num = num_exact_new();
+
+  mpq_set_ui(num, n, 1);
+
+  return value_new_cons(value_new_symbol(name), value_new_exact(num));
+}
+
+static value named_list(const char *name, value list) {
+  return value_new_cons(value_new_symbol(name), list);
+}
+
+// Builtins live in the outermost scope, under their own names
+static value global_bindings(env e) {
+  while (e->parent)
+    e = e->parent;
+
+  return e->bindings;
+}
+
+value builtin_eval_stats(value args, env e) {
+  if (args->type == TYPE_CONS) {
+    if (cdr(args)->type != TYPE_NIL)
+      repl_error("eval-stats takes at most one argument");
+
+    eval_stats.enabled = bool_istrue(car(args), e);
+  }
+
+  value evals = value_new_nil();
+
+  for (int i = TYPE_COUNT - 1; i >= 0; i--)
+    if (eval_stats.evals[i])
+      evals = value_new_cons(stat_pair(value_type_name(i), eval_stats.evals[i]),
+                             evals);
+
+  value specials = value_new_nil();
+
+  for (int i = 0; special_name(i) != NULL; i++)
+    if (eval_stats.specials[i])
+      specials = value_new_cons(
+          stat_pair(special_name(i), eval_stats.specials[i]), specials);
+
+  value builtins = value_new_nil();
+
+  for (value bind = global_bindings(e); bind->type == TYPE_CONS;
+       bind = cdr(bind)) {
+    value fn = cdar(bind);
+
+    if (fn->type == TYPE_FUNCTION && fn->fn_calls &&
+        strcmp(caar(bind)->sym, fn->fn_name) == 0)
+      builtins = value_new_cons(stat_pair(fn->fn_name, fn->fn_calls), builtins);
+  }
+
+  // Average bindings compared per lookup, as an exact ratio
+  mpq_ptr average = num_exact_new();
+
+  if (eval_stats.env_lookups) {
+    mpq_set_ui(average, eval_stats.env_steps, eval_stats.env_lookups);
+    mpq_canonicalize(average);
+  }
+
+  value result = value_new_cons(
+      stat_pair("conses",
+                value_alloc_count(TYPE_CONS) - eval_stats.cons_base),
+      value_new_nil());
+
+  result = value_new_cons(
+      value_new_cons(value_new_symbol("env-chain-average"),
+                     value_new_exact(average)),
+      result);
+  result =
+      value_new_cons(stat_pair("env-chain-walked", eval_stats.env_steps), result);
+  result =
+      value_new_cons(stat_pair("site-cache-misses", eval_stats.site_misses),
+                     result);
+  result =
+      value_new_cons(stat_pair("site-cache-hits", eval_stats.site_hits), result);
+  result =
+      value_new_cons(stat_pair("env-lookups", eval_stats.env_lookups), result);
+  result = value_new_cons(named_list("builtins", builtins), result);
+  result =
+      value_new_cons(stat_pair("builtin-calls", eval_stats.builtin_calls), result);
+  result = value_new_cons(
+      stat_pair("frames-pushed", eval_stats.frames_pushed), result);
+  result = value_new_cons(
+      stat_pair("native-applications", eval_stats.jit_calls), result);
+  result = value_new_cons(
+      stat_pair("closure-applications", eval_stats.closure_calls), result);
+  result = value_new_cons(named_list("specials", specials), result);
+  result = value_new_cons(named_list("evaluations", evals), result);
+  result = value_new_cons(value_new_cons(value_new_symbol("enabled"),
+                                         value_new_bool(eval_stats.enabled)),
+                          result);
+
+  return result;
+}
+
+value builtin_reset_eval_stats(value args, env e) {
+  if (args->type != TYPE_NIL)
+    repl_error("reset-eval-stats takes no arguments");
+
+  int enabled = eval_stats.enabled;
+
+  memset(&eval_stats, 0, sizeof(eval_stats));
+  eval_stats.enabled = enabled;
+  eval_stats.cons_base = value_alloc_count(TYPE_CONS);
+
+  for (value bind = global_bindings(e); bind->type == TYPE_CONS;
+       bind = cdr(bind))
+    if (cdar(bind)->type == TYPE_FUNCTION)
+      cdar(bind)->fn_calls = 0;
+
+  return value_new_bool(1);
+}
+
+value builtin_trace_dump(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_STRING ||
+      cdr(args)->type != TYPE_NIL)
+    repl_error("trace-dump takes a file name");
+
+  if (!trace_write_chrome(car(args)->string))
+    repl_error("trace-dump: could not write '%s'", car(args)->string);
+
+  return car(args);
+}
+
+value builtin_trace_dump_folded(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_STRING ||
+      cdr(args)->type != TYPE_NIL)
+    repl_error("trace-dump-folded takes a file name");
+
+  if (!trace_write_folded(car(args)->string))
+    repl_error("trace-dump-folded: could not write '%s'", car(args)->string);
+
+  return car(args);
+}
+
+// Script name and its arguments, set once by main
+static value command_line;
+
+void builtins_set_command_line(int argc, char **argv) {
+  command_line = value_new_nil();
+
+  for (int i = argc - 1; i >= 0; i--)
+    command_line =
+        value_new_cons(value_new_string(strdup(argv[i])), command_line);
+}
+
+value builtin_command_line(value args, env e) {
+  if (args->type != TYPE_NIL)
+    repl_error("command-line takes no arguments");
+
+  return command_line ? command_line : value_new_nil();
+}
+
+value builtin_gc_stats(value args, env e) {
+  mem_stats stats;
+
+  mem_get_stats(&stats);
+
+  // Per type allocations as a nested alist
+  value allocs = value_new_nil();
+
+  for (int i = TYPE_COUNT - 1; i >= 0; i--)
+    allocs = value_new_cons(
+        stat_pair(value_type_name(i), value_alloc_count(i)), allocs);
+
+  value result = value_new_cons(
+      value_new_cons(value_new_symbol("allocations"), allocs), value_new_nil());
+
+  result =
+      value_new_cons(stat_pair("pause-max-us", stats.pause_max_us), result);
+  result =
+      value_new_cons(stat_pair("pause-total-us", stats.pause_total_us), result);
+  result = value_new_cons(stat_pair("collections", stats.collections), result);
+  result =
+      value_new_cons(stat_pair("allocated-bytes", stats.total_bytes), result);
+  result = value_new_cons(stat_pair("free-bytes", stats.free_bytes), result);
+  result = value_new_cons(stat_pair("heap-size", stats.heap_size), result);
+
+  return result;
+}
+
 struct builtin_functions {
   char *name;
   function fn;
+  int pure; // result depends on the arguments alone, no side effects
 };
 
 struct builtin_functions startup[] = {
-    {"+", builtin_add},
-    {"-", builtin_sub},
-    {"*", builtin_mult},
-    {"/", builtin_div},
-    {"true?", builtin_true_pred},
-    {"null?", builtin_null_pred},
-    {"pair?", builtin_pair_pred},
-    {"number?", builtin_isnumber},
-    {"number->string", builtin_number_to_string},
+    {"+", builtin_add, 1},
+    {"-", builtin_sub, 1},
+    {"*", builtin_mult, 1},
+    {"/", builtin_div, 1},
+    {"quotient", builtin_quotient, 1},
+    {"remainder", builtin_remainder, 1},
+    {"true?", builtin_true_pred, 1},
+    {"null?", builtin_null_pred, 1},
+    {"pair?", builtin_pair_pred, 1},
+    {"number?", builtin_isnumber, 1},
+    {"number->string", builtin_number_to_string, 1},
     {"eq?", builtin_eq_pred},
-    {"<=", builtin_lequ},
-    {"=", builtin_equ},
+    {"<=", builtin_lequ, 1},
+    {"<", builtin_less, 1},
+    {">", builtin_greater, 1},
+    {">=", builtin_gequ, 1},
+    {"not", builtin_not, 1},
+    {"list?", builtin_list_pred, 1},
+    {"string-length", builtin_string_length, 1},
+    {"string-append", builtin_string_append, 1},
+    {"=", builtin_equ, 1},
     {"load", builtin_load},
+    {"compile-file", builtin_compile_file},
+    {"compile-to-c", builtin_compile_to_c},
+    {"save-image", builtin_save_image},
     {"cons", builtin_cons},
-    {"car", builtin_car},
-    {"cdr", builtin_cdr},
+    {"car", builtin_car, 1},
+    {"cdr", builtin_cdr, 1},
+    {"set-car!", builtin_set_car},
+    {"set-cdr!", builtin_set_cdr},
     {"list", builtin_list},
     {"display", builtin_display},
     {"newline", builtin_newline},
+    {"print", builtin_print},
     {"debug", builtin_debug},
     {"debugenv", builtin_debugenv},
+    {"gc-stats", builtin_gc_stats},
+    {"command-line", builtin_command_line},
+    {"eval-stats", builtin_eval_stats},
+    {"reset-eval-stats", builtin_reset_eval_stats},
+    {"trace-dump", builtin_trace_dump},
+    {"trace-dump-folded", builtin_trace_dump_folded},
+    {"spawn", builtin_spawn},
+    {"yield", builtin_yield},
+    {"join", builtin_join},
+    {"make-channel", builtin_make_channel},
+    {"channel-send", builtin_channel_send},
+    {"channel-receive", builtin_channel_receive},
     {NULL, NULL}};
 
+function builtin_lookup(const char *name) {
+  for (int i = 0; startup[i].name != NULL; i++)
+    if (strcmp(startup[i].name, name) == 0)
+      return startup[i].fn;
+
+  return NULL;
+}
+
+int builtin_is_pure(function fn) {
+  for (int i = 0; startup[i].name != NULL; i++)
+    if (startup[i].fn == fn)
+      return startup[i].pure;
+
+  return 0;
+}
+
 env builtins_startup(env e) {
 
   for (int i = 0; startup[i].name != NULL; i++) {
 
-    // To void #include loop's
-    value symbol = value_alloc(TYPE_SYMBOL);
-    value function = value_alloc(TYPE_FUNCTION);
+    value symbol = value_new_symbol(startup[i].name);
+    value function = value_new_function(startup[i].name, startup[i].fn);
 
-    symbol->sym = startup[i].name;
-    function->fn = startup[i].fn;
     env_set(e, symbol, function);
   }
 
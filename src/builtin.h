@@ -9,4 +9,13 @@ int bool_istrue(value args, env e);
 
 env builtins_startup(env e);
 
+// Strings returned by (command-line), the script name first
+void builtins_set_command_line(int argc, char **argv);
+
+// C function of a builtin, NULL if there is none by that name
+function builtin_lookup(const char *name);
+
+// Whether fn can be applied ahead of time to constant arguments
+int builtin_is_pure(function fn);
+
 #endif
@@ -1,7 +1,11 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "builtin.h"
 #include "env.h"
+#include "eval.h"
 #include "memory.h"
 #include "repl.h"
 #include "value.h"
@@ -9,31 +13,231 @@
 /**
  * Environment
  *
- * All env modifications are done by prepending, first occurence of symbol in
- * the alist is the symbols value in that context
+ * Local scopes are alists that are only prepended to, first occurence of
+ * symbol in the alist is the symbols value in that context. They are short,
+ * die young and belong to the thread that made the call, so they need no
+ * synchronization.
  *
- * Todo: Do I need to remove duplicates? (later, later)
+ * The global scope lives as long as the process, holds every builtin and is
+ * shared by all threads, so it also gets a hash table from symbol to its
+ * (symbol . value) pair. A redefinition updates the pair in place, the
+ * alist never grows duplicates and a pair, once found, stays the symbol's
+ * global binding for good.
+ *
+ * Lookups never lock. Definitions are serialized by globals_lock and only
+ * publish fully built objects with release stores: a new pair into an
+ * empty slot, a new value into a pair, or a grown table in place of the
+ * old one, which is left as it was for readers still probing it. Slots go
+ * from empty to a pair and never back, so a probe always terminates.
  */
-struct env_s {
-  env parent;     // Outer scope environment (NULL for global)
-  value bindings; // alist of (symbol . value) pairs for this scope
+struct env_table {
+  value *slots; // binding pairs, NULL if empty
+  size_t cap;   // power of two
+  size_t count;
 };
 
+static atomic_flag globals_lock = ATOMIC_FLAG_INIT;
+
+static inline void globals_acquire() {
+  while (atomic_flag_test_and_set_explicit(&globals_lock, memory_order_acquire))
+    sched_yield();
+}
+
+static inline void globals_release() {
+  atomic_flag_clear_explicit(&globals_lock, memory_order_release);
+}
+
+#define LOAD(place) __atomic_load_n(&(place), __ATOMIC_ACQUIRE)
+#define PUBLISH(place, v) __atomic_store_n(&(place), (v), __ATOMIC_RELEASE)
+
 env env_new(env parent) {
   env e = gcx_malloc(sizeof(struct env_s));
 
   e->parent = parent;
   e->bindings = value_new_nil();
+  e->table = NULL;
   return e;
 }
 
+// Symbols are interned, their address is the key
+static inline size_t table_hash(value sym) {
+  uint64_t h = (uintptr_t)sym;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+// Slot holding the pair of sym, or the empty slot where it goes
+static value *table_slot(struct env_table *t, value sym, unsigned long *steps) {
+  size_t i = table_hash(sym) & (t->cap - 1);
+
+  for (;;) {
+    value pair = LOAD(t->slots[i]);
+
+    (*steps)++;
+
+    if (!pair || car(pair) == sym)
+      return t->slots + i;
+
+    i = (i + 1) & (t->cap - 1);
+  }
+}
+
+// A copy of t with room for one more pair, t itself is left untouched
+static struct env_table *table_grow(struct env_table *t) {
+  struct env_table *bigger = gcx_malloc(sizeof(struct env_table));
+  unsigned long steps = 0;
+
+  bigger->cap = t && t->cap ? t->cap * 2 : 512;
+  bigger->count = t ? t->count : 0;
+  bigger->slots = gcx_malloc(bigger->cap * sizeof(value));
+  memset(bigger->slots, 0, bigger->cap * sizeof(value));
+
+  for (size_t i = 0; t && i < t->cap; i++)
+    if (t->slots[i])
+      *table_slot(bigger, car(t->slots[i]), &steps) = t->slots[i];
+
+  return bigger;
+}
+
+/**
+ * Built on first use, so a global env whose bindings were filled in
+ * directly, as image_load does, gets one too. Older images may hold
+ * shadowed duplicates, the first pair is the live one. Caller holds
+ * globals_lock.
+ */
+static struct env_table *global_table_build(env e) {
+  struct env_table *t = table_grow(NULL);
+  unsigned long steps = 0;
+
+  for (value bind = e->bindings; bind->type == TYPE_CONS; bind = cdr(bind)) {
+    if (2 * (t->count + 1) > t->cap)
+      t = table_grow(t);
+
+    value *slot = table_slot(t, caar(bind), &steps);
+
+    if (!*slot) {
+      *slot = car(bind);
+      t->count++;
+    }
+  }
+
+  PUBLISH(e->table, t);
+  return t;
+}
+
+static struct env_table *global_table(env e) {
+  struct env_table *t = LOAD(e->table);
+
+  if (t)
+    return t;
+
+  globals_acquire();
+
+  t = e->table ? e->table : global_table_build(e);
+
+  globals_release();
+  return t;
+}
+
+static void global_set(env e, value sym, value val) {
+  globals_acquire();
+
+  struct env_table *t = e->table ? e->table : global_table_build(e);
+  unsigned long steps = 0;
+  value *slot = table_slot(t, sym, &steps);
+
+  // Redefinition, reference sites caching this pair see the new value
+  if (*slot) {
+    PUBLISH(cdr(*slot), val);
+    globals_release();
+    return;
+  }
+
+  value pair = value_new_cons(sym, val);
+
+  // Keep the load under 1/2
+  if (2 * (t->count + 1) > t->cap) {
+    t = table_grow(t);
+    slot = table_slot(t, sym, &steps);
+  }
+
+  t->count++;
+  PUBLISH(*slot, pair);
+  PUBLISH(e->table, t);
+  PUBLISH(e->bindings, value_new_cons(pair, e->bindings));
+
+  globals_release();
+}
+
+static value frame_cons(value car, value cdr) {
+  value v = frame_alloc(value_size(TYPE_CONS));
+
+  v->type = TYPE_CONS;
+  car(v) = car;
+  cdr(v) = cdr;
+  return v;
+}
+
 void env_set(env e, value sym, value val) {
+  if (!e->parent) {
+    global_set(e, sym, val);
+    return;
+  }
+
+  // Scopes in the frame region keep their bindings there too
+  if (frame_owns(e)) {
+    e->bindings = frame_cons(frame_cons(sym, val), e->bindings);
+    return;
+  }
+
   // New
   value pair = value_new_cons(sym, val);
 
   e->bindings = value_new_cons(pair, e->bindings);
 }
 
+/**
+ * Local definitions
+ *
+ * Closures share the binding pairs of the variables they capture, see
+ * env_capture. A define updates the pair already bound in its scope, so
+ * closures made earlier see the new value. Names a body defines are
+ * declared when its scope is made, closures referring to a helper defined
+ * further down capture the pair it will be assigned to. A declared but
+ * unassigned pair is invisible to lookups, as if not bound yet.
+ */
+static const struct value_s unassigned_obj = {.type = TYPE_NIL};
+
+#define UNASSIGNED ((value)&unassigned_obj)
+
+// Pair binding sym in scope e itself, declared or not
+static value scope_pair(env e, value sym) {
+  for (value bind = e->bindings; bind->type == TYPE_CONS; bind = cdr(bind))
+    if (caar(bind) == sym)
+      return car(bind);
+
+  return NULL;
+}
+
+void env_define(env e, value sym, value val) {
+  value pair = e->parent ? scope_pair(e, sym) : NULL;
+
+  if (pair)
+    cdr(pair) = val;
+  else
+    env_set(e, sym, val);
+}
+
+void env_declare(env e, value sym) {
+  // A parameter of the same name is what the define will update
+  if (!scope_pair(e, sym))
+    env_set(e, sym, UNASSIGNED);
+}
+
 env env_extend(env parent, value params, value args) {
   env e = env_new(parent);
 
@@ -45,17 +249,92 @@ env env_extend(env parent, value params, value args) {
   return e;
 }
 
-value env_exists(env e, const char *name) {
-  for (; e != NULL; e = e->parent)
-    for (value bind = e->bindings; bind->type == TYPE_CONS; bind = cdr(bind)) {
-      value pair = car(bind);
+env env_push(env parent, value params, value args) {
+  env e = frame_alloc(sizeof(struct env_s));
+
+  e->parent = parent;
+  e->bindings = value_new_nil();
+
+  while (params->type == TYPE_CONS && args->type == TYPE_CONS) {
+    env_set(e, car(params), car(args));
+    params = cdr(params);
+    args = cdr(args);
+  }
+  return e;
+}
+
+static value bindings_find(value bind, value sym, unsigned long *steps) {
+  for (; bind->type == TYPE_CONS; bind = cdr(bind)) {
+    (*steps)++;
 
-      if (strcmp(car(pair)->sym, name) == 0) {
-        return pair;
-      }
+    if (caar(bind) == sym && cdar(bind) != UNASSIGNED)
+      return car(bind);
+  }
+
+  return NULL;
+}
+
+/**
+ * Flat closures
+ *
+ * A closure made in a local scope keeps the binding pairs of its free
+ * variables and the global scope, not the chain of frames it was made in.
+ * Free variables that are not bound locally are global references.
+ */
+env env_capture(env e, value syms) {
+  env flat = env_new(NULL);
+
+  for (; syms->type == TYPE_CONS; syms = cdr(syms)) {
+    value *at = &flat->bindings;
+
+    for (env scope = e; scope->parent; scope = scope->parent) {
+      value pair = scope_pair(scope, car(syms));
+
+      if (!pair)
+        continue;
+
+      if (frame_owns(pair))
+        frame_escape();
+
+      *at = value_new_cons(pair, *at);
+      at = &cdr(*at);
+
+      // Until it is assigned the one further out is in effect
+      if (cdr(pair) != UNASSIGNED)
+        break;
     }
+  }
+
+  while (e->parent)
+    e = e->parent;
+
+  if (flat->bindings->type == TYPE_NIL)
+    return e;
 
-  return value_new_nil();
+  flat->parent = e;
+  return flat;
+}
+
+// The pair binding sym, NULL if unbound. Local frames first, then global.
+static value env_find(env e, value sym, unsigned long *steps) {
+  for (; e->parent; e = e->parent) {
+    value pair = bindings_find(e->bindings, sym, steps);
+
+    if (pair)
+      return pair;
+  }
+
+  return LOAD(*table_slot(global_table(e), sym, steps));
+}
+
+value env_exists(env e, const char *name) {
+  unsigned long steps = 0;
+  value pair = env_find(e, value_new_symbol(name), &steps);
+
+  EVAL_COUNT(env_lookups, 1);
+  EVAL_COUNT(env_steps, steps);
+
+  return pair ? pair : value_new_nil();
 }
 
 value env_lookup(env e, const char *name) {
@@ -64,7 +343,72 @@ value env_lookup(env e, const char *name) {
   if (bool_isnil(v, e))
     repl_error("Unbound symbol: %s\n", name);
 
-  return cdr(v);
+  return LOAD(cdr(v));
+}
+
+value env_lookup_symbol(env e, value sym) {
+  unsigned long steps = 0;
+  value pair = env_find(e, sym, &steps);
+
+  EVAL_COUNT(env_lookups, 1);
+  EVAL_COUNT(env_steps, steps);
+
+  if (!pair)
+    repl_error("Unbound symbol: %s\n", sym->sym);
+
+  return LOAD(cdr(pair));
+}
+
+/**
+ * Reference site caches
+ *
+ * A cons of code whose car is a symbol is a reference site, see
+ * value_code. Other conses are looked up without a cache. Local frames are
+ * searched as usual, there are few of them and they are short. When the
+ * search reaches the global environment the site remembers the binding
+ * pair it found. Global pairs are updated in place and never removed, so
+ * a cached pair stays valid as long as the site still refers to the same
+ * symbol. Code can be shared between threads, so the cache is read and
+ * filled like a global slot.
+ */
+value env_lookup_site(env e, value site) {
+  value sym = car(site);
+  unsigned long steps = 0;
+
+  for (; e->parent; e = e->parent) {
+    value pair = bindings_find(e->bindings, sym, &steps);
+
+    if (pair) {
+      EVAL_COUNT(env_lookups, 1);
+      EVAL_COUNT(env_steps, steps);
+      return cdr(pair);
+    }
+  }
+
+  struct code_s *code = code_of(site);
+  value cell = code ? LOAD(code->site_cell) : NULL;
+
+  if (cell && car(cell) == sym) {
+    EVAL_COUNT(site_hits, 1);
+    EVAL_COUNT(env_lookups, 1);
+    EVAL_COUNT(env_steps, steps);
+    return LOAD(cdr(cell));
+  }
+
+  cell = LOAD(*table_slot(global_table(e), sym, &steps));
+
+  EVAL_COUNT(site_misses, 1);
+  EVAL_COUNT(env_lookups, 1);
+  EVAL_COUNT(env_steps, steps);
+
+  if (!cell)
+    repl_error("Unbound symbol: %s\n", sym->sym);
+
+  // Threads filling the same site store the same pair
+  if (code)
+    PUBLISH(code->site_cell, cell);
+
+  return LOAD(cdr(cell));
 }
 
 void env_dump(env e) {
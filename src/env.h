@@ -7,11 +7,37 @@ typedef struct value_s *value;
 
 typedef struct env_s *env;
 
+struct env_table;
+
+struct env_s {
+  env parent;     // Outer scope environment (NULL for global)
+  value bindings; // alist of (symbol . value) pairs for this scope
+  struct env_table *table; // Global only, symbol to its pair in bindings
+};
+
 env env_new(env e);
 void env_set(env e, value sym, value val);
+
+// Like env_set, but an existing binding in the same scope is updated
+void env_define(env e, value sym, value val);
+
+// Bind sym in e ahead of its definition, lookups skip it until then
+void env_declare(env e, value sym);
+
+// Scope sharing just the local bindings of syms in e, over the global one
+env env_capture(env e, value syms);
 value env_lookup(env e, const char *name);
+value env_lookup_symbol(env e, value sym);
 value env_exists(env e, const char *name);
+
+// Value of the symbol in car(site), global bindings are cached in a site
+// of code
+value env_lookup_site(env e, value site);
+
 void env_dump(env e);
 env env_extend(env parent, value params, value args);
 
+// Same, in the frame region, see frame_mark and frame_release
+env env_push(env parent, value params, value args);
+
 #endif
@@ -0,0 +1,1439 @@
+#include <assert.h>
+#include <gmp.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "builtin.h"
+#include "env.h"
+#include "eval.h"
+#include "jit.h"
+#include "memory.h"
+#include "module.h"
+#include "numbers.h"
+#include "profile.h"
+#include "repl.h"
+#include "trace.h"
+#include "value.h"
+
+/**
+ *  Numbers and utilities
+ */
+mpq_ptr num_exact_new() {
+  mpq_ptr new = gcx_malloc(sizeof(mpq_t));
+
+  mpq_init(new);
+
+  return new;
+}
+
+/**
+ * Base evalation
+ */
+eval_counters eval_stats;
+
+/**
+ * Evaluate car(cell)
+ *
+ * Used wherever code is evaluated out of a list, so a variable reference
+ * has its cons as a site for env_lookup_site to cache the global binding in.
+ */
+static inline value eval_car(value cell, env e) {
+  value v = car(cell);
+
+  if (v->type == TYPE_SYMBOL) {
+    EVAL_COUNT(evals[TYPE_SYMBOL], 1);
+    return env_lookup_site(e, cell);
+  }
+
+  return eval(v, e);
+}
+
+value eval_list(value lst, env e) {
+  value head = value_new_nil();
+  value last = NULL;
+
+  for (; lst->type == TYPE_CONS; lst = cdr(lst)) {
+    value cell = value_new_cons(eval_car(lst, e), value_new_nil());
+
+    if (last)
+      cdr(last) = cell;
+    else
+      head = cell;
+
+    last = cell;
+  }
+
+  return head;
+}
+
+/**
+ * Body analysis
+ *
+ * Done the first time a lambda or let body is evaluated and kept on its
+ * first cons, when that is code: (free-variables defined-names makes-closures . jit-state).
+ * Free variables are what a closure over the body captures, the names the
+ * body defines in its own scope are declared when the scope is made, see
+ * env_declare. A scope whose body makes no closures can not be referred to
+ * once the body returns and goes in the frame region. The jit state is a
+ * jit_state, not a value, see jit.h.
+ */
+// The form_info cache of a cons of code, NULL for anything else
+static inline value form_info(value v) {
+  struct code_s *code = code_of(v);
+
+  return code ? __atomic_load_n(&code->form_info, __ATOMIC_ACQUIRE) : NULL;
+}
+
+// Threads racing here store equal results
+static inline void form_info_set(value v, value info) {
+  struct code_s *code = code_of(v);
+
+  if (code)
+    __atomic_store_n(&code->form_info, info, __ATOMIC_RELEASE);
+}
+
+static inline value info_free(value info) { return car(info); }
+static inline value info_defines(value info) { return cadr(info); }
+static inline int info_closures(value info) {
+  return car(cddr(info))->boolean;
+}
+static inline jit_state *info_jit(value info) {
+  return (jit_state *)cdr(cddr(info));
+}
+
+static int memq(value sym, value list) {
+  for (; list->type == TYPE_CONS; list = cdr(list))
+    if (car(list) == sym)
+      return 1;
+
+  return 0;
+}
+
+static value adjoin(value sym, value list) {
+  return memq(sym, list) ? list : value_new_cons(sym, list);
+}
+
+static int is_form(value head, const char *name) {
+  return head->type == TYPE_SPECIAL && strcmp(head->sym, name) == 0;
+}
+
+// Names bound by a parameter list, proper or dotted
+static value param_names(value params) {
+  value names = value_new_nil();
+
+  for (; params->type == TYPE_CONS; params = cdr(params))
+    names = adjoin(car(params), names);
+
+  if (params->type == TYPE_SYMBOL)
+    names = adjoin(params, names);
+
+  return names;
+}
+
+static value let_names(value bindings) {
+  value names = value_new_nil();
+
+  for (; bindings->type == TYPE_CONS; bindings = cdr(bindings))
+    if (car(bindings)->type == TYPE_CONS)
+      names = adjoin(caar(bindings), names);
+
+  return names;
+}
+
+// Names defined by form in the scope it is evaluated in
+static value defined_names(value form, value names) {
+  if (form->type != TYPE_CONS)
+    return names;
+
+  value head = car(form);
+
+  // These evaluate nothing, or evaluate in a scope of their own
+  if (is_form(head, "quote") || is_form(head, "lambda") ||
+      is_form(head, "let"))
+    return names;
+
+  if (is_form(head, "define") && cdr(form)->type == TYPE_CONS) {
+    value target = cadr(form);
+
+    if (target->type == TYPE_CONS)
+      return adjoin(car(target), names);
+
+    names = adjoin(target, names);
+    form = cdr(form);
+  }
+
+  for (; form->type == TYPE_CONS; form = cdr(form))
+    names = defined_names(car(form), names);
+
+  return names;
+}
+
+// Whether evaluating form can make a closure
+static int makes_closures(value form) {
+  if (form->type != TYPE_CONS)
+    return 0;
+
+  value head = car(form);
+
+  if (is_form(head, "quote"))
+    return 0;
+
+  if (is_form(head, "lambda"))
+    return 1;
+
+  if (is_form(head, "define") && cdr(form)->type == TYPE_CONS &&
+      cadr(form)->type == TYPE_CONS)
+    return 1;
+
+  for (; form->type == TYPE_CONS; form = cdr(form))
+    if (makes_closures(car(form)))
+      return 1;
+
+  return 0;
+}
+
+static value lambda_info(value params, value body);
+static value let_info(value bindings, value body);
+
+// Adds the free variables of a nested body that are not bound here
+static value free_nested(value info, value bound, value free) {
+  for (value syms = info_free(info); syms->type == TYPE_CONS; syms = cdr(syms))
+    if (!memq(car(syms), bound))
+      free = adjoin(car(syms), free);
+
+  return free;
+}
+
+static value free_variables(value form, value bound, value free) {
+  if (form->type == TYPE_SYMBOL)
+    return memq(form, bound) ? free : adjoin(form, free);
+
+  if (form->type != TYPE_CONS)
+    return free;
+
+  value head = car(form);
+  value args = cdr(form);
+
+  if (is_form(head, "quote"))
+    return free;
+
+  if (args->type == TYPE_CONS) {
+    if (is_form(head, "lambda"))
+      return free_nested(lambda_info(car(args), cdr(args)), bound, free);
+
+    if (is_form(head, "define") && car(args)->type == TYPE_CONS)
+      return free_nested(lambda_info(cdar(args), cdr(args)), bound, free);
+
+    if (is_form(head, "let")) {
+      for (value b = car(args); b->type == TYPE_CONS; b = cdr(b))
+        if (car(b)->type == TYPE_CONS)
+          free = free_variables(cdar(b), bound, free);
+
+      return free_nested(let_info(car(args), cdr(args)), bound, free);
+    }
+  }
+
+  for (; form->type == TYPE_CONS; form = cdr(form))
+    free = free_variables(car(form), bound, free);
+
+  return free;
+}
+
+static value body_analyze(value bound, value body) {
+  value defines = value_new_nil();
+  value free = value_new_nil();
+
+  for (value form = body; form->type == TYPE_CONS; form = cdr(form))
+    defines = defined_names(car(form), defines);
+
+  for (value d = defines; d->type == TYPE_CONS; d = cdr(d))
+    bound = adjoin(car(d), bound);
+
+  for (value form = body; form->type == TYPE_CONS; form = cdr(form))
+    free = free_variables(car(form), bound, free);
+
+  int closures = 0;
+
+  for (value form = body; form->type == TYPE_CONS; form = cdr(form))
+    closures |= makes_closures(car(form));
+
+  jit_state *jit = gcx_malloc(sizeof(jit_state));
+
+  value info = value_new_cons(
+      free, value_new_cons(defines, value_new_cons(value_new_bool(closures),
+                                                   (value)jit)));
+
+  form_info_set(body, info);
+
+  return info;
+}
+
+static inline value body_info(value body) { return form_info(body); }
+
+static value lambda_info(value params, value body) {
+  value info = body_info(body);
+
+  return info ? info : body_analyze(param_names(params), body);
+}
+
+static value let_info(value bindings, value body) {
+  value info = body_info(body);
+
+  return info ? info : body_analyze(let_names(bindings), body);
+}
+
+static inline void declare_defines(value info, env e) {
+  for (value d = info_defines(info); d->type == TYPE_CONS; d = cdr(d))
+    env_declare(e, car(d));
+}
+
+/**
+ * Constant folding
+ *
+ * Run over a lambda body once, when it is first evaluated. Calls of pure
+ * builtins on constant arguments are replaced by their result, if and cond
+ * branches ruled out by a constant test are dropped, and let variables
+ * bound to a constant are replaced by it in the body. A name counts as a
+ * builtin only if no enclosing scope binds it.
+ *
+ * Whatever relied on the global binding of a builtin is kept behind a
+ * guard, (%fold folded original . dependencies), which folds the original
+ * form again once one of the bindings no longer holds the builtin it held
+ * when folding. Dependencies are (pair . value), global pairs are stable
+ * so this is a pointer compare each.
+ */
+typedef struct {
+  value form;     // folded, guarded code
+  value constant; // its value, NULL if not known
+  value deps;     // what the value relied on, NULL if nothing
+} folded;
+
+static folded fold(value form, value scope, env e);
+static folded fold_let(value form, value scope, env e);
+
+static value list2(value a, value b) {
+  return value_new_code(a, value_new_code(b, value_new_nil()));
+}
+
+// Whether every global binding still holds what it held when folding
+static int deps_hold(value deps) {
+  for (; deps->type == TYPE_CONS; deps = cdr(deps))
+    if (cdr(caar(deps)) != cdar(deps))
+      return 0;
+
+  return 1;
+}
+
+static value deps_union(value a, value b) {
+  if (!a)
+    return b;
+
+  for (; b && b->type == TYPE_CONS; b = cdr(b))
+    a = value_new_cons(car(b), a);
+
+  return a;
+}
+
+static value guarded(value form, value original, value deps) {
+  if (!deps || deps->type != TYPE_CONS)
+    return form;
+
+  return value_new_code(value_new_symbol("%fold"),
+                        value_new_code(form, value_new_code(original, deps)));
+}
+
+static folded fold_constant(value v, value original, value deps) {
+  value form = v;
+
+  // Anything not evaluating to itself is quoted
+  if (v->type != TYPE_NUM_EXACT && v->type != TYPE_NIL &&
+      v->type != TYPE_BOOL && v->type != TYPE_STRING)
+    form = list2(value_new_symbol("quote"), v);
+
+  return (folded){.form = guarded(form, original, deps),
+                  .constant = v,
+                  .deps = deps};
+}
+
+/**
+ * Scopes are lists of (symbol . known), known is NULL for a variable and
+ * (constant . deps) for a let variable bound to a constant.
+ */
+static value scope_bind(value scope, value sym, value known) {
+  return value_new_cons(value_new_cons(sym, known), scope);
+}
+
+static value scope_bind_all(value scope, value syms) {
+  for (; syms->type == TYPE_CONS; syms = cdr(syms))
+    scope = scope_bind(scope, car(syms), NULL);
+
+  return scope;
+}
+
+static value scope_find(value scope, value sym) {
+  for (; scope->type == TYPE_CONS; scope = cdr(scope))
+    if (caar(scope) == sym)
+      return car(scope);
+
+  return NULL;
+}
+
+static env global_of(env e) {
+  while (e->parent)
+    e = e->parent;
+
+  return e;
+}
+
+// Whatever the scopes of e bind is a variable to the code made there
+static value scope_of(env e) {
+  value scope = value_new_nil();
+
+  for (; e->parent; e = e->parent)
+    for (value bind = e->bindings; bind->type == TYPE_CONS; bind = cdr(bind))
+      scope = scope_bind(scope, caar(bind), NULL);
+
+  return scope;
+}
+
+static value fold_list(value list, value scope, env e) {
+  value head = value_new_nil();
+  value *tail = &head;
+
+  for (; list->type == TYPE_CONS; list = cdr(list)) {
+    *tail = value_new_code(fold(car(list), scope, e).form, value_new_nil());
+    tail = &cdr(*tail);
+  }
+
+  // A dotted tail, not evaluated
+  *tail = list;
+  return head;
+}
+
+// Body forms with the names they define as variables
+static value fold_body(value body, value scope, env e) {
+  value defines = value_new_nil();
+
+  for (value form = body; form->type == TYPE_CONS; form = cdr(form))
+    defines = defined_names(car(form), defines);
+
+  return fold_list(body, scope_bind_all(scope, defines), e);
+}
+
+// (params . body) folded, marked so it is not folded again
+static value fold_lambda_args(value params, value body, value scope, env e) {
+  scope = scope_bind_all(scope, param_names(params));
+
+  value args = value_new_code(params, fold_body(body, scope, e));
+
+  form_info_set(args, args);
+  return args;
+}
+
+// Applies a pure builtin to constant arguments, NULL if it fails
+static value fold_apply(value fn, value args, env e) {
+  value volatile result = NULL;
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+  repl_quiet++;
+
+  if (setjmp(repl_env) == 0)
+    result = fn->fn(args, e);
+
+  repl_quiet--;
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+
+  return result;
+}
+
+/**
+ * Inlining
+ *
+ * A call of a small global procedure is replaced by its body, in a let
+ * binding its parameters to the arguments, then folded on like any let.
+ * Constant arguments and local variables are substituted into the body
+ * instead of bound.
+ * Only procedures made at top level qualify, without internal defines or
+ * closures, that do not call themselves and whose free variables are not
+ * bound where the call is. The body is guarded on the global binding of
+ * the procedure like a folded builtin. Inlined calls are not seen by
+ * profile and trace.
+ */
+#define INLINE_SIZE 32 // conses in the body of an inlined procedure
+#define INLINE_DEPTH 4 // inlined bodies inlining further
+
+static _Thread_local int inline_depth;
+
+// Conses in form, counting stops at limit
+static int form_size(value form, int limit) {
+  int n = 0;
+
+  for (; form->type == TYPE_CONS && n < limit; form = cdr(form))
+    n += 1 + form_size(car(form), limit - n);
+
+  return n;
+}
+
+// Whether the variable sym is referred to in form
+static int occurs(value form, value sym) {
+  if (form == sym)
+    return 1;
+
+  if (form->type != TYPE_CONS || is_form(car(form), "quote"))
+    return 0;
+
+  // Dependencies of a guard are not code
+  if (is_form(car(form), "%fold") && cdr(form)->type == TYPE_CONS &&
+      cddr(form)->type == TYPE_CONS)
+    return occurs(cadr(form), sym) || occurs(car(cddr(form)), sym);
+
+  for (; form->type == TYPE_CONS; form = cdr(form))
+    if (occurs(car(form), sym))
+      return 1;
+
+  return form == sym;
+}
+
+static value substitute(value form, value sym, value arg);
+
+static value substitute_list(value list, value sym, value arg) {
+  if (list->type != TYPE_CONS)
+    return list;
+
+  return value_new_code(substitute(car(list), sym, arg),
+                        substitute_list(cdr(list), sym, arg));
+}
+
+// form with the variable sym replaced by the form arg
+static value substitute(value form, value sym, value arg) {
+  if (form == sym)
+    return arg;
+
+  if (form->type != TYPE_CONS)
+    return form;
+
+  value head = car(form);
+  value args = cdr(form);
+
+  if (is_form(head, "quote"))
+    return form;
+
+  if (is_form(head, "%fold") && args->type == TYPE_CONS &&
+      cdr(args)->type == TYPE_CONS)
+    return value_new_code(
+        head, value_new_code(substitute(car(args), sym, arg),
+                             value_new_code(substitute(cadr(args), sym, arg),
+                                            cddr(args))));
+
+  if (is_form(head, "let") && args->type == TYPE_CONS) {
+    value bindings = value_new_nil();
+    value *tail = &bindings;
+
+    for (value b = car(args); b->type == TYPE_CONS; b = cdr(b)) {
+      *tail = value_new_code(car(b)->type == TYPE_CONS
+                                 ? value_new_code(caar(b),
+                                                  substitute_list(
+                                                      cdar(b), sym, arg))
+                                 : car(b),
+                             value_new_nil());
+      tail = &cdr(*tail);
+    }
+
+    // Unless the let binds sym itself
+    value info = let_info(car(args), cdr(args));
+    value body = memq(sym, let_names(car(args))) ||
+                         memq(sym, info_defines(info))
+                     ? cdr(args)
+                     : substitute_list(cdr(args), sym, arg);
+
+    return value_new_code(head, value_new_code(bindings, body));
+  }
+
+  return substitute_list(form, sym, arg);
+}
+
+/**
+ * Whether arg can stand in for a parameter everywhere in body: a constant,
+ * or a local variable body has no name for.
+ */
+static int substitutes(value arg, value body, value scope) {
+  switch (arg->type) {
+  case TYPE_NUM_EXACT:
+  case TYPE_NIL:
+  case TYPE_BOOL:
+  case TYPE_STRING:
+    return 1;
+
+  case TYPE_SYMBOL:
+    return scope_find(scope, arg) && !occurs(body, arg);
+
+  case TYPE_CONS:
+    return is_form(car(arg), "quote");
+
+  default:
+    return 0;
+  }
+}
+
+// The call form with arguments forms inlined, form is NULL if it can't be
+static folded fold_inline(value form, value forms, value pair, value scope,
+                          env e) {
+  value fn = cdr(pair);
+  value params = fn->clo.params;
+  value body = fn->clo.body;
+  folded none = {.form = NULL};
+
+  // A body from another global, a library, means other things there
+  if (fn->clo.e != global_of(e) || body->type != TYPE_CONS ||
+      inline_depth >= INLINE_DEPTH ||
+      form_size(body, INLINE_SIZE) >= INLINE_SIZE)
+    return none;
+
+  value info = lambda_info(params, body);
+
+  // eval could name the parameters
+  if (info_defines(info)->type != TYPE_NIL || info_closures(info) ||
+      memq(car(form), info_free(info)) ||
+      memq(value_new_symbol("eval"), info_free(info)))
+    return none;
+
+  for (value s = info_free(info); s->type == TYPE_CONS; s = cdr(s))
+    if (scope_find(scope, car(s)))
+      return none;
+
+  // ((param arg) ...) for the arguments not substituted, as many
+  // arguments as parameters
+  value bindings = value_new_nil();
+  value *tail = &bindings;
+  value a = forms;
+
+  for (; params->type == TYPE_CONS && a->type == TYPE_CONS;
+       params = cdr(params), a = cdr(a)) {
+    if (car(params)->type != TYPE_SYMBOL)
+      return none;
+
+    if (substitutes(car(a), body, scope)) {
+      body = substitute_list(body, car(params), car(a));
+      continue;
+    }
+
+    *tail = value_new_code(list2(car(params), car(a)), value_new_nil());
+    tail = &cdr(*tail);
+  }
+
+  if (params->type != TYPE_NIL || a->type != TYPE_NIL)
+    return none;
+
+  inline_depth++;
+
+  folded inlined;
+
+  if (bindings->type != TYPE_NIL)
+    inlined = fold_let(value_new_code(value_new_symbol("let"),
+                                      value_new_code(bindings, body)),
+                       scope, e);
+  else if (cdr(body)->type == TYPE_NIL)
+    inlined = fold(car(body), scope, e);
+  else
+    inlined = fold(value_new_code(value_new_symbol("begin"), body), scope, e);
+
+  inline_depth--;
+
+  value deps = value_new_cons(value_new_cons(pair, fn),
+                              inlined.deps ? inlined.deps : value_new_nil());
+
+  if (inlined.constant)
+    return fold_constant(inlined.constant, form, deps);
+
+  return (folded){.form = guarded(inlined.form, form, deps)};
+}
+
+static folded fold_call(value form, value scope, env e) {
+  value head = car(form);
+  value args = value_new_nil(), forms = value_new_nil();
+  value *args_tail = &args, *forms_tail = &forms;
+  value deps = NULL;
+  int constant = 1;
+
+  for (value a = cdr(form); a->type == TYPE_CONS; a = cdr(a)) {
+    folded arg = fold(car(a), scope, e);
+
+    constant &= arg.constant != NULL;
+    deps = deps_union(deps, arg.deps);
+
+    *forms_tail = value_new_code(arg.form, value_new_nil());
+    forms_tail = &cdr(*forms_tail);
+
+    if (constant) {
+      *args_tail = value_new_cons(arg.constant, value_new_nil());
+      args_tail = &cdr(*args_tail);
+    }
+  }
+
+  if (constant && head->type == TYPE_SYMBOL && !scope_find(scope, head)) {
+    value pair = env_exists(e, head->sym);
+
+    if (pair->type == TYPE_CONS && cdr(pair)->type == TYPE_FUNCTION &&
+        builtin_is_pure(cdr(pair)->fn)) {
+      value result = fold_apply(cdr(pair), args, e);
+
+      if (result)
+        return fold_constant(result, form,
+                             value_new_cons(value_new_cons(pair, cdr(pair)),
+                                            deps ? deps : value_new_nil()));
+    }
+  }
+
+  if (head->type == TYPE_SYMBOL && !scope_find(scope, head)) {
+    value pair = env_exists(e, head->sym);
+
+    if (pair->type == TYPE_CONS && cdr(pair)->type == TYPE_CLOSURE) {
+      folded inlined = fold_inline(form, forms, pair, scope, e);
+
+      if (inlined.form)
+        return inlined;
+    }
+  }
+
+  return (folded){.form = value_new_code(fold(head, scope, e).form, forms)};
+}
+
+static folded fold_if(value form, value scope, env e) {
+  value args = cdr(form);
+
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS)
+    return (folded){.form = form};
+
+  folded test = fold(car(args), scope, e);
+
+  if (!test.constant)
+    return (folded){.form = value_new_code(
+                        car(form), value_new_code(test.form,
+                                                  fold_list(cdr(args), scope,
+                                                            e)))};
+
+  value rest = bool_istrue(test.constant, e) ? cdr(args) : cddr(args);
+  folded branch = rest->type == TYPE_CONS
+                      ? fold(car(rest), scope, e)
+                      : fold_constant(value_new_nil(), form, NULL);
+
+  if (branch.constant)
+    return fold_constant(branch.constant, form,
+                         deps_union(test.deps, branch.deps));
+
+  return (folded){.form = guarded(branch.form, form, test.deps)};
+}
+
+static folded fold_cond(value form, value scope, env e) {
+  value clauses = value_new_nil();
+  value *tail = &clauses;
+  value deps = NULL;
+
+  for (value c = cdr(form); c->type == TYPE_CONS; c = cdr(c)) {
+    value clause = car(c);
+
+    if (clause->type != TYPE_CONS)
+      return (folded){.form = form};
+
+    value test = car(clause);
+    value body = fold_list(cdr(clause), scope, e);
+    int last = test->type == TYPE_SYMBOL && strcmp(test->sym, "else") == 0;
+
+    if (!last) {
+      folded t = fold(test, scope, e);
+
+      if (t.constant) {
+        deps = deps_union(deps, t.deps);
+
+        if (!bool_istrue(t.constant, e))
+          continue;
+
+        last = 1;
+      }
+
+      test = t.form;
+    }
+
+    *tail = value_new_code(value_new_code(test, body), value_new_nil());
+    tail = &cdr(*tail);
+
+    if (last)
+      break;
+  }
+
+  if (clauses->type == TYPE_NIL)
+    return fold_constant(value_new_nil(), form, deps);
+
+  return (folded){.form = guarded(value_new_code(car(form), clauses), form,
+                                  deps)};
+}
+
+static folded fold_let(value form, value scope, env e) {
+  value args = cdr(form);
+
+  if (args->type != TYPE_CONS)
+    return (folded){.form = form};
+
+  value defines = value_new_nil();
+
+  for (value b = cdr(args); b->type == TYPE_CONS; b = cdr(b))
+    defines = defined_names(car(b), defines);
+
+  value bindings = value_new_nil();
+  value *tail = &bindings;
+  value inner = scope;
+
+  for (value b = car(args); b->type == TYPE_CONS; b = cdr(b)) {
+    value bind = car(b);
+
+    if (bind->type != TYPE_CONS || cdr(bind)->type != TYPE_CONS)
+      return (folded){.form = form};
+
+    folded val = fold(cadr(bind), scope, e);
+    value known = val.constant && !memq(car(bind), defines)
+                      ? value_new_cons(val.constant, val.deps)
+                      : NULL;
+
+    inner = scope_bind(inner, car(bind), known);
+    *tail = value_new_code(
+        value_new_code(car(bind), value_new_code(val.form, cddr(bind))),
+        value_new_nil());
+    tail = &cdr(*tail);
+  }
+
+  value body = fold_list(cdr(args), scope_bind_all(inner, defines), e);
+
+  return (folded){.form = value_new_code(car(form),
+                                         value_new_code(bindings, body))};
+}
+
+static folded fold(value form, value scope, env e) {
+  switch (form->type) {
+  case TYPE_NUM_EXACT:
+  case TYPE_NIL:
+  case TYPE_BOOL:
+  case TYPE_STRING:
+    return (folded){.form = form, .constant = form};
+
+  case TYPE_SYMBOL: {
+    value entry = scope_find(scope, form);
+
+    if (entry && cdr(entry))
+      return fold_constant(cadr(entry), form, cddr(entry));
+
+    return (folded){.form = form};
+  }
+
+  case TYPE_CONS:
+    break;
+
+  default:
+    return (folded){.form = form};
+  }
+
+  value head = car(form);
+  value args = cdr(form);
+
+  if (head->type != TYPE_SPECIAL)
+    return fold_call(form, scope, e);
+
+  if (is_form(head, "quote"))
+    return args->type == TYPE_CONS
+               ? (folded){.form = form, .constant = car(args)}
+               : (folded){.form = form};
+
+  // Already folded, only a constant still holding is of use
+  if (is_form(head, "%fold")) {
+    folded inner = fold(car(args), scope, e);
+
+    if (inner.constant && deps_hold(cddr(args)))
+      return fold_constant(inner.constant, cadr(args),
+                           deps_union(inner.deps, cddr(args)));
+
+    return (folded){.form = form};
+  }
+
+  if (is_form(head, "if"))
+    return fold_if(form, scope, e);
+
+  if (is_form(head, "cond"))
+    return fold_cond(form, scope, e);
+
+  if (is_form(head, "let"))
+    return fold_let(form, scope, e);
+
+  if (is_form(head, "lambda") && args->type == TYPE_CONS)
+    return (folded){.form = value_new_code(
+                        head, fold_lambda_args(car(args), cdr(args), scope,
+                                               e))};
+
+  // (define name expr), the name is not an expression
+  if (is_form(head, "define") && args->type == TYPE_CONS &&
+      car(args)->type == TYPE_SYMBOL)
+    return (folded){.form = value_new_code(
+                        head, value_new_code(car(args),
+                                             fold_list(cdr(args), scope, e)))};
+
+  // (define (name . params) . body), eval_define looks for the folded
+  // lambda on its arguments
+  if (is_form(head, "define") && args->type == TYPE_CONS &&
+      car(args)->type == TYPE_CONS) {
+    value define_args = value_new_code(car(args), cdr(args));
+
+    form_info_set(define_args,
+                  fold_lambda_args(cdar(args), cdr(args), scope, e));
+
+    return (folded){.form = value_new_code(head, define_args)};
+  }
+
+  return (folded){.form = value_new_code(head, fold_list(args, scope, e))};
+}
+
+/**
+ * (params . body) of a lambda with the body folded, kept on site. The
+ * folded arguments are their own fold, code made by folding is not folded
+ * again.
+ */
+static value lambda_folded(value site, value params, value body, env e) {
+  value args = form_info(site);
+
+  if (args)
+    return args;
+
+  args = fold_lambda_args(params, body, scope_of(e), e);
+  form_info_set(site, args);
+
+  return args;
+}
+
+/**
+ * original folded again for what the globals hold now, kept on original
+ * until that no longer holds either. Whatever e binds locally is a
+ * variable there.
+ */
+static value refolded(value original, env e) {
+  if (original->type != TYPE_CONS)
+    return original;
+
+  value code = form_info(original);
+
+  if (code && (code->type != TYPE_CONS || !is_form(car(code), "%fold") ||
+               deps_hold(cdr(cddr(code)))))
+    return code;
+
+  code = fold(original, scope_of(e), e).form;
+  form_info_set(original, code);
+
+  return code;
+}
+
+// (%fold folded original . dependencies), see Constant folding
+value eval_fold(value args, env e) {
+  if (deps_hold(cddr(args)))
+    return eval_car(args, e);
+
+  return eval(refolded(cadr(args), e), e);
+}
+
+value eval_define(value args, env e) {
+  value sym = car(args);
+
+  // (define symbol expr)
+  if (sym->type == TYPE_SYMBOL) {
+    value val = eval_car(cdr(args), e);
+
+    // Closures take the first name they are defined under
+    if (val->type == TYPE_CLOSURE && !val->clo.name)
+      val->clo.name = sym->sym;
+
+    env_define(e, sym, val);
+    return sym;
+  }
+
+  // define function
+  else if (sym->type == TYPE_CONS) {
+    value func_name = car(sym);
+
+    // TODO: This breaks renaming special forms (dont really care f.n.)
+    if (func_name->type != TYPE_SYMBOL)
+      repl_error("define: function name must be a symbol");
+
+    value params = cdr(sym);
+    value body = cdr(args);
+
+    value lambda_sym = value_new_symbol("lambda");
+    value lambda_expr =
+        value_new_code(lambda_sym, lambda_folded(args, params, body, e));
+
+    value val = eval(lambda_expr, e);
+
+    val->clo.name = func_name->sym;
+    env_define(e, func_name, val);
+    return func_name;
+  }
+
+  repl_error("define: invalid syntax");
+}
+
+value eval_quote(value args, env e) { return car(args); }
+
+value eval_lambda(value args, env e) {
+  if (args->type == TYPE_CONS)
+    args = lambda_folded(args, car(args), cdr(args), e);
+
+  value params = car(args); // first argument
+  value body = cdr(args);   // rest of list
+
+  // Nothing local to capture at top level
+  if (!e->parent)
+    return value_new_closure(params, body, e);
+
+  value free = info_free(lambda_info(params, body));
+
+  return value_new_closure(params, body, env_capture(e, free));
+}
+
+// Applies the closure fn to evaluated args
+static value apply_closure(value fn, value args) {
+  value params = fn->clo.params;
+  value body = fn->clo.body;
+  env closure_env = fn->clo.e;
+
+  value info = lambda_info(params, body);
+  char *mark = frame_mark();
+
+  // Bind params to args
+  env new_env;
+
+  if (info_closures(info)) {
+    new_env = env_extend(closure_env, params, args);
+  } else {
+    new_env = env_push(closure_env, params, args);
+    EVAL_COUNT(frames_pushed, 1);
+  }
+
+  declare_defines(info, new_env);
+
+  // Top level procedures applied often run as native code, see jit.h
+  jit_state *jit = info_jit(info);
+  jit_code code = __atomic_load_n(&jit->code, __ATOMIC_ACQUIRE);
+
+  if (!code && jit_enabled && !closure_env->parent &&
+      ++jit->calls == JIT_THRESHOLD) {
+    jit_compile(jit, fn, info_defines(info));
+    code = __atomic_load_n(&jit->code, __ATOMIC_ACQUIRE);
+  }
+
+  // Evaluate body in new_env
+  value result = value_new_nil();
+
+  const char *name = fn->clo.name ? fn->clo.name : "<lambda>";
+
+  EVAL_COUNT(closure_calls, 1);
+  profile_enter(name);
+  trace_enter(name);
+
+  if (code && !trace_enabled && !closure_env->parent) {
+    EVAL_COUNT(jit_calls, 1);
+    result = code(new_env);
+  } else {
+    while (body->type == TYPE_CONS) {
+      result = eval_car(body, new_env);
+      body = cdr(body);
+    }
+  }
+
+  trace_leave(name);
+  profile_leave();
+  frame_release(mark);
+
+  return result;
+}
+
+value eval_apply_closure(value fn, value arg_exprs, env calling_env) {
+  assert(fn->type == TYPE_CLOSURE);
+
+  // eval args in calling env
+  return apply_closure(fn, eval_list(arg_exprs, calling_env));
+}
+
+static value apply_builtin(value fn, value args, env e) {
+  value result;
+
+  if (eval_stats.enabled) {
+    eval_stats.builtin_calls++;
+    fn->fn_calls++;
+  }
+
+  profile_enter(fn->fn_name);
+  trace_enter(fn->fn_name);
+  result = fn->fn(args, e);
+  trace_leave(fn->fn_name);
+  profile_leave();
+
+  return result;
+}
+
+value eval_apply(value fn, value args, env e) {
+  if (fn->type == TYPE_CLOSURE)
+    return apply_closure(fn, args);
+
+  if (fn->type == TYPE_FUNCTION)
+    return apply_builtin(fn, args, e);
+
+  repl_error("Not a function");
+}
+
+value eval_if(value args, env env) {
+  if (args->type != TYPE_CONS)
+    repl_error("if: missing arguments");
+
+  // Extract then branch
+  if (cdr(args)->type != TYPE_CONS)
+    repl_error("if: missing then branch");
+
+  // Evaluate predicate
+  value cond = eval_car(args, env);
+
+  if (bool_istrue(cond, env))
+    return eval_car(cdr(args), env);
+
+  // Else branch is optional
+  if (cddr(args)->type == TYPE_CONS)
+    return eval_car(cddr(args), env);
+
+  return value_new_nil();
+}
+
+value eval(value v, env e) {
+  EVAL_COUNT(evals[v->type], 1);
+
+  switch (v->type) {
+  case TYPE_NUM_EXACT:
+  case TYPE_NIL:
+  case TYPE_FUNCTION:
+  case TYPE_BOOL:
+  case TYPE_STRING:
+  case TYPE_SPECIAL:
+    return v;
+
+  case TYPE_SYMBOL:
+    return env_lookup_symbol(e, v);
+
+  case TYPE_CONS: {
+    value head = car(v);
+
+    if (head->type == TYPE_SPECIAL)
+      return eval_special(head, cdr(v), e);
+
+    value fn = eval_car(v, e);
+    value args = cdr(v);
+
+    if (fn->type == TYPE_CLOSURE)
+      return eval_apply_closure(fn, args, e);
+
+    if (fn->type == TYPE_FUNCTION)
+      return apply_builtin(fn, eval_list(args, e), e);
+
+    repl_error("Not a function");
+  }
+
+  default:
+    repl_error("Unknown type in eval: %s\n", value_type_name(v->type));
+    exit(1);
+  }
+}
+
+/**
+ * Special forms
+ */
+
+value eval_or(value args, env e) {
+
+  while (args->type == TYPE_CONS) {
+    value result = eval_car(args, e);
+
+    // Short
+    if (result->type != TYPE_BOOL || result->boolean)
+      return result;
+
+    args = cdr(args);
+  }
+
+  return value_new_bool(0);
+}
+
+value eval_and(value args, env e) {
+  while (args->type == TYPE_CONS) {
+    value result = eval_car(args, e);
+
+    // short
+    if (result->type == TYPE_BOOL && !result->boolean)
+      return result;
+
+    args = cdr(args);
+  }
+
+  return value_new_bool(1);
+}
+
+value eval_eval(value args, env env) {
+  if (args->type != TYPE_CONS)
+    repl_error("eval: expected 1 argument");
+
+  value expr = car(args);
+
+  if (cdr(args)->type != TYPE_NIL)
+    repl_error("eval: too many arguments");
+
+  return eval(expr, env);
+}
+
+// Argument list in an unevaled sequence of sexps to eval
+value eval_begin(value args, env e) {
+  value result = value_new_nil();
+
+  for (; args->type == TYPE_CONS; args = cdr(args))
+    result = eval_car(args, e);
+
+  return result;
+}
+
+value eval_cond(value args, env e) {
+  for (; args->type == TYPE_CONS; args = cdr(args)) {
+    value clause = car(args);
+
+    if (clause->type != TYPE_CONS)
+      repl_error("cond: invalid clause");
+
+    value predicate = car(clause);
+
+    if (predicate->type == TYPE_SYMBOL && strcmp(predicate->sym, "else") == 0) {
+      // (else expr1 expr2 ...)
+      return eval_begin(cdr(clause), e);
+    }
+
+    value result = eval_car(clause, e);
+
+    if (bool_istrue(result, e)) {
+      // (predicate expr1 expr2 ...)
+      return eval_begin(cdr(clause), e);
+    }
+  }
+
+  return value_new_nil(); // no clause matched
+}
+
+value eval_let(value args, env e) {
+
+  if (args->type != TYPE_CONS)
+    repl_error("let: missing bindings and body");
+
+  value bindings = car(args);
+  value body = cdr(args);
+
+  if (bindings->type != TYPE_CONS && bindings->type != TYPE_NIL)
+    repl_error("let: bindings must be a list");
+
+  value info = let_info(car(args), body);
+  char *mark = frame_mark();
+  env new_env;
+
+  if (info_closures(info)) {
+    new_env = env_extend(e, value_new_nil(), value_new_nil());
+  } else {
+    new_env = env_push(e, value_new_nil(), value_new_nil());
+    EVAL_COUNT(frames_pushed, 1);
+  }
+
+  // Iterate over bindings
+  for (; bindings->type == TYPE_CONS; bindings = cdr(bindings)) {
+    value bind = car(bindings);
+
+    if (bind->type != TYPE_CONS || cdr(bind)->type != TYPE_CONS ||
+        cddr(bind)->type != TYPE_NIL)
+      repl_error("let: each binding must be (var expr)");
+
+    value var = car(bind);
+
+    if (var->type != TYPE_SYMBOL)
+      repl_error("let: binding variable must be a symbol");
+
+    value val = eval_car(cdr(bind), e); // old environment !!
+
+    env_set(new_env, var, val);
+  }
+
+  declare_defines(info, new_env);
+
+  value result = eval_begin(body, new_env);
+
+  frame_release(mark);
+  return result;
+}
+
+// (profile expr [folded-file]) reports where expr spent its time on stderr
+value eval_profile(value args, env e) {
+  if (args->type != TYPE_CONS)
+    repl_error("profile: missing expression");
+
+  const char *folded = NULL;
+
+  if (cdr(args)->type == TYPE_CONS) {
+    value file = eval(cadr(args), e);
+
+    if (file->type != TYPE_STRING)
+      repl_error("profile: folded stack file must be a string");
+
+    folded = file->string;
+  }
+
+  // Nested, or under --profile, the outer profile gets the samples
+  if (!profile_start())
+    return eval(car(args), e);
+
+  // Stop sampling when an error unwinds past us, then pass it on
+  size_t depth = profile_depth;
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+
+  if (setjmp(repl_env) != 0) {
+    profile_stop();
+    profile_depth = depth;
+    memcpy(repl_env, outer, sizeof(jmp_buf));
+    longjmp(repl_env, 1);
+  }
+
+  value result = eval(car(args), e);
+
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+  profile_stop();
+  profile_report(stderr);
+
+  if (folded && !profile_write_folded(folded))
+    repl_error("profile: could not write '%s'", folded);
+
+  return result;
+}
+
+// (trace expr) reports every call made by expr on stderr
+value eval_trace(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_NIL)
+    repl_error("trace: expected one expression");
+
+  // Nested, or under --trace, the outer trace gets the events
+  if (!trace_start())
+    return eval(car(args), e);
+
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+
+  if (setjmp(repl_env) != 0) {
+    trace_stop();
+    memcpy(repl_env, outer, sizeof(jmp_buf));
+    longjmp(repl_env, 1);
+  }
+
+  value result = eval(car(args), e);
+
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+  trace_stop();
+  trace_report(stderr);
+
+  return result;
+}
+
+static double elapsed_ms(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// (time expr) reports what expr cost on stderr
+value eval_time(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_NIL)
+    repl_error("time: expected one expression");
+
+  struct timespec wall_start, wall_end, cpu_start, cpu_end;
+  mem_stats before, after;
+
+  mem_get_stats(&before);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+  value result = eval(car(args), e);
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+  mem_get_stats(&after);
+
+  fprintf(stderr,
+          ";; time: %.3f ms wall, %.3f ms cpu, %zu bytes allocated, "
+          "%lu collections\n",
+          elapsed_ms(&wall_start, &wall_end), elapsed_ms(&cpu_start, &cpu_end),
+          after.total_bytes - before.total_bytes,
+          after.collections - before.collections);
+
+  return result;
+}
+
+value eval_np(value args, env e) { repl_error("Special form not implemented"); }
+
+static const char *special_forms[] = {
+    "lambda", "define", "quote",          "if",     "or",      "and",
+    "eval",   "begin",  "cond",           "let",    "profile", "time",
+    "trace",  "%fold",  "define-library", "import", NULL};
+
+static const function special_handlers[] = {
+    eval_lambda,           eval_define,  eval_quote, eval_if,
+    eval_or,               eval_and,     eval_eval,  eval_begin,
+    eval_cond,             eval_let,     eval_profile, eval_time,
+    eval_trace,            eval_fold,    module_define_library,
+    module_import};
+
+int is_special(const char *sym) {
+  for (int i = 0; special_forms[i] != NULL; i++)
+    if (strcmp(sym, special_forms[i]) == 0)
+      return 1;
+
+  return 0;
+}
+
+value eval_special(value head, value args, env e) {
+  for (int i = 0; special_forms[i] != NULL; i++)
+    if (strcmp(head->sym, special_forms[i]) == 0) {
+      EVAL_COUNT(specials[i], 1);
+      return special_handlers[i](args, e);
+    }
+
+  repl_error("Unknown special form: %s", head->sym);
+}
+
+const char *special_name(int i) { return special_forms[i]; }
+
+function special_lookup(const char *name) {
+  for (int i = 0; special_forms[i] != NULL; i++)
+    if (strcmp(name, special_forms[i]) == 0)
+      return special_handlers[i];
+
+  return NULL;
+}
+
+env special_startup(env e) {
+  for (int i = 0; special_forms[i] != NULL; i++) {
+    // Interned once, read before or after every environment has the same
+    value sym = value_new_symbol(special_forms[i]);
+
+    if (sym->type != TYPE_SPECIAL)
+      sym = value_new_special(special_forms[i]);
+
+    env_set(e, sym, value_new_function(special_forms[i], special_handlers[i]));
+  }
+
+  return e;
+}
@@ -7,4 +7,47 @@
 value eval_special(value head, value args, env e);
 value eval(value v, env e);
 
+// Applies a closure or builtin to evaluated arguments
+value eval_apply(value fn, value args, env e);
+
+// Bind every special form in e
+env special_startup(env e);
+
+// Handler of a special form, NULL if there is none by that name
+function special_lookup(const char *name);
+
+// Name of special form i, NULL past the last one
+const char *special_name(int i);
+
+/**
+ * Evaluator counters
+ *
+ * Always compiled in, but only counted while enabled. They are not
+ * synchronized, counts from several threads are approximate.
+ */
+#define EVAL_SPECIALS 32
+
+typedef struct {
+  int enabled;
+  unsigned long evals[TYPE_COUNT];       // eval calls by value type
+  unsigned long specials[EVAL_SPECIALS]; // dispatches by special form index
+  unsigned long closure_calls;
+  unsigned long jit_calls; // closure calls run as native code
+  unsigned long frames_pushed; // scopes made in the frame region
+  unsigned long site_hits; // global references served by a site cache
+  unsigned long site_misses;
+  unsigned long builtin_calls; // per builtin in each function value
+  unsigned long env_lookups;
+  unsigned long env_steps; // bindings compared by lookups
+  size_t cons_base;        // cons allocations at the last reset
+} eval_counters;
+
+extern eval_counters eval_stats;
+
+#define EVAL_COUNT(counter, n)                                                 \
+  do {                                                                         \
+    if (eval_stats.enabled)                                                    \
+      eval_stats.counter += (n);                                               \
+  } while (0)
+
 #endif
@@ -0,0 +1,1116 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <gmp.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "eval.h"
+#include "fasl.h"
+#include "memory.h"
+#include "numbers.h"
+#include "parser.h"
+#include "reader.h"
+#include "repl.h"
+
+/**
+ * Layout
+ *
+ * header | symbols | nodes | forms | data
+ *
+ * Values are referenced by 32 bit refs. The low two bits tag them: node
+ * indices, symbol indices and small integers, plus immediate (), #t and #f.
+ * Lists, strings and other numbers are nodes, a list node points to the refs
+ * of its elements and its tail in data.
+ *
+ * Nodes of a form are stored children first and every form is a contiguous
+ * run of nodes ending in its root, so a loader builds one form at a time in
+ * a single forward pass. Sections are 8 byte aligned and in native byte
+ * order.
+ */
+#define FASL_MAGIC "LETFASL"
+#define IMAGE_MAGIC "LETIMG"
+#define FASL_VERSION 3
+#define FASL_BYTE_ORDER 0x01020304u
+
+#define REF_NODE 0
+#define REF_SYMBOL 1
+#define REF_FIXNUM 2
+#define REF_IMMEDIATE 3
+
+#define REF_NIL ((0 << 2) | REF_IMMEDIATE)
+#define REF_TRUE ((1 << 2) | REF_IMMEDIATE)
+#define REF_FALSE ((2 << 2) | REF_IMMEDIATE)
+#define REF_NONE ((3 << 2) | REF_IMMEDIATE) // NULL env
+
+#define REF(index, tag) (((uint32_t)(index) << 2) | (tag))
+#define REF_TAG(ref) ((ref) & 3)
+#define REF_INDEX(ref) ((ref) >> 2)
+
+// Small integers live in the ref itself
+#define FIXNUM_MIN (-(1L << 29))
+#define FIXNUM_MAX ((1L << 29) - 1)
+#define REF_FIXNUM_VALUE(ref) ((long)(int32_t)(ref) >> 2)
+
+#define NODE_MAX (UINT32_MAX >> 2)
+
+enum {
+  FASL_LIST,
+  FASL_FIXNUM,
+  FASL_BIGNUM,
+  FASL_STRING,
+
+  // Images only
+  IMAGE_CONS,
+  IMAGE_CLOSURE,
+  IMAGE_ENV,
+  IMAGE_FUNCTION,
+  IMAGE_CODE // a cons of code, see value_new_code
+};
+
+struct fasl_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t symbols, symbol_count;
+  uint64_t nodes, node_count;
+  uint64_t forms, form_count; // root ref of each form
+  uint64_t data, data_size;
+};
+
+struct fasl_symbol {
+  uint64_t offset; // name in data
+  uint32_t len;
+  uint32_t special; // interned as a special form
+};
+
+struct fasl_node {
+  uint32_t tag;
+  uint32_t a; // list: element count, string/bignum/function: length
+  uint64_t b; // list/string/bignum/function: offset in data, fixnum: value
+              // image cons: a car, b cdr, env: a parent, b bindings
+              // image closure: a name, b offset of params, body and env
+};
+
+// Bignum data, followed by the limb bytes of numerator and denominator
+struct fasl_bignum {
+  uint32_t negative;
+  uint32_t num_len;
+  uint32_t den_len;
+};
+
+/**
+ * Writer
+ */
+typedef struct {
+  struct fasl_node *nodes;
+  size_t node_count, node_cap;
+
+  uint32_t *forms;
+  size_t form_count, form_cap;
+
+  char *data;
+  size_t data_size, data_cap;
+
+  struct fasl_symbol *symbols;
+  size_t symbol_count, symbol_cap;
+
+  // symbol value -> index, open addressing on the pointer
+  value *sym_keys;
+  uint32_t *sym_index;
+  size_t sym_cap;
+} fasl_writer;
+
+static void *grow(void *ptr, size_t *cap, size_t need, size_t size) {
+  if (need <= *cap)
+    return ptr;
+
+  while (*cap < need)
+    *cap = *cap ? *cap * 2 : 256;
+
+  return gcx_realloc(ptr, *cap * size);
+}
+
+static uint32_t emit_node(fasl_writer *w, uint32_t tag, uint32_t a,
+                          uint64_t b) {
+  if (w->node_count >= NODE_MAX)
+    repl_error("compile-file: too many nodes");
+
+  w->nodes = grow(w->nodes, &w->node_cap, w->node_count + 1,
+                  sizeof(struct fasl_node));
+
+  struct fasl_node *n = w->nodes + w->node_count;
+
+  n->tag = tag;
+  n->a = a;
+  n->b = b;
+
+  return REF(w->node_count++, REF_NODE);
+}
+
+// 8 byte aligned, returns the offset within data
+static uint64_t emit_data(fasl_writer *w, const void *bytes, size_t len) {
+  uint64_t offset = w->data_size;
+  size_t padded = (len + 7) & ~(size_t)7;
+
+  w->data = grow(w->data, &w->data_cap, offset + padded, 1);
+  memcpy(w->data + offset, bytes, len);
+  memset(w->data + offset + len, 0, padded - len);
+  w->data_size += padded;
+
+  return offset;
+}
+
+static void symbols_rehash(fasl_writer *w) {
+  size_t cap = w->sym_cap ? w->sym_cap * 2 : 256;
+  value *keys = gcx_malloc(cap * sizeof(value));
+  uint32_t *index = gcx_malloc(cap * sizeof(uint32_t));
+
+  memset(keys, 0, cap * sizeof(value));
+
+  for (size_t i = 0; i < w->sym_cap; i++) {
+    if (!w->sym_keys[i])
+      continue;
+
+    size_t j = ((uintptr_t)w->sym_keys[i] >> 4) & (cap - 1);
+
+    while (keys[j])
+      j = (j + 1) & (cap - 1);
+
+    keys[j] = w->sym_keys[i];
+    index[j] = w->sym_index[i];
+  }
+
+  w->sym_keys = keys;
+  w->sym_index = index;
+  w->sym_cap = cap;
+}
+
+// Each symbol is stored once, symbols are interned so the pointer is the key
+static uint32_t emit_symbol(fasl_writer *w, value sym) {
+  if (2 * (w->symbol_count + 1) > w->sym_cap)
+    symbols_rehash(w);
+
+  size_t j = ((uintptr_t)sym >> 4) & (w->sym_cap - 1);
+
+  while (w->sym_keys[j] && w->sym_keys[j] != sym)
+    j = (j + 1) & (w->sym_cap - 1);
+
+  if (w->sym_keys[j])
+    return REF(w->sym_index[j], REF_SYMBOL);
+
+  if (w->symbol_count >= NODE_MAX)
+    repl_error("compile-file: too many symbols");
+
+  w->symbols = grow(w->symbols, &w->symbol_cap, w->symbol_count + 1,
+                    sizeof(struct fasl_symbol));
+
+  struct fasl_symbol *s = w->symbols + w->symbol_count;
+
+  s->len = strlen(sym->sym);
+  s->offset = emit_data(w, sym->sym, s->len);
+  s->special = sym->type == TYPE_SPECIAL;
+
+  w->sym_keys[j] = sym;
+  w->sym_index[j] = w->symbol_count;
+
+  return REF(w->symbol_count++, REF_SYMBOL);
+}
+
+static uint32_t emit_number(fasl_writer *w, mpq_ptr q) {
+  if (mpz_cmp_ui(mpq_denref(q), 1) == 0 && mpz_fits_slong_p(mpq_numref(q))) {
+    long n = mpz_get_si(mpq_numref(q));
+
+    if (n >= FIXNUM_MIN && n <= FIXNUM_MAX)
+      return ((uint32_t)n << 2) | REF_FIXNUM;
+
+    return emit_node(w, FASL_FIXNUM, 0, (uint64_t)n);
+  }
+
+  size_t num_len = 0, den_len = 0;
+  void *num = mpz_export(NULL, &num_len, -1, 1, 0, 0, mpq_numref(q));
+  void *den = mpz_export(NULL, &den_len, -1, 1, 0, 0, mpq_denref(q));
+
+  struct fasl_bignum big = {.negative = mpq_sgn(q) < 0,
+                            .num_len = num_len,
+                            .den_len = den_len};
+
+  size_t len = sizeof(big) + num_len + den_len;
+  char *bytes = gcx_malloc(len);
+
+  memcpy(bytes, &big, sizeof(big));
+  memcpy(bytes + sizeof(big), num, num_len);
+  memcpy(bytes + sizeof(big) + num_len, den, den_len);
+
+  return emit_node(w, FASL_BIGNUM, len, emit_data(w, bytes, len));
+}
+
+static uint32_t emit_atom(fasl_writer *w, value v) {
+  switch (v->type) {
+  case TYPE_NIL:
+    return REF_NIL;
+
+  case TYPE_BOOL:
+    return v->boolean ? REF_TRUE : REF_FALSE;
+
+  case TYPE_SYMBOL:
+  case TYPE_SPECIAL:
+    return emit_symbol(w, v);
+
+  case TYPE_NUM_EXACT:
+    return emit_number(w, v->num_exact);
+
+  case TYPE_STRING: {
+    size_t len = strlen(v->string);
+
+    return emit_node(w, FASL_STRING, len, emit_data(w, v->string, len));
+  }
+
+  default:
+    repl_error("compile-file: can not store %s", value_type_name(v->type));
+  }
+}
+
+/**
+ * Lists are walked with an explicit stack. Element refs collect on a ref
+ * stack until the list ends, then move into data behind one list node.
+ */
+struct fasl_walk {
+  value cursor;    // rest of the list
+  size_t ref_base; // first element ref on the ref stack
+};
+
+typedef struct {
+  struct fasl_walk *lists;
+  size_t depth, lists_cap;
+
+  uint32_t *refs;
+  size_t ref_count, refs_cap;
+} fasl_walker;
+
+static void walk_visit(fasl_writer *w, fasl_walker *k, value v) {
+  if (v->type == TYPE_CONS) {
+    k->lists = grow(k->lists, &k->lists_cap, k->depth + 1,
+                    sizeof(struct fasl_walk));
+    k->lists[k->depth++] =
+        (struct fasl_walk){.cursor = v, .ref_base = k->ref_count};
+    return;
+  }
+
+  k->refs = grow(k->refs, &k->refs_cap, k->ref_count + 1, sizeof(uint32_t));
+  k->refs[k->ref_count++] = emit_atom(w, v);
+}
+
+static uint32_t emit_value(fasl_writer *w, value root) {
+  fasl_walker k = {0};
+
+  walk_visit(w, &k, root);
+
+  while (k.depth) {
+    struct fasl_walk *f = k.lists + k.depth - 1;
+
+    if (f->cursor->type == TYPE_CONS) {
+      value element = car(f->cursor);
+
+      f->cursor = cdr(f->cursor);
+      walk_visit(w, &k, element);
+      continue;
+    }
+
+    // Tail goes last, () unless the list is dotted
+    size_t base = f->ref_base;
+    size_t count = k.ref_count - base;
+
+    walk_visit(w, &k, f->cursor);
+
+    if (count >= UINT32_MAX)
+      repl_error("compile-file: list too long");
+
+    uint64_t offset =
+        emit_data(w, k.refs + base, (count + 1) * sizeof(uint32_t));
+
+    k.ref_count = base;
+    k.depth--;
+
+    uint32_t ref = emit_node(w, FASL_LIST, count, offset);
+
+    k.refs[k.ref_count++] = ref;
+  }
+
+  return k.refs[0];
+}
+
+static void fasl_write(fasl_writer *w, const char *magic,
+                       const char *target) {
+  struct fasl_header h = {.version = FASL_VERSION,
+                          .byte_order = FASL_BYTE_ORDER};
+
+  memcpy(h.magic, magic, strlen(magic) + 1);
+
+  h.symbols = sizeof(h);
+  h.symbol_count = w->symbol_count;
+  h.nodes = h.symbols + w->symbol_count * sizeof(struct fasl_symbol);
+  h.node_count = w->node_count;
+  h.forms = h.nodes + w->node_count * sizeof(struct fasl_node);
+  h.form_count = w->form_count;
+  h.data = h.forms + ((w->form_count * sizeof(uint32_t) + 7) & ~7UL);
+  h.data_size = w->data_size;
+
+  // Replace the target in one step
+  char *tmp = gcx_malloc(strlen(target) + 5);
+
+  sprintf(tmp, "%s.tmp", target);
+
+  FILE *out = fopen(tmp, "wb");
+
+  if (!out)
+    repl_error("error: could not open file '%s' for writing", tmp);
+
+  fwrite(&h, sizeof(h), 1, out);
+  fwrite(w->symbols, sizeof(struct fasl_symbol), w->symbol_count, out);
+  fwrite(w->nodes, sizeof(struct fasl_node), w->node_count, out);
+  fwrite(w->forms, sizeof(uint32_t), w->form_count, out);
+
+  if (w->form_count & 1)
+    fwrite("\0\0\0\0", 4, 1, out);
+
+  fwrite(w->data, 1, w->data_size, out);
+
+  if (ferror(out) | fclose(out) || rename(tmp, target)) {
+    unlink(tmp);
+    repl_error("error: could not write file '%s'", target);
+  }
+}
+
+const char *fasl_compile(const char *source, const char *target) {
+  fasl_writer w = {0};
+  reader in = reader_open_file(source);
+
+  if (!in)
+    repl_error("compile-file: could not open file '%s'", source);
+
+  jmp_buf parse_error;
+
+  in->recover = &parse_error;
+
+  if (setjmp(parse_error)) {
+    char message[sizeof(in->error)];
+
+    strcpy(message, in->error);
+    reader_close(in);
+    repl_error("compile-file: %s: %s", source, message);
+  }
+
+  value expr;
+
+  while ((expr = parse_expression(in))) {
+    uint32_t root = emit_value(&w, expr);
+
+    w.forms = grow(w.forms, &w.form_cap, w.form_count + 1, sizeof(uint32_t));
+    w.forms[w.form_count++] = root;
+
+    reader_release(in);
+  }
+
+  reader_close(in);
+
+  fasl_write(&w, FASL_MAGIC, target);
+
+  return target;
+}
+
+/**
+ * Loader
+ */
+typedef struct {
+  const char *filename;
+  const struct fasl_header *h;
+  const struct fasl_node *nodes;
+  const char *data;
+
+  value *syms;
+
+  // Values of the current form's nodes, from node index start
+  value *built;
+  size_t built_cap;
+  uint64_t start;
+} fasl_loader;
+
+// Whether count items of size bytes at offset fit in limit bytes, without
+// any sum that could wrap
+static inline int in_bounds(uint64_t offset, uint64_t count, uint64_t size,
+                            uint64_t limit) {
+  return offset <= limit && count <= (limit - offset) / size;
+}
+
+__attribute__((noreturn)) static void corrupt(fasl_loader *l) {
+  repl_error("load: '%s' is corrupt", l->filename);
+}
+
+// Value of a ref made by node i, whose children are already built
+static value load_ref(fasl_loader *l, uint32_t ref, uint64_t i) {
+  switch (REF_TAG(ref)) {
+  case REF_NODE:
+    if (REF_INDEX(ref) < l->start || REF_INDEX(ref) >= i)
+      corrupt(l);
+
+    return l->built[REF_INDEX(ref) - l->start];
+
+  case REF_SYMBOL:
+    if (REF_INDEX(ref) >= l->h->symbol_count)
+      corrupt(l);
+
+    return l->syms[REF_INDEX(ref)];
+
+  case REF_FIXNUM: {
+    mpq_ptr q = num_exact_new();
+
+    mpq_set_si(q, REF_FIXNUM_VALUE(ref), 1);
+    return value_new_exact(q);
+  }
+
+  default:
+    if (ref == REF_NIL)
+      return value_new_nil();
+
+    if (ref == REF_TRUE || ref == REF_FALSE)
+      return value_new_bool(ref == REF_TRUE);
+
+    corrupt(l);
+  }
+}
+
+static value load_bignum(fasl_loader *l, const struct fasl_node *n) {
+  struct fasl_bignum big;
+
+  if (!in_bounds(n->b, n->a, 1, l->h->data_size) || n->a < sizeof(big))
+    corrupt(l);
+
+  memcpy(&big, l->data + n->b, sizeof(big));
+
+  if (sizeof(big) + (uint64_t)big.num_len + big.den_len > n->a)
+    corrupt(l);
+
+  const char *bytes = l->data + n->b + sizeof(big);
+  mpq_ptr q = num_exact_new();
+
+  mpz_import(mpq_numref(q), big.num_len, -1, 1, 0, 0, bytes);
+  mpz_import(mpq_denref(q), big.den_len, -1, 1, 0, 0, bytes + big.num_len);
+
+  if (big.negative)
+    mpq_neg(q, q);
+
+  return value_new_exact(q);
+}
+
+static value load_node(fasl_loader *l, uint64_t i) {
+  const struct fasl_node *n = l->nodes + i;
+
+  switch (n->tag) {
+  case FASL_LIST: {
+    if (!in_bounds(n->b, (uint64_t)n->a + 1, sizeof(uint32_t),
+                   l->h->data_size))
+      corrupt(l);
+
+    const uint32_t *refs = (const void *)(l->data + n->b);
+    value list = load_ref(l, refs[n->a], i);
+
+    for (uint32_t k = n->a; k > 0; k--)
+      list = value_new_cons(load_ref(l, refs[k - 1], i), list);
+
+    return list;
+  }
+
+  case FASL_FIXNUM: {
+    mpq_ptr q = num_exact_new();
+
+    mpq_set_si(q, (long)n->b, 1);
+    return value_new_exact(q);
+  }
+
+  case FASL_BIGNUM:
+    return load_bignum(l, n);
+
+  case FASL_STRING:
+    if (!in_bounds(n->b, n->a, 1, l->h->data_size))
+      corrupt(l);
+
+    return value_new_string(strndup(l->data + n->b, n->a));
+
+  default:
+    corrupt(l);
+  }
+}
+
+int fasl_is_fasl(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+
+  return ext && strcmp(ext, ".fasl") == 0;
+}
+
+// Map filename and check its header, errors unmap before unwinding
+static const struct fasl_header *fasl_map(const char *filename,
+                                          const char *magic, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    repl_error("error: could not open file '%s'\n", filename);
+
+  struct stat st;
+
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct fasl_header)) {
+    close(fd);
+    repl_error("load: '%s' is not a compiled file", filename);
+  }
+
+  *size = st.st_size;
+
+  const char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED)
+    repl_error("load: could not map '%s'", filename);
+
+  const struct fasl_header *h = (const void *)map;
+  char want[sizeof(h->magic)] = {0};
+
+  memcpy(want, magic, strlen(magic));
+
+  if (memcmp(h->magic, want, sizeof(h->magic)) ||
+      h->version != FASL_VERSION || h->byte_order != FASL_BYTE_ORDER ||
+      !in_bounds(h->symbols, h->symbol_count, sizeof(struct fasl_symbol),
+                 *size) ||
+      !in_bounds(h->nodes, h->node_count, sizeof(struct fasl_node), *size) ||
+      !in_bounds(h->forms, h->form_count, sizeof(uint32_t), *size) ||
+      !in_bounds(h->data, h->data_size, 1, *size)) {
+    munmap((void *)map, *size);
+    repl_error("load: '%s' is not a %s file of this version", filename,
+               magic);
+  }
+
+  return h;
+}
+
+// Intern the symbol table of a mapped file
+static value *fasl_symbols(fasl_loader *l) {
+  const struct fasl_header *h = l->h;
+  const struct fasl_symbol *symbols =
+      (const void *)((const char *)h + h->symbols);
+  value *syms = gcx_malloc((h->symbol_count + 1) * sizeof(value));
+
+  for (uint64_t i = 0; i < h->symbol_count; i++) {
+    const struct fasl_symbol *sym = symbols + i;
+
+    if (!in_bounds(sym->offset, sym->len, 1, h->data_size))
+      corrupt(l);
+
+    syms[i] = value_intern(l->data + sym->offset, sym->len);
+
+    // An image starts without special forms, it brings its own
+    if (sym->special && syms[i]->type != TYPE_SPECIAL)
+      syms[i] = value_new_special(strndup(l->data + sym->offset, sym->len));
+  }
+
+  return syms;
+}
+
+value fasl_load(const char *filename, env e) {
+  size_t size;
+  const struct fasl_header *h = fasl_map(filename, FASL_MAGIC, &size);
+
+  // Unmap when an error unwinds past us, then pass it on
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+
+  if (setjmp(repl_env) != 0) {
+    munmap((void *)h, size);
+    memcpy(repl_env, outer, sizeof(jmp_buf));
+    longjmp(repl_env, 1);
+  }
+
+  const char *map = (const char *)h;
+
+  fasl_loader l = {.filename = filename,
+                   .h = h,
+                   .nodes = (const void *)(map + h->nodes),
+                   .data = map + h->data};
+
+  const uint32_t *forms = (const void *)(map + h->forms);
+
+  l.syms = fasl_symbols(&l);
+
+  // Build, evaluate and drop one form at a time
+  value result = value_new_nil();
+
+  for (uint64_t f = 0; f < h->form_count; f++) {
+    uint32_t root = forms[f];
+    uint64_t end = l.start;
+
+    if (REF_TAG(root) == REF_NODE) {
+      end = REF_INDEX(root) + 1;
+
+      if (end <= l.start || end > h->node_count)
+        corrupt(&l);
+    }
+
+    l.built = grow(l.built, &l.built_cap, end - l.start + 1, sizeof(value));
+
+    for (uint64_t i = l.start; i < end; i++)
+      l.built[i - l.start] = load_node(&l, i);
+
+    result = eval(value_code(load_ref(&l, root, end)), e);
+    l.start = end;
+  }
+
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+  munmap((void *)map, size);
+
+  return result;
+}
+
+/**
+ * Locating compiled files
+ */
+char *fasl_path(const char *source) {
+  const char *slash = strrchr(source, '/');
+  const char *ext = strrchr(source, '.');
+  size_t stem = (ext && (!slash || ext > slash)) ? (size_t)(ext - source)
+                                                 : strlen(source);
+  char *path = gcx_malloc(stem + sizeof(".fasl"));
+
+  memcpy(path, source, stem);
+  strcpy(path + stem, ".fasl");
+
+  return path;
+}
+
+char *fasl_fresh(const char *source) {
+  char *compiled = fasl_path(source);
+  struct stat src, bin;
+
+  if (stat(compiled, &bin) != 0)
+    return NULL;
+
+  // A missing source is fine, the fasl stands in for it
+  if (stat(source, &src) == 0 &&
+      (bin.st_mtim.tv_sec < src.st_mtim.tv_sec ||
+       (bin.st_mtim.tv_sec == src.st_mtim.tv_sec &&
+        bin.st_mtim.tv_nsec < src.st_mtim.tv_nsec)))
+    return NULL;
+
+  return compiled;
+}
+
+// Directory of the cache, made if missing, NULL if there is none
+static char *cache_dir(void) {
+  const char *dir = getenv("LETLISP_CACHE"), *sub = "";
+
+  if (!dir || !*dir) {
+    dir = getenv("XDG_CACHE_HOME");
+    sub = "/letlisp";
+  }
+
+  if (!dir || !*dir) {
+    dir = getenv("HOME");
+    sub = "/.cache/letlisp";
+  }
+
+  if (!dir || !*dir)
+    return NULL;
+
+  char *path = gcx_malloc(strlen(dir) + strlen(sub) + 1);
+
+  sprintf(path, "%s%s", dir, sub);
+
+  // Make every missing component
+  for (char *p = path + 1;; p++) {
+    if (*p != '/' && *p != '\0')
+      continue;
+
+    char c = *p;
+
+    *p = '\0';
+
+    if (mkdir(path, 0777) != 0 && errno != EEXIST)
+      return NULL;
+
+    *p = c;
+
+    if (!c)
+      return path;
+  }
+}
+
+char *fasl_cached(const char *source) {
+  FILE *in = fopen(source, "rb");
+
+  if (!in)
+    return NULL;
+
+  // FNV-1a of the contents and the format they are compiled to
+  uint64_t hash = 14695981039346656037ULL;
+  uint32_t format[] = {FASL_VERSION, FASL_BYTE_ORDER};
+  unsigned char buf[8192];
+  size_t n;
+
+  for (size_t i = 0; i < sizeof(format); i++)
+    hash = (hash ^ ((unsigned char *)format)[i]) * 1099511628211ULL;
+
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    for (size_t i = 0; i < n; i++)
+      hash = (hash ^ buf[i]) * 1099511628211ULL;
+
+  int failed = ferror(in);
+
+  fclose(in);
+
+  char *dir = failed ? NULL : cache_dir();
+
+  if (!dir)
+    return NULL;
+
+  char *compiled = gcx_malloc(strlen(dir) + sizeof("/0123456789abcdef.fasl"));
+
+  sprintf(compiled, "%s/%016llx.fasl", dir, (unsigned long long)hash);
+
+  if (access(compiled, R_OK) != 0)
+    fasl_compile(source, compiled);
+
+  return compiled;
+}
+
+/**
+ * Images
+ *
+ * An image is the global environment and everything reachable from it, in
+ * the fasl layout with a single form: the ref of the environment. Cons
+ * cells, closures and environments are nodes of their own so sharing and
+ * cycles survive, builtins and special forms are stored by name and bound
+ * to this binary's C functions when the image is mapped.
+ */
+// Object whose node is reserved but not yet filled in
+struct image_pending {
+  const void *obj;
+  uint32_t node;
+};
+
+typedef struct {
+  fasl_writer w;
+
+  // object pointer -> ref, open addressing on the pointer
+  const void **obj_keys;
+  uint32_t *obj_refs;
+  size_t obj_count, obj_cap;
+
+  struct image_pending *pending;
+  size_t pending_count, pending_cap;
+} image_writer;
+
+static uint32_t *image_slot(image_writer *iw, const void *obj) {
+  if (2 * (iw->obj_count + 1) > iw->obj_cap) {
+    size_t cap = iw->obj_cap ? iw->obj_cap * 2 : 1024;
+    const void **keys = gcx_malloc(cap * sizeof(void *));
+    uint32_t *refs = gcx_malloc(cap * sizeof(uint32_t));
+
+    memset(keys, 0, cap * sizeof(void *));
+
+    for (size_t i = 0; i < iw->obj_cap; i++) {
+      if (!iw->obj_keys[i])
+        continue;
+
+      size_t j = ((uintptr_t)iw->obj_keys[i] >> 4) & (cap - 1);
+
+      while (keys[j])
+        j = (j + 1) & (cap - 1);
+
+      keys[j] = iw->obj_keys[i];
+      refs[j] = iw->obj_refs[i];
+    }
+
+    iw->obj_keys = keys;
+    iw->obj_refs = refs;
+    iw->obj_cap = cap;
+  }
+
+  size_t j = ((uintptr_t)obj >> 4) & (iw->obj_cap - 1);
+
+  while (iw->obj_keys[j] && iw->obj_keys[j] != obj)
+    j = (j + 1) & (iw->obj_cap - 1);
+
+  if (!iw->obj_keys[j]) {
+    iw->obj_keys[j] = obj;
+    iw->obj_refs[j] = REF_NONE;
+    iw->obj_count++;
+  }
+
+  return iw->obj_refs + j;
+}
+
+// Node for obj, its fields are patched once the worklist reaches it
+static uint32_t image_reserve(image_writer *iw, const void *obj,
+                              uint32_t tag) {
+  uint32_t ref = emit_node(&iw->w, tag, 0, 0);
+
+  iw->pending = grow(iw->pending, &iw->pending_cap, iw->pending_count + 1,
+                     sizeof(struct image_pending));
+  iw->pending[iw->pending_count++] =
+      (struct image_pending){.obj = obj, .node = REF_INDEX(ref)};
+
+  return ref;
+}
+
+static uint32_t image_env(image_writer *iw, env e) {
+  if (!e)
+    return REF_NONE;
+
+  uint32_t *slot = image_slot(iw, e);
+
+  if (*slot == REF_NONE)
+    *slot = image_reserve(iw, e, IMAGE_ENV);
+
+  return *slot;
+}
+
+static uint32_t image_value(image_writer *iw, value v) {
+  switch (v->type) {
+  case TYPE_NIL:
+  case TYPE_BOOL:
+  case TYPE_SYMBOL:
+  case TYPE_SPECIAL:
+    return emit_atom(&iw->w, v);
+
+  default:
+    break;
+  }
+
+  uint32_t *slot = image_slot(iw, v);
+
+  if (*slot != REF_NONE)
+    return *slot;
+
+  switch (v->type) {
+  case TYPE_CONS:
+    *slot = image_reserve(iw, v, v->code ? IMAGE_CODE : IMAGE_CONS);
+    break;
+
+  case TYPE_CLOSURE:
+    *slot = image_reserve(iw, v, IMAGE_CLOSURE);
+    break;
+
+  case TYPE_FUNCTION:
+    if (!v->fn_name)
+      repl_error("save-image: function without a name");
+
+    // Saved by name, loading finds it again only if letlisp has it
+    if (v->fn != builtin_lookup(v->fn_name) &&
+        v->fn != special_lookup(v->fn_name))
+      repl_error("save-image: %s is not a builtin, procedures of compiled "
+                 "modules can not be saved",
+                 v->fn_name);
+
+    *slot = emit_node(&iw->w, IMAGE_FUNCTION, strlen(v->fn_name),
+                      emit_data(&iw->w, v->fn_name, strlen(v->fn_name)));
+    break;
+
+  case TYPE_NUM_EXACT:
+  case TYPE_STRING:
+    *slot = emit_atom(&iw->w, v);
+    break;
+
+  default:
+    repl_error("save-image: can not store %s", value_type_name(v->type));
+  }
+
+  return *slot;
+}
+
+void image_save(const char *filename, env e) {
+  image_writer iw = {0};
+  uint32_t root = image_env(&iw, e);
+
+  // Children are reserved as they are found, so the worklist only grows
+  for (size_t i = 0; i < iw.pending_count; i++) {
+    struct image_pending p = iw.pending[i];
+    uint32_t tag = iw.w.nodes[p.node].tag;
+    uint32_t a;
+    uint64_t b;
+
+    if (tag == IMAGE_ENV) {
+      const struct env_s *scope = p.obj;
+
+      a = image_env(&iw, scope->parent);
+      b = image_value(&iw, scope->bindings);
+    } else if (tag == IMAGE_CONS || tag == IMAGE_CODE) {
+      value v = (value)p.obj;
+
+      a = image_value(&iw, car(v));
+      b = image_value(&iw, cdr(v));
+    } else {
+      value v = (value)p.obj;
+
+      uint32_t refs[3] = {image_value(&iw, v->clo.params),
+                          image_value(&iw, v->clo.body),
+                          image_env(&iw, v->clo.e)};
+
+      a = v->clo.name ? emit_symbol(&iw.w, value_new_symbol(v->clo.name))
+                      : REF_NONE;
+      b = emit_data(&iw.w, refs, sizeof(refs));
+    }
+
+    iw.w.nodes[p.node].a = a;
+    iw.w.nodes[p.node].b = b;
+  }
+
+  iw.w.forms = gcx_malloc(sizeof(uint32_t));
+  iw.w.forms[0] = root;
+  iw.w.form_count = 1;
+
+  fasl_write(&iw.w, IMAGE_MAGIC, filename);
+}
+
+// Value of a ref in an image, every node is allocated by now
+static value image_ref(fasl_loader *l, uint32_t ref, int want_env) {
+  if (ref == REF_NONE) {
+    if (!want_env)
+      corrupt(l);
+
+    return NULL;
+  }
+
+  if (REF_TAG(ref) != REF_NODE) {
+    if (want_env)
+      corrupt(l);
+
+    return load_ref(l, ref, 0);
+  }
+
+  if (REF_INDEX(ref) >= l->h->node_count ||
+      (l->nodes[REF_INDEX(ref)].tag == IMAGE_ENV) != want_env)
+    corrupt(l);
+
+  return l->built[REF_INDEX(ref)];
+}
+
+// Allocate node i, leaving references to other nodes for the second pass
+static value image_alloc(fasl_loader *l, uint64_t i) {
+  const struct fasl_node *n = l->nodes + i;
+
+  switch (n->tag) {
+  case IMAGE_CONS:
+    return value_alloc(TYPE_CONS);
+
+  case IMAGE_CODE:
+    return value_new_code(NULL, NULL);
+
+  case IMAGE_CLOSURE:
+    return value_alloc(TYPE_CLOSURE);
+
+  case IMAGE_ENV:
+    return (value)env_new(NULL);
+
+  case IMAGE_FUNCTION: {
+    if (!in_bounds(n->b, n->a, 1, l->h->data_size))
+      corrupt(l);
+
+    char *name = strndup(l->data + n->b, n->a);
+    function fn = builtin_lookup(name);
+
+    if (!fn)
+      fn = special_lookup(name);
+
+    if (!fn)
+      repl_error("load: '%s' needs %s, which this letlisp does not have",
+                 l->filename, name);
+
+    return value_new_function(name, fn);
+  }
+
+  default:
+    return load_node(l, i);
+  }
+}
+
+env image_load(const char *filename) {
+  size_t size;
+  const struct fasl_header *h = fasl_map(filename, IMAGE_MAGIC, &size);
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+
+  if (setjmp(repl_env) != 0) {
+    munmap((void *)h, size);
+    memcpy(repl_env, outer, sizeof(jmp_buf));
+    longjmp(repl_env, 1);
+  }
+
+  const char *map = (const char *)h;
+
+  fasl_loader l = {.filename = filename,
+                   .h = h,
+                   .nodes = (const void *)(map + h->nodes),
+                   .data = map + h->data};
+
+  if (h->form_count != 1)
+    corrupt(&l);
+
+  l.syms = fasl_symbols(&l);
+  l.built = gcx_malloc((h->node_count + 1) * sizeof(value));
+
+  // Images keep every cons as a node of its own
+  for (uint64_t i = 0; i < h->node_count; i++) {
+    if (l.nodes[i].tag == FASL_LIST)
+      corrupt(&l);
+
+    l.built[i] = image_alloc(&l, i);
+  }
+
+  for (uint64_t i = 0; i < h->node_count; i++) {
+    const struct fasl_node *n = l.nodes + i;
+    value v = l.built[i];
+
+    if (n->tag == IMAGE_CONS || n->tag == IMAGE_CODE) {
+      car(v) = image_ref(&l, n->a, 0);
+      cdr(v) = image_ref(&l, (uint32_t)n->b, 0);
+    } else if (n->tag == IMAGE_CLOSURE) {
+      if (!in_bounds(n->b, 3, sizeof(uint32_t), h->data_size))
+        corrupt(&l);
+
+      const uint32_t *refs = (const void *)(l.data + n->b);
+
+      v->clo.params = image_ref(&l, refs[0], 0);
+      v->clo.body = image_ref(&l, refs[1], 0);
+      v->clo.e = (env)image_ref(&l, refs[2], 1);
+
+      if (n->a != REF_NONE) {
+        if (REF_TAG(n->a) != REF_SYMBOL)
+          corrupt(&l);
+
+        v->clo.name = load_ref(&l, n->a, 0)->sym;
+      }
+    } else if (n->tag == IMAGE_ENV) {
+      env scope = (env)v;
+
+      scope->parent = (env)image_ref(&l, n->a, 1);
+      scope->bindings = image_ref(&l, (uint32_t)n->b, 0);
+    }
+  }
+
+  const uint32_t *forms = (const void *)(map + h->forms);
+  env global = (env)image_ref(&l, forms[0], 1);
+
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+  munmap((void *)map, size);
+
+  if (!global)
+    corrupt(&l);
+
+  return global;
+}
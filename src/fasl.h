@@ -0,0 +1,46 @@
+#ifndef FASL_H
+#define FASL_H
+
+#include "env.h"
+#include "value.h"
+
+/**
+ * Compiled files
+ *
+ * A fasl holds the parsed top level forms of a source file. Everything is
+ * addressed by index or offset so the file is used straight from a read only
+ * mapping: symbols are interned once per load, numbers are stored as
+ * machine words or GMP limb bytes, and forms are rebuilt and evaluated one at
+ * a time.
+ */
+
+// Parse source and write target, returns target
+const char *fasl_compile(const char *source, const char *target);
+
+// Evaluate every form in a fasl file
+value fasl_load(const char *filename, env e);
+
+int fasl_is_fasl(const char *filename);
+
+// Write e, its parents and everything reachable from them to filename
+void image_save(const char *filename, env e);
+
+// Global environment saved by image_save
+env image_load(const char *filename);
+
+// Compiled sibling of source if it exists and is not older, else NULL
+char *fasl_fresh(const char *source);
+
+/**
+ * Compiled copy of source in the cache, compiled there first if missing,
+ * NULL if source can not be read or there is no cache directory. Copies are
+ * named by a hash of the contents of source, so edits and checkouts of any
+ * age get their own. The cache is LETLISP_CACHE, else letlisp in the XDG
+ * cache directory.
+ */
+char *fasl_cached(const char *source);
+
+// source with its extension replaced by .fasl
+char *fasl_path(const char *source);
+
+#endif
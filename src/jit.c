@@ -0,0 +1,751 @@
+#include <gmp.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "builtin.h"
+#include "env.h"
+#include "eval.h"
+#include "jit.h"
+#include "memory.h"
+#include "numbers.h"
+#include "value.h"
+
+int jit_enabled = 1;
+
+/**
+ * Fast paths
+ *
+ * Called from compiled code with both arguments evaluated. Small integers,
+ * exact with a one limb numerator, are done on machine words, other
+ * numbers directly on their mpq, anything else by the builtin itself so
+ * errors read the same.
+ */
+static int small(value v, long *n) {
+  if (v->type != TYPE_NUM_EXACT)
+    return 0;
+
+  mpz_srcptr num = mpq_numref(v->num_exact);
+  mpz_srcptr den = mpq_denref(v->num_exact);
+
+  if (den->_mp_size != 1 || den->_mp_d[0] != 1)
+    return 0;
+
+  if (num->_mp_size == 0) {
+    *n = 0;
+    return 1;
+  }
+
+  if ((num->_mp_size != 1 && num->_mp_size != -1) || num->_mp_d[0] > LONG_MAX)
+    return 0;
+
+  *n = num->_mp_size < 0 ? -(long)num->_mp_d[0] : (long)num->_mp_d[0];
+  return 1;
+}
+
+static value box(long n) {
+  mpq_ptr q = num_exact_new();
+
+  mpq_set_si(q, n, 1);
+  return value_new_exact(q);
+}
+
+static value slow(value fn, value a, value b, env e) {
+  return fn->fn(value_new_cons(a, value_new_cons(b, value_new_nil())), e);
+}
+
+static value jit_add(value a, value b, env e, value fn) {
+  long x, y, r;
+
+  if (small(a, &x) && small(b, &y) && !__builtin_add_overflow(x, y, &r))
+    return box(r);
+
+  return slow(fn, a, b, e);
+}
+
+static value jit_sub(value a, value b, env e, value fn) {
+  long x, y, r;
+
+  if (small(a, &x) && small(b, &y) && !__builtin_sub_overflow(x, y, &r))
+    return box(r);
+
+  return slow(fn, a, b, e);
+}
+
+static value jit_mul(value a, value b, env e, value fn) {
+  long x, y, r;
+
+  if (small(a, &x) && small(b, &y) && !__builtin_mul_overflow(x, y, &r))
+    return box(r);
+
+  return slow(fn, a, b, e);
+}
+
+// Sign of a - b, or 2 when either is not a number
+static int compare(value a, value b) {
+  long x, y;
+
+  if (small(a, &x) && small(b, &y))
+    return (x > y) - (x < y);
+
+  if (a->type != TYPE_NUM_EXACT || b->type != TYPE_NUM_EXACT)
+    return 2;
+
+  int cmp = mpq_cmp(a->num_exact, b->num_exact);
+
+  return (cmp > 0) - (cmp < 0);
+}
+
+#define JIT_COMPARE(name, test)                                                \
+  static value name(value a, value b, env e, value fn) {                       \
+    int cmp = compare(a, b);                                                   \
+                                                                               \
+    if (cmp == 2)                                                              \
+      return slow(fn, a, b, e);                                                \
+                                                                               \
+    return value_new_bool(test);                                               \
+  }
+
+JIT_COMPARE(jit_less, cmp < 0)
+JIT_COMPARE(jit_greater, cmp > 0)
+JIT_COMPARE(jit_less_equal, cmp <= 0)
+JIT_COMPARE(jit_greater_equal, cmp >= 0)
+JIT_COMPARE(jit_equal, cmp == 0)
+
+static const struct {
+  const char *name;
+  jit_op op;
+} jit_ops[] = {
+    {"+", jit_add},          {"-", jit_sub},
+    {"*", jit_mul},          {"<", jit_less},
+    {">", jit_greater},      {"<=", jit_less_equal},
+    {">=", jit_greater_equal}, {"=", jit_equal},
+};
+
+#define JIT_OPS (sizeof(jit_ops) / sizeof(jit_ops[0]))
+
+jit_op jit_fast_op(function fn) {
+  static function fns[JIT_OPS];
+
+  // Threads racing here store the same
+  if (!fns[0])
+    for (size_t i = JIT_OPS; i-- > 0;)
+      fns[i] = builtin_lookup(jit_ops[i].name);
+
+  for (size_t i = 0; i < JIT_OPS; i++)
+    if (fns[i] == fn)
+      return jit_ops[i].op;
+
+  return NULL;
+}
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Applies fn to the n values at argv, for calls compiled code can't make
+static value jit_apply(value fn, value *argv, long n, env e) {
+  value args = value_new_nil();
+
+  while (n--)
+    args = value_new_cons(argv[n], args);
+
+  return eval_apply(fn, args, e);
+}
+
+/**
+ * Code buffer
+ *
+ * Only what the compiler below needs of x86-64. The scope is kept in rbx,
+ * results in rax, temporaries in stack slots above rsp, which stays 16
+ * byte aligned for calls.
+ */
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RSI = 6,
+  RDI = 7,
+  R11 = 11
+};
+
+enum { CC_E = 0x4, CC_NE = 0x5 };
+
+typedef struct {
+  unsigned char *code;
+  size_t len;
+  size_t cap;
+  int slots;     // temporaries in use
+  int max_slots; // for the frame
+  value params;  // in order
+  long declared; // defines bound ahead of the parameters
+  value locals;  // names bound in the scope of a call
+  env global;
+  value refs;
+} jit_buf;
+
+static void emit(jit_buf *b, const void *bytes, size_t n) {
+  if (b->len + n > b->cap) {
+    b->cap = (b->len + n) * 2;
+    b->code = realloc(b->code, b->cap);
+
+    if (!b->code)
+      abort();
+  }
+
+  memcpy(b->code + b->len, bytes, n);
+  b->len += n;
+}
+
+static void emit_byte(jit_buf *b, unsigned char byte) { emit(b, &byte, 1); }
+
+static void emit_u32(jit_buf *b, uint32_t v) { emit(b, &v, 4); }
+
+static void emit_rex(jit_buf *b, int wide, int reg, int base) {
+  emit_byte(b, 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) |
+                   (base >= 8 ? 1 : 0));
+}
+
+// Any opcode on reg and [base + disp]
+static void emit_mem(jit_buf *b, int wide, unsigned char opcode, int reg,
+                     int base, int32_t disp) {
+  emit_rex(b, wide, reg, base);
+  emit_byte(b, opcode);
+  emit_byte(b, 0x80 | (reg & 7) << 3 | (base & 7));
+
+  if ((base & 7) == RSP)
+    emit_byte(b, 0x24);
+
+  emit_u32(b, disp);
+}
+
+static void emit_load(jit_buf *b, int reg, int base, int32_t disp) {
+  emit_mem(b, 1, 0x8b, reg, base, disp);
+}
+
+static void emit_store(jit_buf *b, int base, int32_t disp, int reg) {
+  emit_mem(b, 1, 0x89, reg, base, disp);
+}
+
+static void emit_lea(jit_buf *b, int reg, int base, int32_t disp) {
+  emit_mem(b, 1, 0x8d, reg, base, disp);
+}
+
+// cmp dword [base + disp], imm
+static void emit_cmp_mem32(jit_buf *b, int base, int32_t disp, uint32_t imm) {
+  emit_mem(b, 0, 0x81, 7, base, disp);
+  emit_u32(b, imm);
+}
+
+static void emit_cmp(jit_buf *b, int left, int right) {
+  emit_rex(b, 1, right, left);
+  emit_byte(b, 0x39);
+  emit_byte(b, 0xc0 | (right & 7) << 3 | (left & 7));
+}
+
+static void emit_move(jit_buf *b, int dst, int src) {
+  emit_rex(b, 1, src, dst);
+  emit_byte(b, 0x89);
+  emit_byte(b, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+static void emit_imm(jit_buf *b, int reg, const void *imm) {
+  uint64_t v = (uintptr_t)imm;
+
+  emit_rex(b, 1, 0, reg);
+  emit_byte(b, 0xb8 | (reg & 7));
+  emit(b, &v, 8);
+}
+
+// A value the code points to
+static void emit_value(jit_buf *b, int reg, value v) {
+  b->refs = value_new_cons(v, b->refs);
+  emit_imm(b, reg, v);
+}
+
+static void emit_call(jit_buf *b, const void *fn) {
+  emit_imm(b, R11, fn);
+  emit(b, "\x41\xff\xd3", 3);
+}
+
+// Jumps return where to patch the target in
+static size_t emit_jcc(jit_buf *b, int cc) {
+  emit_byte(b, 0x0f);
+  emit_byte(b, 0x80 | cc);
+  emit_u32(b, 0);
+  return b->len;
+}
+
+static size_t emit_jmp(jit_buf *b) {
+  emit_byte(b, 0xe9);
+  emit_u32(b, 0);
+  return b->len;
+}
+
+static void patch(jit_buf *b, size_t jump) {
+  int32_t rel = b->len - jump;
+
+  memcpy(b->code + jump - 4, &rel, 4);
+}
+
+static int32_t slot(int n) { return n * 8; }
+
+static int slots_reserve(jit_buf *b, int n) {
+  int first = b->slots;
+
+  b->slots += n;
+
+  if (b->slots > b->max_slots)
+    b->max_slots = b->slots;
+
+  return first;
+}
+
+#define CAR offsetof(struct value_s, cons.car)
+#define CDR offsetof(struct value_s, cons.cdr)
+#define TYPE offsetof(struct value_s, type)
+#define BOOLEAN offsetof(struct value_s, boolean)
+#define BINDINGS offsetof(struct env_s, bindings)
+
+/**
+ * Compiler
+ *
+ * Each form leaves its value in rax.
+ */
+static void compile_car(jit_buf *b, value cell);
+
+static int is_special(value head, const char *name) {
+  return head->type == TYPE_SPECIAL && strcmp(head->sym, name) == 0;
+}
+
+static int memq(value sym, value list) {
+  for (; list->type == TYPE_CONS; list = cdr(list))
+    if (car(list) == sym)
+      return 1;
+
+  return 0;
+}
+
+static long length(value list) {
+  long n = 0;
+
+  for (; list->type == TYPE_CONS; list = cdr(list))
+    n++;
+
+  return n;
+}
+
+static void compile_eval(jit_buf *b, value form) {
+  emit_value(b, RDI, form);
+  emit_move(b, RSI, RBX);
+  emit_call(b, eval);
+}
+
+// Jumps if rax is false, where to patch is returned
+static size_t compile_false_jump(jit_buf *b) {
+  emit_cmp_mem32(b, RAX, TYPE, TYPE_BOOL);
+  size_t not_bool = emit_jcc(b, CC_NE);
+  emit_cmp_mem32(b, RAX, BOOLEAN, 0);
+  size_t jump = emit_jcc(b, CC_E);
+  patch(b, not_bool);
+
+  return jump;
+}
+
+static void compile_sequence(jit_buf *b, value body) {
+  if (body->type != TYPE_CONS)
+    emit_value(b, RAX, value_new_nil());
+
+  for (; body->type == TYPE_CONS; body = cdr(body))
+    compile_car(b, body);
+}
+
+/**
+ * Parameter i is the pair this far down the bindings, unless the call
+ * was short of arguments or a define added a name: the pair must have the
+ * symbol or the name is looked up.
+ */
+#define JIT_DEPTH 16 // deepest parameter checked in place
+
+static void compile_reference(jit_buf *b, value cell) {
+  value sym = car(cell);
+  long i = 0;
+  value p = b->params;
+
+  for (; p->type == TYPE_CONS && car(p) != sym; p = cdr(p))
+    i++;
+
+  long depth = b->declared + length(b->params) - 1 - i;
+
+  if (p->type != TYPE_CONS || memq(sym, cdr(p)) || depth >= JIT_DEPTH) {
+    emit_move(b, RDI, RBX);
+    emit_value(b, RSI, cell);
+    emit_call(b, env_lookup_site);
+    return;
+  }
+
+  size_t misses[JIT_DEPTH + 2];
+  int n = 0;
+
+  emit_load(b, RAX, RBX, BINDINGS);
+
+  for (long d = 0; d <= depth; d++) {
+    emit_cmp_mem32(b, RAX, TYPE, TYPE_CONS);
+    misses[n++] = emit_jcc(b, CC_NE);
+
+    if (d < depth)
+      emit_load(b, RAX, RAX, CDR);
+  }
+
+  emit_load(b, RAX, RAX, CAR);
+  emit_load(b, RDX, RAX, CAR);
+  emit_value(b, RCX, sym);
+  emit_cmp(b, RDX, RCX);
+  misses[n++] = emit_jcc(b, CC_NE);
+  emit_load(b, RAX, RAX, CDR);
+  size_t done = emit_jmp(b);
+
+  for (int m = 0; m < n; m++)
+    patch(b, misses[m]);
+
+  emit_move(b, RDI, RBX);
+  emit_value(b, RSI, cell);
+  emit_call(b, env_lookup_site);
+  patch(b, done);
+}
+
+static void compile_if(jit_buf *b, value form) {
+  value args = cdr(form);
+
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS) {
+    compile_eval(b, form);
+    return;
+  }
+
+  compile_car(b, args);
+  size_t otherwise = compile_false_jump(b);
+
+  compile_car(b, cdr(args));
+  size_t done = emit_jmp(b);
+
+  patch(b, otherwise);
+
+  if (cddr(args)->type == TYPE_CONS)
+    compile_car(b, cddr(args));
+  else
+    emit_value(b, RAX, value_new_nil());
+
+  patch(b, done);
+}
+
+static void compile_cond(jit_buf *b, value form) {
+  size_t done[64];
+  int n = 0;
+
+  for (value c = cdr(form); c->type == TYPE_CONS; c = cdr(c))
+    if (car(c)->type != TYPE_CONS) {
+      compile_eval(b, form);
+      return;
+    }
+
+  if (length(cdr(form)) > 64) {
+    compile_eval(b, form);
+    return;
+  }
+
+  for (value c = cdr(form); c->type == TYPE_CONS; c = cdr(c)) {
+    value clause = car(c);
+    value test = car(clause);
+
+    if (test->type == TYPE_SYMBOL && strcmp(test->sym, "else") == 0) {
+      compile_sequence(b, cdr(clause));
+      done[n++] = emit_jmp(b);
+      break;
+    }
+
+    compile_car(b, clause);
+    size_t next = compile_false_jump(b);
+
+    compile_sequence(b, cdr(clause));
+    done[n++] = emit_jmp(b);
+    patch(b, next);
+  }
+
+  emit_value(b, RAX, value_new_nil());
+
+  for (int i = 0; i < n; i++)
+    patch(b, done[i]);
+}
+
+// and stops at the first false value, or at the first true one
+static void compile_and_or(jit_buf *b, value form, int is_and) {
+  size_t done[128];
+  int n = 0;
+
+  if (length(cdr(form)) > 64) {
+    compile_eval(b, form);
+    return;
+  }
+
+  for (value a = cdr(form); a->type == TYPE_CONS; a = cdr(a)) {
+    compile_car(b, a);
+    emit_cmp_mem32(b, RAX, TYPE, TYPE_BOOL);
+
+    if (is_and) {
+      size_t not_bool = emit_jcc(b, CC_NE);
+
+      emit_cmp_mem32(b, RAX, BOOLEAN, 0);
+      done[n++] = emit_jcc(b, CC_E);
+      patch(b, not_bool);
+    } else {
+      done[n++] = emit_jcc(b, CC_NE);
+      emit_cmp_mem32(b, RAX, BOOLEAN, 0);
+      done[n++] = emit_jcc(b, CC_NE);
+    }
+  }
+
+  emit_value(b, RAX, value_new_bool(is_and));
+
+  for (int i = 0; i < n; i++)
+    patch(b, done[i]);
+}
+
+// (%fold folded original . dependencies), see Constant folding in eval.c
+static void compile_fold(jit_buf *b, value form) {
+  value args = cdr(form);
+  size_t misses[64];
+  int n = 0;
+
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_CONS ||
+      length(cddr(args)) > 64) {
+    compile_eval(b, form);
+    return;
+  }
+
+  for (value d = cddr(args); d->type == TYPE_CONS; d = cdr(d)) {
+    emit_value(b, RAX, caar(d));
+    emit_load(b, RAX, RAX, CDR);
+    emit_value(b, RCX, cdar(d));
+    emit_cmp(b, RAX, RCX);
+    misses[n++] = emit_jcc(b, CC_NE);
+  }
+
+  compile_car(b, args);
+  size_t done = emit_jmp(b);
+
+  for (int i = 0; i < n; i++)
+    patch(b, misses[i]);
+
+  compile_eval(b, form);
+  patch(b, done);
+}
+
+// Fast path of a global builtin applied to two arguments, NULL if none
+static jit_op builtin_op(jit_buf *b, value head, value *pair) {
+  if (head->type != TYPE_SYMBOL || memq(head, b->locals))
+    return NULL;
+
+  *pair = env_exists(b->global, head->sym);
+
+  if ((*pair)->type != TYPE_CONS || cdr(*pair)->type != TYPE_FUNCTION)
+    return NULL;
+
+  return jit_fast_op(cdr(*pair)->fn);
+}
+
+static void compile_call(jit_buf *b, value form) {
+  value args = cdr(form);
+  long n = length(args);
+  value pair;
+  jit_op op = n == 2 ? builtin_op(b, car(form), &pair) : NULL;
+
+  // Head, then the arguments
+  int first = slots_reserve(b, n + 1);
+
+  if (!op) {
+    compile_car(b, form);
+    emit_store(b, RSP, slot(first), RAX);
+  }
+
+  for (long i = 0; args->type == TYPE_CONS; args = cdr(args), i++) {
+    compile_car(b, args);
+    emit_store(b, RSP, slot(first + 1 + i), RAX);
+  }
+
+  size_t done = 0;
+
+  if (op) {
+    value fn = cdr(pair);
+
+    emit_value(b, RAX, pair);
+    emit_load(b, RAX, RAX, CDR);
+    emit_value(b, RCX, fn);
+    emit_cmp(b, RAX, RCX);
+    size_t miss = emit_jcc(b, CC_NE);
+
+    emit_load(b, RDI, RSP, slot(first + 1));
+    emit_load(b, RSI, RSP, slot(first + 2));
+    emit_move(b, RDX, RBX);
+    emit_value(b, RCX, fn);
+    emit_call(b, op);
+    done = emit_jmp(b);
+
+    // Whatever the name holds now
+    patch(b, miss);
+    emit_move(b, RDI, RBX);
+    emit_value(b, RSI, form);
+    emit_call(b, env_lookup_site);
+    emit_store(b, RSP, slot(first), RAX);
+  }
+
+  emit_load(b, RDI, RSP, slot(first));
+  emit_lea(b, RSI, RSP, slot(first + 1));
+  emit_imm(b, RDX, (void *)(uintptr_t)n);
+  emit_move(b, RCX, RBX);
+  emit_call(b, jit_apply);
+
+  if (op)
+    patch(b, done);
+
+  b->slots = first;
+}
+
+static void compile_car(jit_buf *b, value cell) {
+  value form = car(cell);
+
+  switch (form->type) {
+  case TYPE_SYMBOL:
+    compile_reference(b, cell);
+    return;
+
+  case TYPE_CONS:
+    break;
+
+  case TYPE_NUM_EXACT:
+  case TYPE_NIL:
+  case TYPE_FUNCTION:
+  case TYPE_BOOL:
+  case TYPE_STRING:
+  case TYPE_SPECIAL:
+    emit_value(b, RAX, form);
+    return;
+
+  default:
+    compile_eval(b, form);
+    return;
+  }
+
+  value head = car(form);
+
+  if (head->type != TYPE_SPECIAL) {
+    compile_call(b, form);
+    return;
+  }
+
+  if (is_special(head, "quote") && cdr(form)->type == TYPE_CONS)
+    emit_value(b, RAX, cadr(form));
+  else if (is_special(head, "if"))
+    compile_if(b, form);
+  else if (is_special(head, "cond"))
+    compile_cond(b, form);
+  else if (is_special(head, "begin"))
+    compile_sequence(b, cdr(form));
+  else if (is_special(head, "and"))
+    compile_and_or(b, form, 1);
+  else if (is_special(head, "or"))
+    compile_and_or(b, form, 0);
+  else if (is_special(head, "%fold"))
+    compile_fold(b, form);
+  else
+    compile_eval(b, form);
+}
+
+// Executable copy of the code, NULL if the system won't have it
+static jit_code jit_install(jit_buf *b) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (b->len + page - 1) / page * page;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (mem == MAP_FAILED)
+    return NULL;
+
+  memcpy(mem, b->code, b->len);
+
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    return NULL;
+  }
+
+  return (jit_code)mem;
+}
+
+void jit_compile(jit_state *jit, value fn, value defines) {
+  env global = fn->clo.e;
+
+  // The names a body refers to are only known for top level procedures
+  if (global->parent || fn->clo.body->type != TYPE_CONS)
+    return;
+
+  jit_buf b = {.params = value_new_nil(),
+               .locals = defines,
+               .global = global,
+               .refs = value_new_nil()};
+  value *tail = &b.params;
+
+  value p = fn->clo.params;
+
+  for (; p->type == TYPE_CONS; p = cdr(p)) {
+    *tail = value_new_cons(car(p), value_new_nil());
+    tail = &cdr(*tail);
+    b.locals = value_new_cons(car(p), b.locals);
+  }
+
+  // A rest parameter is not bound by env_extend, but still a local name
+  if (p->type == TYPE_SYMBOL)
+    b.locals = value_new_cons(p, b.locals);
+
+  for (value d = defines; d->type == TYPE_CONS; d = cdr(d))
+    if (!memq(car(d), b.params))
+      b.declared++;
+
+  // push rbx; sub rsp, frame; mov rbx, rdi
+  emit_byte(&b, 0x53);
+  emit(&b, "\x48\x81\xec", 3);
+  emit_u32(&b, 0);
+  size_t frame = b.len;
+  emit_move(&b, RBX, RDI);
+
+  compile_sequence(&b, fn->clo.body);
+
+  // Entry leaves rsp 8 off alignment, push rbx made up for it
+  uint32_t size = (b.max_slots * 8 + 15) & ~15u;
+
+  memcpy(b.code + frame - 4, &size, 4);
+
+  // add rsp, frame; pop rbx; ret
+  emit(&b, "\x48\x81\xc4", 3);
+  emit_u32(&b, size);
+  emit_byte(&b, 0x5b);
+  emit_byte(&b, 0xc3);
+
+  jit_code code = jit_install(&b);
+
+  free(b.code);
+
+  if (!code)
+    return;
+
+  jit->refs = b.refs;
+  __atomic_store_n(&jit->code, code, __ATOMIC_RELEASE);
+}
+
+#else
+
+void jit_compile(jit_state *jit, value fn, value defines) {}
+
+#endif
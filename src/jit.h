@@ -0,0 +1,50 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "env.h"
+#include "value.h"
+
+/**
+ * Native code
+ *
+ * Bodies of top level procedures applied JIT_THRESHOLD times are compiled
+ * to x86-64 machine code, run in place of the interpreter on the scope of
+ * each call. Control flow, parameter references and guards are native,
+ * anything else is handed back to eval. Two argument arithmetic and
+ * comparisons of global builtins call fast paths for small integers,
+ * guarded like folded code on the global binding. Parameter references
+ * check the binding they expect and look the name up when it is not
+ * there, a guard that fails falls back to the interpreter for that form.
+ *
+ * Builtins applied through a fast path are not seen by trace, profile or
+ * eval-stats, compiled code is not used while tracing. Elsewhere than
+ * x86-64 nothing is compiled.
+ */
+#define JIT_THRESHOLD 100
+
+typedef value (*jit_code)(env e);
+
+// Per lambda body, see Body analysis in eval.c
+typedef struct {
+  unsigned long calls; // applications until compiled, not synchronized
+  jit_code code;       // NULL while interpreted
+  value refs;          // what code points to, kept alive with it
+} jit_state;
+
+// Fast path of a builtin applied to a and b, fn is the builtin value
+typedef value (*jit_op)(value a, value b, env e, value fn);
+
+// Fast path for the builtin fn, NULL if there is none
+jit_op jit_fast_op(function fn);
+
+// Cleared by --no-jit
+extern int jit_enabled;
+
+/**
+ * Compiles the body of fn for scopes made by binding its parameters, then
+ * declaring defines. Sets code in jit, or leaves it NULL if fn can not be
+ * compiled.
+ */
+void jit_compile(jit_state *jit, value fn, value defines);
+
+#endif
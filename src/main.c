@@ -14,363 +14,294 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <assert.h>
-#include <ctype.h>
-#include <gmp.h>
+#include <getopt.h>
 #include <setjmp.h>
-#include <stddef.h>
-#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // TODO: Parse with regex
 // TODO: Continuations (for io as well?)
 // TODO: Multiline input to readline
-// TODO: Finish refactor into small files
 
 // Stuff
+#include "aot.h"
 #include "builtin.h"
 #include "env.h"
 #include "eval.h"
+#include "fasl.h"
+#include "jit.h"
 #include "memory.h"
-#include "parser.h"
+#include "profile.h"
 #include "repl.h"
+#include "trace.h"
 #include "value.h"
 
-// Functions
-int is_special(const char *sym);
-
 /**
- *  Numbers and utilities
+ * Command line
  */
-mpq_ptr num_exact_new() {
-  mpq_ptr new = gcx_malloc(sizeof(mpq_t));
-
-  mpq_init(new);
-
-  return new;
+static void usage(FILE *out) {
+  fprintf(out,
+          "Usage: letlisp [options] [-e expr]... [script | -] [args]\n"
+          "  -e expr               evaluate expr, may be repeated\n"
+          "  --compile             compile the files that follow to C and\n"
+          "                        shared objects, for load\n"
+          "  --gc-stats            print collector statistics on exit\n"
+          "  --gc-heap=SIZE        initial heap size (k/m/g suffix)\n"
+          "  --gc-free-divisor=N   collector free space divisor\n"
+          "  --gc-incremental      incremental collection\n"
+          "  --gc-markers=N        parallel marker threads\n"
+          "  --image=FILE          start from an image made by save-image\n"
+          "  --eval-stats          count evaluator work from the start\n"
+          "  --no-jit              interpret everything, no native code\n"
+          "  --profile[=FILE]      sample the run, report on exit, folded\n"
+          "                        stacks to FILE\n"
+          "  --trace[=FILE]        trace every call, report on exit, Chrome\n"
+          "                        trace to FILE\n"
+          "  -h, --help            this text\n"
+          "\n"
+          "Expressions are evaluated in order, then the script. Without a\n"
+          "script or -e, a terminal gets the repl and anything else is read\n"
+          "as a script from stdin. Scripts print nothing themselves and exit\n"
+          "with status 1 on the first error. letlisp.lsp in the current\n"
+          "directory is loaded first, when there is one.\n");
 }
 
-/**
- * Base evalation
- */
-
-value eval_list(value lst, env e) {
-  if (lst->type == TYPE_NIL)
-    return lst;
+static const char *profile_folded = NULL;
 
-  value head = eval(car(lst), e);
-  value tail = eval_list(cdr(lst), e);
+static void profile_exit_report() {
+  profile_stop();
+  profile_report(stderr);
 
-  return value_new_cons(head, tail);
+  if (profile_folded && !profile_write_folded(profile_folded))
+    fprintf(stderr, "letlisp: could not write '%s'\n", profile_folded);
 }
 
-value eval_define(value args, env e) {
-  value sym = car(args);
-
-  // (define symbol expr)
-  if (sym->type == TYPE_SYMBOL) {
-    value expr = car(cdr(args));
-    value val = eval(expr, e);
-
-    env_set(e, sym, val);
-    return sym;
-  }
-
-  // define function
-  else if (sym->type == TYPE_CONS) {
-    value func_name = car(sym);
-
-    // TODO: This breaks renaming special forms (dont really care f.n.)
-    if (func_name->type != TYPE_SYMBOL)
-      repl_error("define: function name must be a symbol");
-
-    value params = cdr(sym);
-    value body = cdr(args);
+static const char *trace_file = NULL;
 
-    value lambda_sym = value_new_symbol("lambda", e);
-    value lambda_expr =
-        value_new_cons(lambda_sym, value_new_cons(params, body));
+static void trace_exit_report() {
+  trace_stop();
+  trace_report(stderr);
 
-    value val = eval(lambda_expr, e);
-
-    env_set(e, func_name, val);
-    return func_name;
-  }
-
-  repl_error("define: invalid syntax");
+  if (trace_file && !trace_write_chrome(trace_file))
+    fprintf(stderr, "letlisp: could not write '%s'\n", trace_file);
 }
 
-value eval_quote(value args, env e) { return car(args); }
-
-value eval_lambda(value args, env e) {
-  value params = car(args); // first argument
-  value body = cdr(args);   // rest of list
-
-  return value_new_closure(params, body, e);
+static void gc_stats_report() {
+  fprintf(stderr, "\n;; gc-stats\n");
+  mem_print_stats(stderr);
+  value_print_stats(stderr);
 }
 
-value eval_apply_closure(value fn, value arg_exprs, env calling_env) {
-  assert(fn->type == TYPE_CLOSURE);
-  value params = fn->clo.params;
-  value body = fn->clo.body;
-  env closure_env = fn->clo.e;
-
-  value args = eval_list(arg_exprs, calling_env); // eval args in calling env
-
-  // Bind params to args
-  env new_env = env_extend(closure_env, params, args);
-
-  // Evaluate body in new_env
-  value result = value_new_nil();
-
-  while (body->type == TYPE_CONS) {
-    result = eval(car(body), new_env);
-    body = cdr(body);
-  }
-
-  return result;
-}
-
-value eval_if(value args, env env) {
-  if (args->type != TYPE_CONS)
-    repl_error("if: missing arguments");
-
-  // Extract predicate
-  value predicate = car(args);
-
-  // Extract then branch
-  if (cdr(args)->type != TYPE_CONS)
-    repl_error("if: missing then branch");
-
-  value then_branch = cadr(args);
-
-  // Extract else branch (optional)
-  value else_branch = value_new_nil();
-
-  if (cddr(args)->type == TYPE_CONS)
-    else_branch = car(cddr(args));
-
-  // Evaluate predicate
-  value cond = eval(predicate, env);
-
-  if (bool_istrue(cond, env))
-    return eval(then_branch, env);
-  else
-    return eval(else_branch, env);
-}
-
-const char *valueTypeNames[] = {"cons",    "int",      "symbol",
-                                "nil",     "function", "special",
-                                "closure", "bool",     "string"};
-
-value eval(value v, env e) {
-  switch (v->type) {
-  case TYPE_NUM_EXACT:
-  case TYPE_NIL:
-  case TYPE_FUNCTION:
-  case TYPE_BOOL:
-  case TYPE_STRING:
-  case TYPE_SPECIAL:
-    return v;
-
-  case TYPE_SYMBOL:
-    return env_lookup(e, v->sym);
-
-  case TYPE_CONS: {
-    value head = car(v);
-
-    if (head->type == TYPE_SPECIAL)
-      return eval_special(head, cdr(v), e);
-
-    value fn = eval(head, e);
-    value args = cdr(v);
-
-    if (fn->type == TYPE_CLOSURE)
-      return eval_apply_closure(fn, args, e);
-
-    if (fn->type == TYPE_FUNCTION)
-      return fn->fn(eval_list(args, e), e);
-
-    repl_error("Not a function");
+enum {
+  OPT_GC_STATS = 256,
+  OPT_GC_HEAP,
+  OPT_GC_FREE_DIVISOR,
+  OPT_GC_INCREMENTAL,
+  OPT_GC_MARKERS,
+  OPT_IMAGE,
+  OPT_COMPILE,
+  OPT_PROFILE,
+  OPT_EVAL_STATS,
+  OPT_NO_JIT,
+  OPT_TRACE
+};
+
+static const struct option long_options[] = {
+    {"gc-stats", no_argument, NULL, OPT_GC_STATS},
+    {"gc-heap", required_argument, NULL, OPT_GC_HEAP},
+    {"gc-free-divisor", required_argument, NULL, OPT_GC_FREE_DIVISOR},
+    {"gc-incremental", no_argument, NULL, OPT_GC_INCREMENTAL},
+    {"gc-markers", required_argument, NULL, OPT_GC_MARKERS},
+    {"image", required_argument, NULL, OPT_IMAGE},
+    {"compile", no_argument, NULL, OPT_COMPILE},
+    {"profile", optional_argument, NULL, OPT_PROFILE},
+    {"eval-stats", no_argument, NULL, OPT_EVAL_STATS},
+    {"no-jit", no_argument, NULL, OPT_NO_JIT},
+    {"trace", optional_argument, NULL, OPT_TRACE},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+int main(int argc, char **argv) {
+  mem_options mem_opts;
+  const char *image = NULL;
+  char **exprs = calloc(argc, sizeof(char *));
+  int expr_count = 0;
+  int gc_stats = 0;
+  int profile = 0;
+  int trace = 0;
+  int compile = 0;
+  int opt;
+
+  mem_options_init(&mem_opts);
+
+  // Stop at the script, the rest of argv is its own
+  while ((opt = getopt_long(argc, argv, "+he:", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'e':
+      exprs[expr_count++] = optarg;
+      break;
+
+    case OPT_GC_STATS:
+      gc_stats = 1;
+      break;
+
+    case OPT_GC_HEAP:
+      if (mem_parse_size(optarg, &mem_opts.initial_heap)) {
+        fprintf(stderr, "letlisp: invalid heap size '%s'\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case OPT_GC_FREE_DIVISOR:
+      mem_opts.free_divisor = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_GC_INCREMENTAL:
+      mem_opts.incremental = 1;
+      break;
+
+    case OPT_GC_MARKERS:
+      mem_opts.markers = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_IMAGE:
+      image = optarg;
+      break;
+
+    case OPT_COMPILE:
+      compile = 1;
+      break;
+
+    case OPT_EVAL_STATS:
+      eval_stats.enabled = 1;
+      break;
+
+    case OPT_NO_JIT:
+      jit_enabled = 0;
+      break;
+
+    case OPT_TRACE:
+      trace = 1;
+      trace_file = optarg;
+      break;
+
+    case OPT_PROFILE:
+      profile = 1;
+      profile_folded = optarg;
+      break;
+
+    case 'h':
+      usage(stdout);
+      return EXIT_SUCCESS;
+
+    default:
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
   }
 
-  default:
-    repl_error("Unknown type in eval: %s\n", valueTypeNames[v->type]);
-    exit(1);
-  }
-}
-
-/**
- * Special forms
- */
-
-value eval_or(value args, env e) {
-
-  while (args->type == TYPE_CONS) {
-    value current = car(args);
-    value result = eval(current, e);
+  // Memory
+  mem_startup(&mem_opts);
 
-    // Short
-    if (result->type != TYPE_BOOL || result->boolean)
-      return result;
+  if (gc_stats)
+    atexit(gc_stats_report);
 
-    args = cdr(args);
+  if (profile) {
+    atexit(profile_exit_report);
+    profile_start();
   }
 
-  return value_new_bool(0);
-}
-
-value eval_and(value args, env e) {
-  while (args->type == TYPE_CONS) {
-    value current = car(args);
-    value result = eval(current, e);
-
-    // short
-    if (result->type == TYPE_BOOL && !result->boolean)
-      return result;
-
-    args = cdr(args);
+  if (trace) {
+    atexit(trace_exit_report);
+    trace_start();
   }
 
-  return value_new_bool(1);
-}
-
-value eval_eval(value args, env env) {
-  if (args->type != TYPE_CONS)
-    repl_error("eval: expected 1 argument");
-
-  value expr = car(args);
-
-  if (cdr(args)->type != TYPE_NIL)
-    repl_error("eval: too many arguments");
+  env global_env;
 
-  return eval(expr, env);
-}
-
-// Argument list in an unevaled sequence of sexps to eval
-value eval_begin(value args, env e) {
-  value result = value_new_nil();
+  if (image) {
+    // Builtins, special forms and the startup file are all in the image
+    if (setjmp(repl_env) != 0)
+      return EXIT_FAILURE;
 
-  for (; args->type == TYPE_CONS; args = cdr(args))
-    result = eval(car(args), e);
+    global_env = image_load(image);
+  } else {
+    // Load builtins
+    global_env = env_new(NULL);
 
-  return result;
-}
-
-value eval_cond(value args, env e) {
-  for (; args->type == TYPE_CONS; args = cdr(args)) {
-    value clause = car(args);
-
-    if (clause->type != TYPE_CONS)
-      repl_error("cond: invalid clause");
-
-    value predicate = car(clause);
-
-    if (predicate->type == TYPE_SYMBOL && strcmp(predicate->sym, "else") == 0) {
-      // (else expr1 expr2 ...)
-      return eval_begin(cdr(clause), e);
-    }
+    global_env = builtins_startup(global_env);
+    global_env = special_startup(global_env);
 
-    value result = eval(predicate, e);
+    // Load lisp startup, when there is one here
+    char *startup = "letlisp.lsp";
 
-    if (bool_istrue(result, e)) {
-      // (predicate expr1 expr2 ...)
-      return eval_begin(cdr(clause), e);
+    if (access(startup, R_OK) == 0) {
+      if (setjmp(repl_env) == 0)
+        repl_eval_file(startup, global_env);
+      else {
+        fprintf(stderr, "Error in startup file\n");
+        frame_reset();
+      }
     }
   }
 
-  return value_new_nil(); // no clause matched
-}
-
-value eval_let(value args, env e) {
-
-  if (args->type != TYPE_CONS)
-    repl_error("let: missing bindings and body");
-
-  value bindings = car(args);
-  value body = cdr(args);
-
-  if (bindings->type != TYPE_CONS && bindings->type != TYPE_NIL)
-    repl_error("let: bindings must be a list");
-
-  env new_env = env_extend(e, value_new_nil(), value_new_nil());
-
-  // Iterate over bindings
-  for (; bindings->type == TYPE_CONS; bindings = cdr(bindings)) {
-    value bind = car(bindings);
-
-    if (bind->type != TYPE_CONS || cdr(bind)->type != TYPE_CONS ||
-        cddr(bind)->type != TYPE_NIL)
-      repl_error("let: each binding must be (var expr)");
-
-    value var = car(bind);
-    value expr = cadr(bind);
+  // Compile mode, every file that follows is a source
+  if (compile) {
+    if (optind == argc) {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
 
-    if (var->type != TYPE_SYMBOL)
-      repl_error("let: binding variable must be a symbol");
+    if (setjmp(repl_env) != 0)
+      return EXIT_FAILURE;
 
-    value val = eval(expr, e); // old environment !!
+    for (int i = optind; i < argc; i++)
+      aot_build(argv[i], aot_path(argv[i], ".so"));
 
-    env_set(new_env, var, val);
+    return EXIT_SUCCESS;
   }
 
-  return eval_begin(body, new_env);
-}
-
-value eval_np(value args, env e) { repl_error("Special form not implemented"); }
-
-static const char *special_forms[] = {"lambda", "define", "quote", "if",
-                                      "or",     "and",    "eval",  "begin",
-                                      "cond",   "let",    NULL};
-
-static const function special_handlers[] = {
-    eval_lambda, eval_define, eval_quote, eval_if,   eval_or,
-    eval_and,    eval_eval,   eval_begin, eval_cond, eval_let};
-
-int is_special(const char *sym) {
-  for (int i = 0; special_forms[i] != NULL; i++)
-    if (strcmp(sym, special_forms[i]) == 0)
-      return 1;
-
-  return 0;
-}
+  // Batch mode, script and arguments follow the options
+  char **args = argv + optind;
+  int arg_count = argc - optind;
+  char *script = NULL;
 
-value eval_special(value head, value args, env e) {
-  for (int i = 0; special_forms[i] != NULL; i++)
-    if (strcmp(head->sym, special_forms[i]) == 0)
-      return special_handlers[i](args, e);
+  if (arg_count > 0)
+    script = args[0];
+  else if (expr_count == 0 && !isatty(STDIN_FILENO))
+    script = "-";
 
-  repl_error("Unknown special form: %s", head->sym);
-}
+  // (command-line) is the script, or letlisp itself, then the arguments
+  if (script && arg_count > 0) {
+    args++;
+    arg_count--;
+  }
 
-env special_startup(env e) {
-  for (int i = 0; special_forms[i] != NULL; i++)
-    env_set(e, value_new_special(special_forms[i]),
-            value_new_function(special_handlers[i]));
+  char **line = calloc(arg_count + 1, sizeof(char *));
 
-  return e;
-}
+  line[0] = script ? script : argv[0];
+  memcpy(line + 1, args, arg_count * sizeof(char *));
+  builtins_set_command_line(arg_count + 1, line);
+  free(line);
 
-int main() {
-  // Memory
-  mem_startup();
+  if (expr_count == 0 && !script) {
+    // Go for it
+    repl(global_env);
 
-  // Load builtins
-  env global_env = env_new(NULL);
+    return EXIT_SUCCESS;
+  }
 
-  global_env = builtins_startup(global_env);
-  global_env = special_startup(global_env);
+  if (setjmp(repl_env) != 0)
+    return EXIT_FAILURE;
 
-  // Load lisp startup
-  if (setjmp(repl_env) == 0)
-    repl_eval_file("letlisp.lsp", global_env);
-  else
-    fprintf(stderr, "Error in startup file\n");
+  for (int i = 0; i < expr_count; i++)
+    repl_eval(reader_open_string(exprs[i], strlen(exprs[i])), global_env);
 
-  // Go for it
-  repl(global_env);
+  if (script && strcmp(script, "-") == 0)
+    repl_eval(reader_open_fd(STDIN_FILENO), global_env);
+  else if (script)
+    repl_eval_file(script, global_env);
 
   return EXIT_SUCCESS;
 }
@@ -1,9 +1,13 @@
 #include <gc/gc.h>
+#include <gc/gc_mark.h>
 #include <gmp.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "memory.h"
 
@@ -11,6 +15,7 @@ void *mem_realloc_cb(void *ptr, size_t oldsize, size_t newsize) {
 #if 1
   ptr = gcx_realloc(ptr, newsize);
 
+  return ptr;
 #else
   // Try is memory corruption is a problem (again)
   void *new = gcx_malloc(newsize);
@@ -23,16 +28,145 @@ void *mem_realloc_cb(void *ptr, size_t oldsize, size_t newsize) {
 
 void mem_free_cb(void *, size_t oldsize) { return; }
 
+/**
+ * Collection pause timing
+ *
+ * Called by the collector with its allocation lock held
+ */
+static struct timespec pause_start;
+static unsigned long pause_total_us = 0;
+static unsigned long pause_max_us = 0;
+
+static void mem_collection_event(GC_EventType event) {
+  if (event == GC_EVENT_START) {
+    clock_gettime(CLOCK_MONOTONIC, &pause_start);
+    return;
+  }
+
+  if (event != GC_EVENT_END)
+    return;
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  unsigned long us = (now.tv_sec - pause_start.tv_sec) * 1000000UL +
+                     (now.tv_nsec - pause_start.tv_nsec) / 1000;
+
+  pause_total_us += us;
+  if (us > pause_max_us)
+    pause_max_us = us;
+}
+
+/**
+ * Options
+ */
+
+// Defaults, overridden by LETLISP_GC_* in the environment
+void mem_options_init(mem_options *opts) {
+  const char *env;
+
+  memset(opts, 0, sizeof(*opts));
+
+  if ((env = getenv("LETLISP_GC_HEAP")))
+    mem_parse_size(env, &opts->initial_heap);
+
+  if ((env = getenv("LETLISP_GC_FREE_DIVISOR")))
+    opts->free_divisor = strtoul(env, NULL, 10);
+
+  if ((env = getenv("LETLISP_GC_INCREMENTAL")))
+    opts->incremental = atoi(env) != 0;
+
+  if ((env = getenv("LETLISP_GC_MARKERS")))
+    opts->markers = strtoul(env, NULL, 10);
+}
+
+// Byte count with optional k/m/g suffix, returns 0 on success
+int mem_parse_size(const char *text, size_t *size) {
+  char *end;
+  unsigned long long n = strtoull(text, &end, 10);
+
+  if (end == text)
+    return -1;
+
+  switch (*end) {
+  case 'g':
+  case 'G':
+    n <<= 10;
+    // fallthrough
+  case 'm':
+  case 'M':
+    n <<= 10;
+    // fallthrough
+  case 'k':
+  case 'K':
+    n <<= 10;
+    end++;
+    break;
+  }
+
+  if (*end != '\0')
+    return -1;
+
+  *size = n;
+  return 0;
+}
+
 /**
  * Memory
  */
-void mem_startup() {
+void mem_startup(const mem_options *opts) {
+  // Marker threads are started by GC_INIT
+  if (opts->markers) {
+#if GC_VERSION_MAJOR > 8 || (GC_VERSION_MAJOR == 8 && GC_VERSION_MINOR >= 2)
+    GC_set_markers_count(opts->markers);
+#else
+    char markers[16];
+
+    snprintf(markers, sizeof(markers), "%u", opts->markers);
+    setenv("GC_MARKERS", markers, 1);
+#endif
+  }
+
   GC_INIT();
 
+  GC_set_on_collection_event(mem_collection_event);
+
+  if (opts->initial_heap > GC_get_heap_size())
+    GC_expand_hp(opts->initial_heap - GC_get_heap_size());
+
+  if (opts->free_divisor)
+    GC_set_free_space_divisor(opts->free_divisor);
+
+  if (opts->incremental)
+    GC_enable_incremental();
+
   // Numbers
   mp_set_memory_functions(gcx_malloc, mem_realloc_cb, mem_free_cb);
 }
 
+void mem_get_stats(mem_stats *stats) {
+  stats->heap_size = GC_get_heap_size();
+  stats->free_bytes = GC_get_free_bytes();
+  stats->total_bytes = GC_get_total_bytes();
+  stats->collections = GC_get_gc_no();
+  stats->pause_total_us = pause_total_us;
+  stats->pause_max_us = pause_max_us;
+}
+
+void mem_print_stats(FILE *out) {
+  mem_stats stats;
+
+  mem_get_stats(&stats);
+
+  fprintf(out, "heap-size: %zu\n", stats.heap_size);
+  fprintf(out, "free-bytes: %zu\n", stats.free_bytes);
+  fprintf(out, "allocated-bytes: %zu\n", stats.total_bytes);
+  fprintf(out, "collections: %lu\n", stats.collections);
+  fprintf(out, "pause-total-us: %lu\n", stats.pause_total_us);
+  fprintf(out, "pause-max-us: %lu\n", stats.pause_max_us);
+}
+
 void *gcx_malloc(size_t size) {
   void *ptr = GC_MALLOC(size);
 
@@ -55,3 +189,126 @@ void *gcx_realloc(void *ptr, size_t size) {
 }
 
 void gcx_free(void *ptr) { return; }
+
+/**
+ * Frame region
+ *
+ * Chunks in use are linked through their first word from frame_chunks,
+ * thread locals are not something every collector scans.
+ */
+_Thread_local frame_region frames;
+
+static void *frame_chunks;
+static atomic_flag frame_chunks_lock = ATOMIC_FLAG_INIT;
+
+static inline void frame_chunks_acquire() {
+  while (atomic_flag_test_and_set_explicit(&frame_chunks_lock,
+                                           memory_order_acquire))
+    sched_yield();
+}
+
+static inline void frame_chunks_release() {
+  atomic_flag_clear_explicit(&frame_chunks_lock, memory_order_release);
+}
+
+static void frame_chunk_new() {
+  char *chunk = gcx_malloc(FRAME_REGION_SIZE);
+
+  frame_chunks_acquire();
+  *(void **)chunk = frame_chunks;
+  frame_chunks = chunk;
+  frame_chunks_release();
+
+  frames.base = chunk;
+  frames.top = chunk + sizeof(void *);
+}
+
+void *frame_alloc(size_t size) {
+  // Pointer aligned
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+  if (!frames.base) {
+    if (frames.collected)
+      return gcx_malloc(size);
+
+    frame_chunk_new();
+  }
+
+  if (frames.top + size > frames.base + FRAME_REGION_SIZE)
+    return gcx_malloc(size);
+
+  void *ptr = frames.top;
+
+  frames.top += size;
+  return ptr;
+}
+
+void frame_release(char *mark) {
+  // Marks taken in a chunk that escaped, everything since is released. A
+  // full chunk has its top at the very end.
+  if (mark < frames.base || mark > frames.base + FRAME_REGION_SIZE)
+    mark = frames.base + sizeof(void *);
+
+  if (frames.top > mark) {
+    memset(mark, 0, frames.top - mark);
+    frames.top = mark;
+  }
+}
+
+void frame_escape(void) {
+  char *chunk = frames.base;
+
+  frame_chunks_acquire();
+
+  void **link = &frame_chunks;
+
+  // The link is the first word of each chunk
+  while (*link != chunk)
+    link = (void **)*link;
+
+  *link = *(void **)chunk;
+  frame_chunks_release();
+
+  frame_chunk_new();
+}
+
+void frame_reset(void) {
+  if (frames.base)
+    frame_release(frames.base + sizeof(void *));
+}
+
+/**
+ * Stacks
+ */
+static void *stack_thread; // collector handle of the OS thread
+static void (*stack_roots)(mem_push push);
+static GC_push_other_roots_proc push_other_roots;
+
+static void push_eager(void *lo, void *hi) { GC_push_all_eager(lo, hi); }
+
+static void push_stacks(void) {
+  if (push_other_roots)
+    push_other_roots();
+
+  stack_roots(push_eager);
+}
+
+void *mem_stack_main(void) {
+  struct GC_stack_base sb;
+
+  stack_thread = GC_get_my_stackbottom(&sb);
+
+  return sb.mem_base;
+}
+
+void mem_stack_enter(void *bottom) {
+  struct GC_stack_base sb = {.mem_base = bottom};
+
+  GC_set_stackbottom(stack_thread, &sb);
+}
+
+void mem_stack_roots(void (*each)(mem_push push)) {
+  stack_roots = each;
+  push_other_roots = GC_get_push_other_roots();
+  GC_set_push_other_roots(push_stacks);
+}
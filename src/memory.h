@@ -2,12 +2,43 @@
 #define MEMORY_H
 
 #include <gmp.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+/**
+ * Collector tuning
+ *
+ * Zero means "leave the collector default alone"
+ */
+typedef struct {
+  size_t initial_heap;        // bytes to grow the heap to at startup
+  unsigned long free_divisor; // GC_set_free_space_divisor
+  int incremental;            // GC_enable_incremental
+  unsigned markers;           // parallel marker threads
+} mem_options;
+
+/**
+ * Collector statistics
+ */
+typedef struct {
+  size_t heap_size;         // bytes currently held by the collector
+  size_t free_bytes;        // of which unused
+  size_t total_bytes;       // bytes allocated since startup
+  unsigned long collections;
+  unsigned long pause_total_us;
+  unsigned long pause_max_us;
+} mem_stats;
+
 /**
  * Memory
  */
-void mem_startup();
+void mem_options_init(mem_options *opts);
+int mem_parse_size(const char *text, size_t *size);
+
+void mem_startup(const mem_options *opts);
+
+void mem_get_stats(mem_stats *stats);
+void mem_print_stats(FILE *out);
 
 void *gcx_malloc(size_t size);
 
@@ -15,4 +46,62 @@ void *gcx_realloc(void *ptr, size_t size);
 
 void gcx_free(void *ptr);
 
+/**
+ * Frame region
+ *
+ * Per thread bump allocation for scopes nothing refers to once their call
+ * returns. Chunks come from the collector and stay registered as roots
+ * while in use, so whatever a frame points to is kept alive. When a frame
+ * escapes after all, the chunk is left to the collector, interior pointers
+ * keep it alive for as long as needed, and the thread starts a new one.
+ * Memory above the top is kept zeroed. Green threads interleave their
+ * calls, they leave the region unused.
+ */
+#define FRAME_REGION_SIZE (64 * 1024)
+
+typedef struct {
+  char *base; // NULL until first used
+  char *top;
+  int collected; // no region, frames come from the collector
+} frame_region;
+
+extern _Thread_local frame_region frames;
+
+static inline char *frame_mark(void) { return frames.top; }
+
+static inline int frame_owns(const void *ptr) {
+  return (const char *)ptr >= frames.base &&
+         (const char *)ptr < frames.base + FRAME_REGION_SIZE;
+}
+
+// Zeroed, from the collector when the region is full
+void *frame_alloc(size_t size);
+
+// Frees everything allocated since mark was taken
+void frame_release(char *mark);
+
+// Something that outlives its frame refers into the region
+void frame_escape(void);
+
+// After an error unwound all frames of this thread
+void frame_reset(void);
+
+/**
+ * Stacks
+ *
+ * Green threads run on stacks of their own, see thread.h. The collector
+ * scans the stack in use up to the bottom given to mem_stack_enter, the
+ * function given to mem_stack_roots pushes the ones switched out.
+ */
+typedef void (*mem_push)(void *lo, void *hi);
+
+// Bottom of the stack of this OS thread, the highest address
+void *mem_stack_main(void);
+
+// Code now runs on the stack ending at bottom
+void mem_stack_enter(void *bottom);
+
+// each is called by collections to push every stack not in use
+void mem_stack_roots(void (*each)(mem_push push));
+
 #endif
@@ -0,0 +1,352 @@
+#include <gmp.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtin.h"
+#include "eval.h"
+#include "fasl.h"
+#include "memory.h"
+#include "module.h"
+#include "repl.h"
+
+typedef struct library_s *library;
+
+struct library_s {
+  const char *path; // name as a relative path, parts joined by /
+  const char *text; // name as written, for errors
+  value exports;    // ((external . internal) ...)
+  env e;
+  int loading; // declarations not all done yet
+  library next;
+};
+
+static library libraries = NULL;
+
+static int is_named(value v, const char *name) {
+  return (v->type == TYPE_SYMBOL || v->type == TYPE_SPECIAL) &&
+         strcmp(v->sym, name) == 0;
+}
+
+// name with its parts separated by sep, or an error naming who
+static char *library_key(value name, char sep, const char *who) {
+  char *key;
+  size_t len;
+  FILE *out = open_memstream(&key, &len);
+
+  if (name->type != TYPE_CONS) {
+    fclose(out);
+    free(key);
+    repl_error("%s: a library name is a list", who);
+  }
+
+  for (value part = name; part->type == TYPE_CONS; part = cdr(part)) {
+    value v = car(part);
+
+    if (part != name)
+      fputc(sep, out);
+
+    if (v->type == TYPE_SYMBOL || v->type == TYPE_SPECIAL)
+      fputs(v->sym, out);
+    else if (v->type == TYPE_NUM_EXACT &&
+             mpz_cmp_ui(mpq_denref(v->num_exact), 1) == 0 &&
+             mpq_sgn(v->num_exact) >= 0)
+      gmp_fprintf(out, "%Zd", mpq_numref(v->num_exact));
+    else {
+      fclose(out);
+      free(key);
+      repl_error("%s: library names are symbols and integers", who);
+    }
+  }
+
+  fclose(out);
+
+  char *copy = gcx_malloc(len + 1);
+
+  memcpy(copy, key, len + 1);
+  free(key);
+
+  return copy;
+}
+
+static library library_find(const char *path) {
+  for (library l = libraries; l; l = l->next)
+    if (strcmp(l->path, path) == 0)
+      return l;
+
+  return NULL;
+}
+
+static void library_unlink(library l) {
+  for (library *p = &libraries; *p; p = &(*p)->next)
+    if (*p == l) {
+      *p = l->next;
+      return;
+    }
+}
+
+// A global environment of builtins and special forms
+static env library_env(void) {
+  return special_startup(builtins_startup(env_new(NULL)));
+}
+
+// (export id (rename id external) ...)
+static value library_exports(library l, value specs, value exports) {
+  for (; specs->type == TYPE_CONS; specs = cdr(specs)) {
+    value spec = car(specs);
+
+    if (spec->type == TYPE_SYMBOL)
+      exports = value_new_cons(value_new_cons(spec, spec), exports);
+    else if (spec->type == TYPE_CONS && is_named(car(spec), "rename") &&
+             cdr(spec)->type == TYPE_CONS && cddr(spec)->type == TYPE_CONS &&
+             cadr(spec)->type == TYPE_SYMBOL &&
+             car(cddr(spec))->type == TYPE_SYMBOL)
+      exports = value_new_cons(value_new_cons(car(cddr(spec)), cadr(spec)),
+                               exports);
+    else
+      repl_error("define-library: (%s) exports something not an identifier",
+                 l->text);
+  }
+
+  return exports;
+}
+
+static void library_declare(library l, value decl) {
+  value head = decl->type == TYPE_CONS ? car(decl) : decl;
+
+  if (is_named(head, "export"))
+    l->exports = library_exports(l, cdr(decl), l->exports);
+  else if (is_named(head, "include"))
+    for (value f = cdr(decl); f->type == TYPE_CONS; f = cdr(f)) {
+      if (car(f)->type != TYPE_STRING)
+        repl_error("define-library: (%s) includes something not a file name",
+                   l->text);
+
+      repl_eval_file(car(f)->string, l->e);
+    }
+  else if (head->type == TYPE_SPECIAL &&
+           (is_named(head, "import") || is_named(head, "begin")))
+    eval(decl, l->e);
+  else
+    repl_error("define-library: (%s) has an unknown declaration", l->text);
+}
+
+value module_define_library(value args, env e) {
+  if (e->parent)
+    repl_error("define-library: only at top level");
+
+  if (args->type != TYPE_CONS)
+    repl_error("define-library: expected a library name");
+
+  library l = gcx_malloc(sizeof(struct library_s));
+
+  l->path = library_key(car(args), '/', "define-library");
+  l->text = library_key(car(args), ' ', "define-library");
+  l->exports = value_new_nil();
+  l->e = library_env();
+  l->loading = 1;
+  l->next = libraries;
+  libraries = l;
+
+  // Drop the library when an error unwinds past us, then pass it on
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+
+  if (setjmp(repl_env) != 0) {
+    library_unlink(l);
+    memcpy(repl_env, outer, sizeof(jmp_buf));
+    longjmp(repl_env, 1);
+  }
+
+  for (value d = cdr(args); d->type == TYPE_CONS; d = cdr(d))
+    library_declare(l, car(d));
+
+  for (value x = l->exports; x->type == TYPE_CONS; x = cdr(x))
+    if (env_exists(l->e, cdar(x)->sym)->type != TYPE_CONS)
+      repl_error("define-library: (%s) exports %s, which it does not define",
+                 l->text, cdar(x)->sym);
+
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+
+  // A library defined again replaces the one before
+  for (library old; (old = library_find(l->path)) != l;)
+    library_unlink(old);
+
+  l->loading = 0;
+
+  return car(args);
+}
+
+// Source of the library at path in LETLISP_PATH, NULL if there is none
+static char *library_file(const char *path) {
+  const char *dirs = getenv("LETLISP_PATH");
+
+  if (!dirs || !*dirs)
+    dirs = ".";
+
+  for (const char *dir = dirs;; dir++) {
+    const char *end = strchr(dir, ':');
+    size_t len = end ? (size_t)(end - dir) : strlen(dir);
+    char *file = gcx_malloc(len + strlen(path) + sizeof("/.lsp"));
+
+    sprintf(file, "%.*s/%s.lsp", (int)len, dir, path);
+
+    if (access(file, R_OK) == 0)
+      return file;
+
+    if (!end)
+      return NULL;
+
+    dir = end;
+  }
+}
+
+static library library_load(value name) {
+  const char *path = library_key(name, '/', "import");
+  library l = library_find(path);
+
+  if (l && l->loading)
+    repl_error("import: library (%s) imports itself",
+               library_key(name, ' ', "import"));
+
+  if (l)
+    return l;
+
+  char *file = library_file(path);
+
+  if (!file)
+    repl_error("import: no library (%s) in LETLISP_PATH",
+               library_key(name, ' ', "import"));
+
+  // Whatever else the file does stays out of the importer
+  char *compiled = fasl_cached(file);
+
+  if (compiled)
+    fasl_load(compiled, library_env());
+  else
+    repl_eval_file(file, library_env());
+
+  l = library_find(path);
+
+  if (!l)
+    repl_error("import: %s does not define library (%s)", file,
+               library_key(name, ' ', "import"));
+
+  return l;
+}
+
+static value binding_find(value bindings, value sym) {
+  for (; bindings->type == TYPE_CONS; bindings = cdr(bindings))
+    if (caar(bindings) == sym)
+      return car(bindings);
+
+  return NULL;
+}
+
+// The ids of a modified set, each bound by bindings
+static void import_check(value ids, value bindings, const char *who) {
+  for (; ids->type == TYPE_CONS; ids = cdr(ids)) {
+    value id = car(ids)->type == TYPE_CONS ? caar(ids) : car(ids);
+
+    if (id->type != TYPE_SYMBOL)
+      repl_error("import: %s takes identifiers", who);
+
+    if (!binding_find(bindings, id))
+      repl_error("import: %s names %s, which is not imported", who, id->sym);
+  }
+}
+
+// ((name . value) ...) of an import set
+static value import_set(value set) {
+  if (set->type != TYPE_CONS)
+    repl_error("import: expected a library name");
+
+  value head = car(set);
+  int modified = cdr(set)->type == TYPE_CONS && cadr(set)->type == TYPE_CONS;
+  value bindings = value_new_nil();
+
+  if (modified && (is_named(head, "only") || is_named(head, "except"))) {
+    value from = import_set(cadr(set));
+    int only = is_named(head, "only");
+
+    import_check(cddr(set), from, head->sym);
+
+    for (; from->type == TYPE_CONS; from = cdr(from)) {
+      int named = 0;
+
+      for (value id = cddr(set); id->type == TYPE_CONS; id = cdr(id))
+        named |= car(id) == caar(from);
+
+      if (named == only)
+        bindings = value_new_cons(car(from), bindings);
+    }
+
+    return bindings;
+  }
+
+  if (modified && is_named(head, "prefix")) {
+    value from = import_set(cadr(set));
+
+    if (cddr(set)->type != TYPE_CONS || car(cddr(set))->type != TYPE_SYMBOL)
+      repl_error("import: prefix takes an identifier");
+
+    const char *prefix = car(cddr(set))->sym;
+
+    for (; from->type == TYPE_CONS; from = cdr(from)) {
+      char *name = gcx_malloc(strlen(prefix) + strlen(caar(from)->sym) + 1);
+
+      sprintf(name, "%s%s", prefix, caar(from)->sym);
+      bindings = value_new_cons(
+          value_new_cons(value_new_symbol(name), cdar(from)), bindings);
+    }
+
+    return bindings;
+  }
+
+  if (modified && is_named(head, "rename")) {
+    value from = import_set(cadr(set));
+
+    for (value r = cddr(set); r->type == TYPE_CONS; r = cdr(r))
+      if (car(r)->type != TYPE_CONS || cdar(r)->type != TYPE_CONS ||
+          cadr(car(r))->type != TYPE_SYMBOL)
+        repl_error("import: rename takes (id new-id) pairs");
+
+    import_check(cddr(set), from, "rename");
+
+    for (; from->type == TYPE_CONS; from = cdr(from)) {
+      value name = caar(from);
+
+      for (value r = cddr(set); r->type == TYPE_CONS; r = cdr(r))
+        if (caar(r) == caar(from))
+          name = cadr(car(r));
+
+      bindings = value_new_cons(value_new_cons(name, cdar(from)), bindings);
+    }
+
+    return bindings;
+  }
+
+  // Resolved now, see module.h
+  library l = library_load(set);
+
+  for (value x = l->exports; x->type == TYPE_CONS; x = cdr(x))
+    bindings = value_new_cons(
+        value_new_cons(caar(x), cdr(env_exists(l->e, cdar(x)->sym))),
+        bindings);
+
+  return bindings;
+}
+
+value module_import(value args, env e) {
+  if (e->parent)
+    repl_error("import: only at top level");
+
+  for (; args->type == TYPE_CONS; args = cdr(args))
+    for (value b = import_set(car(args)); b->type == TYPE_CONS; b = cdr(b))
+      env_define(e, caar(b), cdar(b));
+
+  return value_new_bool(1);
+}
@@ -0,0 +1,35 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include "env.h"
+#include "value.h"
+
+/**
+ * Libraries
+ *
+ * (define-library (name ...) declaration ...) makes a library in a global
+ * environment of its own, holding just the builtins and special forms. Its
+ * declarations are done in order:
+ *
+ *   (export id (rename id external) ...)
+ *   (import set ...)
+ *   (begin form ...)
+ *   (include "file" ...)
+ *
+ * (import set ...) binds what libraries export in the global environment.
+ * A set is a library name, (only set id ...), (except set id ...),
+ * (prefix set id) or (rename set (id external) ...). Imports are resolved
+ * when they are made, the importer gets the values exported then and later
+ * definitions in the library do not reach it.
+ *
+ * A library is made once per process. One not made yet is looked up as
+ * name/of/library.lsp in the directories of LETLISP_PATH, the current one
+ * by default, and loaded from its compiled copy in the cache, see
+ * fasl_cached. The table of libraries is not synchronized.
+ */
+
+// Special forms, at top level only
+value module_define_library(value args, env e);
+value module_import(value args, env e);
+
+#endif
@@ -5,10 +5,14 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "builtin.h"
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "memory.h"
 #include "numbers.h"
 #include "parser.h"
-#include "repl.h"
+#include "reader.h"
 #include "value.h"
 
 // TODO: Go over and make sure error state on fp is properly handled
@@ -16,172 +20,306 @@
 /**
  * Minimalist lexer
  */
-typedef enum {
-  TOK_EOF,
-  TOK_LPAREN,
-  TOK_RPAREN,
-  TOK_QUOTE,
-  TOK_SYMBOL,
-  TOK_NUMBER,
-  TOK_BOOL,
-  TOK_STRING,
-  TOK_COMMENT
-} tokenType;
-
-typedef struct {
-  tokenType type;
-  char *text;
-} token;
-
-int peek(FILE *in) {
-  int c = fgetc(in);
+
+// Next byte without consuming it, EOF at end of input
+static inline int peek(reader in) {
+  if (in->pos == in->len && !reader_refill(in))
+    return EOF;
+
+  return (unsigned char)in->buf[in->pos];
+}
+
+static inline int next(reader in) {
+  int c = peek(in);
 
   if (c != EOF)
-    ungetc(c, in);
+    in->pos++;
+
   return c;
 }
 
-// Store for next token
-static token tok = {0};
+static inline int is_symbol_char(int c) {
+  return c > 0 && (isalnum(c) || strchr("+-*/<=>!?_", c));
+}
+
+static inline int is_number_char(int c) {
+  return c != EOF && (isdigit(c) || c == '.' || c == '/');
+}
 
-int token_pushed = 0;
+/**
+ * Character class scanning
+ *
+ * Each scanner advances in->pos past a run of bytes in its class. With
+ * SSE4.2 whole 16 byte blocks are classified by one PCMPESTRI, the scalar
+ * loop finishes the block tail and the scan continues after a refill.
+ */
+#ifdef __SSE4_2__
+#define SCAN_ANY                                                               \
+  (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_NEGATIVE_POLARITY)
+#define SCAN_RANGES                                                            \
+  (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY)
+#define SCAN_UNTIL (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY)
+
+// Scan 16 bytes at a time while the block is entirely in the class
+#define SCAN_BLOCKS(in, set, set_len, mode)                                    \
+  while ((in)->pos + 16 <= (in)->len) {                                        \
+    __m128i block = _mm_loadu_si128((const __m128i *)((in)->buf + (in)->pos)); \
+    int i = _mm_cmpestri(set, set_len, block, 16, mode);                       \
+                                                                               \
+    (in)->pos += i;                                                            \
+    if (i < 16)                                                                \
+      break;                                                                   \
+  }
+#else
+#define SCAN_BLOCKS(in, set, set_len, mode)
+#endif
 
-void token_push(token to_push) {
-  assert(!token_pushed);
+#define SCAN_TAIL(in, test)                                                    \
+  while ((in)->pos < (in)->len && test((unsigned char)(in)->buf[(in)->pos]))   \
+    (in)->pos++;
 
-  tok = to_push;
-  token_pushed = 1;
+static inline int is_not_newline(int c) { return c != '\n'; }
+
+static inline int is_string_char(int c) { return isprint(c) && c != '\"'; }
+
+// Blanks are never part of a token, a refill while skipping them drops them
+static inline int refill_blank(reader in) {
+  in->mark = in->pos;
+  return reader_refill(in);
 }
 
-// Temp buffer for token data
-char buf[1024];
+// Whitespace and comments
+static void scan_blank(reader in) {
+#ifdef __SSE4_2__
+  const __m128i space = _mm_setr_epi8(' ', '\t', '\n', '\v', '\f', '\r', 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i newline = _mm_setr_epi8('\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        0, 0, 0, 0);
+#endif
+
+  for (;;) {
+    do {
+      SCAN_BLOCKS(in, space, 6, SCAN_ANY);
+      SCAN_TAIL(in, isspace);
+    } while (in->pos == in->len && refill_blank(in));
+
+    if (in->pos == in->len || in->buf[in->pos] != ';')
+      return;
+
+    // Comment, up to the newline
+    do {
+      SCAN_BLOCKS(in, newline, 1, SCAN_UNTIL);
+      SCAN_TAIL(in, is_not_newline);
+    } while (in->pos == in->len && refill_blank(in));
+  }
+}
+
+// Digits, '.' and '/'
+static void scan_number(reader in) {
+#ifdef __SSE4_2__
+  const __m128i ranges = _mm_setr_epi8('.', '9', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0);
+#endif
+
+  do {
+    SCAN_BLOCKS(in, ranges, 2, SCAN_RANGES);
+    SCAN_TAIL(in, is_number_char);
+  } while (in->pos == in->len && reader_refill(in));
+}
+
+// Alphanumerics and +-*/<=>!?_
+static void scan_symbol(reader in) {
+#ifdef __SSE4_2__
+  // Eight ranges fill the register, '/' is picked up by the tail loop
+  const __m128i ranges =
+      _mm_setr_epi8('0', '9', '<', '?', 'A', 'Z', '_', '_', 'a', 'z', '!', '!',
+                    '*', '+', '-', '-');
+#endif
+
+  do {
+    SCAN_BLOCKS(in, ranges, 16, SCAN_RANGES);
+    SCAN_TAIL(in, is_symbol_char);
+  } while (in->pos == in->len && reader_refill(in));
+}
+
+// Printable characters other than '"'
+static void scan_string(reader in) {
+#ifdef __SSE4_2__
+  const __m128i ranges = _mm_setr_epi8(' ', '!', '#', '~', 0, 0, 0, 0, 0, 0, 0,
+                                       0, 0, 0, 0, 0);
+#endif
+
+  do {
+    SCAN_BLOCKS(in, ranges, 4, SCAN_RANGES);
+    SCAN_TAIL(in, is_string_char);
+  } while (in->pos == in->len && reader_refill(in));
+}
+
+void token_push(reader in, token to_push) {
+  assert(!in->token_pushed);
+
+  in->pushed = to_push;
+  in->token_pushed = 1;
+}
+
+// Close the token started at in->mark, up to the read position
+static inline token token_slice(reader in, tokenType type, size_t skip) {
+  token t = {.type = type,
+             .text = in->buf + in->mark + skip,
+             .len = in->pos - in->mark - skip};
+
+  return t;
+}
 
 // Simple token reader
-token token_getnext(FILE *in) {
+token token_getnext(reader in) {
+  token t = {0};
 
-  if (token_pushed) {
-    token_pushed = 0;
-    return tok;
+  if (in->token_pushed) {
+    in->token_pushed = 0;
+    return in->pushed;
   }
 
-  // TODO: More robust
-  tok.text = buf;
-
-  // Skip whitespace
   int c;
 
-  while (isspace(c = fgetc(in)))
-    ;
+  scan_blank(in);
+
+  // Everything before the token may be dropped on refill
+  in->mark = in->pos;
+  c = next(in);
 
   if (c == EOF) {
-    tok.type = TOK_EOF;
-    return tok;
+    t.type = TOK_EOF;
+    return t;
   }
 
   if (c == '(') {
-    tok.type = TOK_LPAREN;
-    return tok;
+    t.type = TOK_LPAREN;
+    return t;
   }
 
   if (c == ')') {
-    tok.type = TOK_RPAREN;
-    return tok;
+    t.type = TOK_RPAREN;
+    return t;
   }
 
   if (c == '\'') {
-    tok.type = TOK_QUOTE;
-    return tok;
+    t.type = TOK_QUOTE;
+    return t;
   }
 
-  if (c == ';') {
-    tok.type = TOK_COMMENT;
+  if (c == '#') {
+    c = next(in);
 
-    // Skip comment
-    for (; c != EOF && c != '\n'; c = fgetc(in))
-      ;
+    if (c != 't' && c != 'f')
+      reader_error(in, "Malformated input: #%c\n", c == EOF ? ' ' : c);
 
-    return tok;
+    return token_slice(in, TOK_BOOL, 0);
   }
 
-  if (c == '#') {
-    tok.type = TOK_BOOL;
-    buf[0] = '#';
-    buf[1] = fgetc(in);
-    buf[2] = '\0';
+  // Number
+  if (isdigit(c) || (c == '-' && isdigit(peek(in)))) {
+    scan_number(in);
 
-    if (!strchr("tf", buf[1]))
-      repl_error("Malformated input: %s\n", buf);
+    return token_slice(in, TOK_NUMBER, 0);
+  }
 
-    // tok.text = strdup(buf);
+  // Symbol
+  if (is_symbol_char(c)) {
+    scan_symbol(in);
 
-    return tok;
+    return token_slice(in, TOK_SYMBOL, 0);
   }
 
-  // Number
-  if (isdigit(c) || (c == '-' && isdigit(peek(in)))) {
-    int i = 0;
+  // String literal
+  if (c == '\"') {
+    // TODO: Add escapes
+    scan_string(in);
 
-    buf[i++] = c;
-    while (isdigit(peek(in)) || strchr("./", peek(in)))
-      buf[i++] = fgetc(in);
-    buf[i] = '\0';
+    if (peek(in) != '\"')
+      reader_error(in, "Unterminated string literal: %.*s",
+                   (int)(in->pos - in->mark), in->buf + in->mark);
 
-    tok.type = TOK_NUMBER;
-    return tok;
+    // Without the quotes
+    t = token_slice(in, TOK_STRING, 1);
+    in->pos++;
+
+    return t;
   }
 
-  // Symbol
-  if (isalpha(c) || strchr("+-*/<=>!?_", c)) {
-    int i = 1;
+  reader_error(in, "Unexpected char: '%c'\n", c);
+}
 
-    buf[0] = c;
+/**
+ * Token conversion
+ */
 
-    while (isalnum(peek(in)) || strchr("+-*/<=>!?_", peek(in)))
-      buf[i++] = fgetc(in);
+// Plain decimal integers that fit a long skip the GMP string parser
+static int token_to_long(token t, long *n) {
+  const char *p = t.text;
+  const char *end = t.text + t.len;
+  int neg = 0;
 
-    buf[i] = '\0';
+  if (t.len > 18)
+    return 0;
 
-    tok.type = TOK_SYMBOL;
-    return tok;
+  if (*p == '-') {
+    neg = 1;
+    p++;
   }
 
-  // String literal
-  if (c == '\"') {
-    int i = 0;
+  long acc = 0;
 
-    // TODO: Add escapes
-    c = fgetc(in);
-    while (isprint(c) && '\"' != c) {
-      buf[i] = c;
-      c = fgetc(in);
-      i += 1;
-    }
+  for (; p < end; p++) {
+    if (!isdigit(*p))
+      return 0;
+
+    acc = acc * 10 + (*p - '0');
+  }
+
+  *n = neg ? -acc : acc;
+  return 1;
+}
 
-    buf[i] = '\0';
+static value token_to_number(reader in, token t) {
+  mpq_ptr exact = num_exact_new();
+  long n;
 
-    if (c != '\"')
-      repl_error("Unterminated string literal: %s", buf);
+  if (token_to_long(t, &n)) {
+    mpq_set_si(exact, n, 1);
+    return value_new_exact(exact);
+  }
+
+  // GMP wants a terminated string
+  char *text = strndup(t.text, t.len);
 
-    tok.type = TOK_STRING;
-    return tok;
+  if (0 != mpq_set_str(exact, text, 10)) {
+    free(text);
+    reader_error(in, "Invalid number string: %.*s", (int)t.len, t.text);
   }
 
-  repl_error("Unexpected char: '%c'\n", c);
+  free(text);
+
+  mpq_canonicalize(exact);
+
+  return value_new_exact(exact);
 }
 
+static value token_to_symbol(token t) { return value_intern(t.text, t.len); }
+
 /**
  * Simple parser
  */
 
 // Greey parse all sexps in input
-value parse_all(FILE *in, env e) {
+value parse_all(reader in) {
   value exprs = value_new_nil();
   value *tail = &exprs;
 
   for (;;) {
-    value expr = parse_expression(in, e);
+    value expr = parse_expression(in);
 
-    if (bool_isnil(expr, e))
+    if (!expr)
       return exprs;
 
     *tail = value_new_cons(expr, value_new_nil());
@@ -189,69 +327,114 @@ value parse_all(FILE *in, env e) {
   }
 }
 
-value parse_list(FILE *in, env e) {
-  token t = token_getnext(in);
-
-  if (t.type == TOK_EOF)
-    repl_error("Unbalanced parenthesis");
-
-  if (t.type == TOK_RPAREN)
-    return value_new_nil();
+/**
+ * Lists are built in place on an explicit stack kept in the reader, so
+ * neither nesting depth nor list length uses C stack.
+ */
+static struct parse_frame *parse_push(reader in, int quote) {
+  if (in->depth == in->stack_cap) {
+    in->stack_cap = in->stack_cap ? in->stack_cap * 2 : 64;
+    in->stack =
+        gcx_realloc(in->stack, in->stack_cap * sizeof(struct parse_frame));
+  }
 
-  token_push(t);
+  struct parse_frame *f = in->stack + in->depth++;
 
-  value car_val = parse_expression(in, e);
-  value cdr_val = parse_list(in, e);
+  f->head = value_new_nil();
+  f->last = NULL;
+  f->quote = quote;
 
-  return value_new_cons(car_val, cdr_val);
+  return f;
 }
 
-value parse_expression(FILE *in, env e) {
-
-  // Loop needed for comment, aka skip
+// Parse until the frame at depth base is complete
+static value parse_from(reader in, size_t base) {
   for (;;) {
     token t = token_getnext(in);
+    value v;
 
     switch (t.type) {
     case TOK_LPAREN:
-      return parse_list(in, e);
+      parse_push(in, 0);
+      continue;
 
     case TOK_QUOTE:
-      return value_new_cons(
-          value_new_symbol("quote", e),
-          value_new_cons(parse_expression(in, e), value_new_nil()));
+      parse_push(in, 1);
+      continue;
 
-    case TOK_BOOL:
-      return value_new_bool(t.text[1] == 't');
+    case TOK_RPAREN:
+      if (in->depth == base)
+        reader_error(in, "Unexpected ')' outside list");
 
-    case TOK_NUMBER: {
-      mpq_ptr exact = num_exact_new();
+      if (in->stack[in->depth - 1].quote)
+        reader_error(in, "quote: expected a datum before ')'");
 
-      if (0 != mpq_set_str(exact, t.text, 10))
-        repl_error("Invalid number string: %s", t.text);
+      v = in->stack[--in->depth].head;
+      break;
 
-      mpq_canonicalize(exact);
+    case TOK_BOOL:
+      v = value_new_bool(t.text[1] == 't');
+      break;
 
-      return value_new_exact(exact);
-    }
+    case TOK_NUMBER:
+      v = token_to_number(in, t);
+      break;
 
     case TOK_SYMBOL:
-      return value_new_symbol(t.text, e);
+      v = token_to_symbol(t);
+      break;
 
     case TOK_STRING:
-      return value_new_string(strdup(t.text));
-
-    case TOK_RPAREN:
-      repl_error("Unexpected ')' outside list");
+      v = value_new_string(strndup(t.text, t.len));
+      break;
 
     case TOK_EOF:
-      return value_new_nil();
+      if (in->depth == base)
+        return NULL;
 
-    case TOK_COMMENT:
-      continue;
+      if (in->stack[in->depth - 1].quote)
+        reader_error(in, "Unexpected end of input after quote");
+
+      reader_error(in, "Unbalanced parenthesis");
 
     default:
-      repl_error("Unknown token type");
+      reader_error(in, "Unknown token type");
+    }
+
+    // Hand the finished value to the enclosing frames
+    for (;;) {
+      if (in->depth == base)
+        return v;
+
+      struct parse_frame *f = in->stack + in->depth - 1;
+
+      if (f->quote) {
+        v = value_new_cons(value_new_symbol("quote"),
+                           value_new_cons(v, value_new_nil()));
+        in->depth--;
+        continue;
+      }
+
+      value cell = value_new_cons(v, value_new_nil());
+
+      if (f->last)
+        cdr(f->last) = cell;
+      else
+        f->head = cell;
+
+      f->last = cell;
+      break;
     }
   }
 }
+
+// Rest of a list, after its '('
+value parse_list(reader in) {
+  size_t base = in->depth;
+
+  parse_push(in, 0);
+
+  return parse_from(in, base);
+}
+
+value parse_expression(reader in) { return parse_from(in, in->depth); }
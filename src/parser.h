@@ -1,11 +1,21 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-#include <stdio.h>
-
+#include "reader.h"
 #include "value.h"
 
-value parse_expression(FILE *in, env e);
-value parse_list(FILE *in, env e);
-value parse_all(FILE *in, env e);
+/**
+ * Parser
+ *
+ * Symbols are interned, the parser does not touch any environment. Errors
+ * unwind to in->recover if set, otherwise to the repl of the calling thread.
+ *
+ * parse_expression returns NULL at the end of input.
+ */
+token token_getnext(reader in);
+void token_push(reader in, token to_push);
+
+value parse_expression(reader in);
+value parse_list(reader in);
+value parse_all(reader in);
 #endif
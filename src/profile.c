@@ -0,0 +1,293 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "profile.h"
+
+_Thread_local const char *profile_frames[PROFILE_FRAMES];
+_Thread_local size_t profile_depth;
+
+/**
+ * Samples
+ *
+ * Each sample is its frame count followed by that many names, outermost
+ * first. Only the innermost SAMPLE_DEPTH frames of a deep stack are kept.
+ * The buffer is allocated before the timer starts, samples that do not
+ * fit are counted as dropped.
+ */
+#define SAMPLE_DEPTH 256
+#define SAMPLE_WORDS (4 * 1024 * 1024)
+
+#define TOPLEVEL "<toplevel>"
+#define TRUNCATED "<truncated>"
+
+static uintptr_t *samples;
+static volatile size_t sample_used;
+static volatile size_t sample_count;
+static volatile size_t sample_dropped;
+static volatile sig_atomic_t sampling;
+
+static struct sigaction previous;
+
+static void profile_signal(int sig) {
+  size_t depth = profile_depth;
+  size_t named = depth < PROFILE_FRAMES ? depth : PROFILE_FRAMES;
+  size_t first = named > SAMPLE_DEPTH ? named - SAMPLE_DEPTH : 0;
+  int truncated = first > 0 || named < depth;
+  size_t len = named - first + truncated + (depth == 0);
+
+  if (!sampling)
+    return;
+
+  if (sample_used + len + 1 > SAMPLE_WORDS) {
+    sample_dropped++;
+    return;
+  }
+
+  uintptr_t *out = samples + sample_used;
+
+  *out++ = len;
+
+  if (depth == 0)
+    *out++ = (uintptr_t)TOPLEVEL;
+
+  if (truncated)
+    *out++ = (uintptr_t)TRUNCATED;
+
+  for (size_t i = first; i < named; i++)
+    *out++ = (uintptr_t)profile_frames[i];
+
+  sample_used += len + 1;
+  sample_count++;
+}
+
+int profile_start(void) {
+  if (sampling)
+    return 0;
+
+  if (!samples) {
+    samples = malloc(SAMPLE_WORDS * sizeof(uintptr_t));
+
+    if (!samples) {
+      fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  sample_used = 0;
+  sample_count = 0;
+  sample_dropped = 0;
+
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, &previous);
+
+  struct itimerval timer = {.it_interval = {0, 1000000 / PROFILE_HZ},
+                            .it_value = {0, 1000000 / PROFILE_HZ}};
+
+  sampling = 1;
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  return 1;
+}
+
+void profile_stop(void) {
+  struct itimerval off = {{0, 0}, {0, 0}};
+
+  if (!sampling)
+    return;
+
+  setitimer(ITIMER_PROF, &off, NULL);
+  sampling = 0;
+  sigaction(SIGPROF, &previous, NULL);
+}
+
+/**
+ * Reports
+ */
+typedef struct {
+  const char *name;
+  size_t self;
+  size_t total;
+  size_t last; // sample that last counted towards total
+} profile_entry;
+
+typedef struct {
+  profile_entry *entries;
+  size_t count, cap;
+} profile_table;
+
+static uint64_t hash_name(const char *name) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+
+  return h;
+}
+
+static profile_entry *table_get(profile_table *t, const char *name) {
+  if (2 * (t->count + 1) > t->cap) {
+    profile_table bigger = {.cap = t->cap ? t->cap * 2 : 256};
+
+    bigger.entries = calloc(bigger.cap, sizeof(profile_entry));
+
+    for (size_t i = 0; i < t->cap; i++)
+      if (t->entries[i].name)
+        *table_get(&bigger, t->entries[i].name) = t->entries[i];
+
+    bigger.count = t->count;
+    free(t->entries);
+    *t = bigger;
+  }
+
+  size_t i = hash_name(name) & (t->cap - 1);
+
+  while (t->entries[i].name && strcmp(t->entries[i].name, name) != 0)
+    i = (i + 1) & (t->cap - 1);
+
+  if (!t->entries[i].name) {
+    t->entries[i] = (profile_entry){.name = name, .last = SIZE_MAX};
+    t->count++;
+  }
+
+  return t->entries + i;
+}
+
+static int by_self(const void *a, const void *b) {
+  const profile_entry *x = a, *y = b;
+
+  if (x->self != y->self)
+    return x->self < y->self ? 1 : -1;
+
+  return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static int by_total(const void *a, const void *b) {
+  const profile_entry *x = a, *y = b;
+
+  if (x->total != y->total)
+    return x->total < y->total ? 1 : -1;
+
+  return x->self < y->self ? 1 : x->self > y->self ? -1 : 0;
+}
+
+static void print_table(FILE *out, profile_entry *entries, size_t count,
+                        size_t samples_total) {
+  double scale = samples_total ? 100.0 / samples_total : 0;
+
+  fprintf(out, ";;   self%%  total%%     self    total  procedure\n");
+
+  for (size_t i = 0; i < count; i++)
+    fprintf(out, ";; %7.2f %7.2f %8zu %8zu  %s\n", entries[i].self * scale,
+            entries[i].total * scale, entries[i].self, entries[i].total,
+            entries[i].name);
+}
+
+void profile_report(FILE *out) {
+  profile_table t = {0};
+  size_t pos = 0;
+
+  for (size_t s = 0; s < sample_count; s++) {
+    size_t len = samples[pos++];
+    const char **names = (const char **)(samples + pos);
+
+    table_get(&t, names[len - 1])->self++;
+
+    // Recursive procedures count once per sample
+    for (size_t i = 0; i < len; i++) {
+      profile_entry *entry = table_get(&t, names[i]);
+
+      if (entry->last != s) {
+        entry->last = s;
+        entry->total++;
+      }
+    }
+
+    pos += len;
+  }
+
+  // Compact the table into a sortable array
+  profile_entry *entries = malloc((t.count + 1) * sizeof(profile_entry));
+  size_t count = 0;
+
+  for (size_t i = 0; i < t.cap; i++)
+    if (t.entries[i].name)
+      entries[count++] = t.entries[i];
+
+  fprintf(out, "\n;; profile: %zu samples at %d Hz, %zu dropped\n",
+          sample_count, PROFILE_HZ, sample_dropped);
+
+  fprintf(out, ";; flat\n");
+  qsort(entries, count, sizeof(profile_entry), by_self);
+  print_table(out, entries, count, sample_count);
+
+  fprintf(out, ";; cumulative\n");
+  qsort(entries, count, sizeof(profile_entry), by_total);
+  print_table(out, entries, count, sample_count);
+
+  free(entries);
+  free(t.entries);
+}
+
+static int by_stack(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int profile_write_folded(const char *filename) {
+  FILE *out = fopen(filename, "w");
+
+  if (!out)
+    return 0;
+
+  // Render every sample, equal stacks end up next to each other
+  char **stacks = malloc((sample_count + 1) * sizeof(char *));
+  size_t pos = 0;
+
+  for (size_t s = 0; s < sample_count; s++) {
+    size_t len = samples[pos++];
+    const char **names = (const char **)(samples + pos);
+    size_t size = 1;
+
+    for (size_t i = 0; i < len; i++)
+      size += strlen(names[i]) + 1;
+
+    char *line = malloc(size);
+    char *p = line;
+
+    for (size_t i = 0; i < len; i++) {
+      if (i)
+        *p++ = ';';
+
+      p = stpcpy(p, names[i]);
+    }
+
+    stacks[s] = line;
+    pos += len;
+  }
+
+  qsort(stacks, sample_count, sizeof(char *), by_stack);
+
+  for (size_t s = 0; s < sample_count;) {
+    size_t run = s + 1;
+
+    while (run < sample_count && strcmp(stacks[run], stacks[s]) == 0)
+      run++;
+
+    fprintf(out, "%s %zu\n", stacks[s], run - s);
+
+    for (; s < run; s++)
+      free(stacks[s]);
+  }
+
+  free(stacks);
+
+  return !ferror(out) & !fclose(out);
+}
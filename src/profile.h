@@ -0,0 +1,48 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Shadow stack
+ *
+ * Names of the Lisp procedures being applied on this thread, outermost
+ * first. It is kept whether or not the profiler runs, frames past
+ * PROFILE_FRAMES are counted but not named.
+ */
+#define PROFILE_FRAMES 4096
+
+extern _Thread_local const char *profile_frames[PROFILE_FRAMES];
+extern _Thread_local size_t profile_depth;
+
+static inline void profile_enter(const char *name) {
+  if (profile_depth < PROFILE_FRAMES)
+    profile_frames[profile_depth] = name;
+
+  // The sampling signal must not see the depth before the name
+  __atomic_signal_fence(__ATOMIC_RELEASE);
+  profile_depth++;
+}
+
+static inline void profile_leave(void) { profile_depth--; }
+
+/**
+ * Sampling profiler
+ *
+ * A profiling timer copies the shadow stack of the running thread into a
+ * preallocated buffer, reports are built from it once sampling stops.
+ */
+#define PROFILE_HZ 1000
+
+// 0 if sampling was already running
+int profile_start(void);
+void profile_stop(void);
+
+// Flat and cumulative samples per procedure
+void profile_report(FILE *out);
+
+// One "outer;inner count" line per distinct stack, for flamegraph tools
+int profile_write_folded(const char *filename);
+
+#endif
@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "reader.h"
+#include "repl.h"
+
+#define READER_BLOCK (64 * 1024)
+
+// Give mapped input back in steps of this
+#define READER_RELEASE (1024 * 1024)
+
+/**
+ * Reader
+ */
+// Collected, the parse stack holds values
+static reader reader_new() {
+  reader r = gcx_malloc(sizeof(struct reader_s));
+
+  memset(r, 0, sizeof(struct reader_s));
+  r->fd = -1;
+
+  return r;
+}
+
+reader reader_open_string(const char *str, size_t len) {
+  reader r = reader_new();
+
+  r->buf = str;
+  r->len = len;
+
+  return r;
+}
+
+reader reader_open_fd(int fd) {
+  reader r = reader_new();
+
+  r->fd = fd;
+  r->cap = READER_BLOCK;
+  r->owned = malloc(r->cap);
+
+  if (!r->owned) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  r->buf = r->owned;
+
+  return r;
+}
+
+// Returns NULL if the file can not be opened
+reader reader_open_file(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    reader r;
+
+    if (st.st_size == 0) {
+      close(fd);
+      return reader_open_string("", 0);
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      close(fd);
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+      r = reader_open_string(map, st.st_size);
+      r->mapped = st.st_size;
+      return r;
+    }
+  }
+
+  // Pipes, devices and anything that would not map
+  reader r = reader_open_fd(fd);
+
+  r->owns_fd = 1;
+  return r;
+}
+
+void reader_close(reader r) {
+  if (r->mapped)
+    munmap((void *)r->buf, r->mapped);
+
+  if (r->owns_fd)
+    close(r->fd);
+
+  free(r->owned);
+  gcx_free(r);
+}
+
+size_t reader_refill(reader r) {
+  if (r->fd < 0)
+    return 0;
+
+  // Drop consumed input
+  if (r->mark > 0) {
+    memmove(r->owned, r->owned + r->mark, r->len - r->mark);
+    r->len -= r->mark;
+    r->pos -= r->mark;
+    r->mark = 0;
+  }
+
+  // Grow if a single token fills the buffer
+  if (r->cap - r->len < READER_BLOCK / 2) {
+    r->cap *= 2;
+    r->owned = realloc(r->owned, r->cap);
+
+    if (!r->owned) {
+      fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    r->buf = r->owned;
+  }
+
+  ssize_t n;
+
+  do
+    n = read(r->fd, r->owned + r->len, r->cap - r->len);
+  while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    // End of input, or an error we treat as such
+    if (r->owns_fd)
+      close(r->fd);
+
+    r->fd = -1;
+    r->owns_fd = 0;
+    return 0;
+  }
+
+  r->len += n;
+  return n;
+}
+
+void reader_release(reader r) {
+  // Stream buffers are compacted by reader_refill
+  if (!r->mapped || r->pos - r->released < READER_RELEASE)
+    return;
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t upto = r->pos & ~(page - 1);
+
+  madvise((char *)r->buf + r->released, upto - r->released, MADV_DONTNEED);
+  r->released = upto;
+}
+
+void reader_error(reader r, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(r->error, sizeof(r->error), fmt, ap);
+  va_end(ap);
+
+  // Lookahead and open lists are stale after an error
+  r->token_pushed = 0;
+  r->depth = 0;
+
+  if (r->recover)
+    longjmp(*r->recover, 1);
+
+  repl_error("%s", r->error);
+}
@@ -0,0 +1,85 @@
+#ifndef READER_H
+#define READER_H
+
+#include <setjmp.h>
+#include <stddef.h>
+
+/**
+ * Reader input
+ *
+ * Regular files are mapped whole, pipes and terminals are read in large
+ * blocks into a buffer that grows to fit the longest token. The lexer works
+ * directly on buf, tokens are slices of it.
+ */
+typedef struct reader_s *reader;
+
+/**
+ * Tokens
+ */
+typedef enum {
+  TOK_EOF,
+  TOK_LPAREN,
+  TOK_RPAREN,
+  TOK_QUOTE,
+  TOK_SYMBOL,
+  TOK_NUMBER,
+  TOK_BOOL,
+  TOK_STRING
+} tokenType;
+
+typedef struct {
+  tokenType type;
+  const char *text; // slice of the reader buffer, not terminated
+  size_t len;
+} token;
+
+// Open list or pending quote
+struct parse_frame {
+  struct value_s *head; // list so far
+  struct value_s *last; // its last cons, NULL while empty
+  int quote;            // waiting for the datum after '
+};
+
+/**
+ * All parser state lives in the reader, readers on different threads are
+ * independent of each other.
+ */
+struct reader_s {
+  const char *buf; // input bytes
+  size_t len;      // valid bytes in buf
+  size_t pos;      // read position
+  size_t mark;     // start of the token being read, kept across refills
+
+  int fd;          // refill source, -1 when buf holds all input
+  int owns_fd;     // close fd with the reader
+  char *owned;     // buffer for fd input
+  size_t cap;      // size of owned
+  size_t mapped;   // length of the mapping, 0 if not mapped
+  size_t released; // mapped bytes already given back
+
+  token pushed;     // one token of lookahead
+  int token_pushed; // pushed is valid
+
+  struct parse_frame *stack; // open lists, innermost last
+  size_t depth;              // frames in use
+  size_t stack_cap;          // frames allocated
+
+  jmp_buf *recover; // parse errors jump here when set
+  char error[256];  // message of the last parse error
+};
+
+reader reader_open_file(const char *filename);
+reader reader_open_fd(int fd);
+reader reader_open_string(const char *str, size_t len);
+void reader_close(reader r);
+
+// Read more input, discarding everything before mark. 0 at end of input
+size_t reader_refill(reader r);
+
+// Input before the read position is no longer needed
+void reader_release(reader r);
+
+// Record a parse error and unwind to r->recover, or to the repl
+__attribute__((noreturn)) void reader_error(reader r, const char *fmt, ...);
+
+#endif
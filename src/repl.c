@@ -7,15 +7,21 @@
 #include <readline/history.h>
 #include <readline/readline.h>
 
+#include "aot.h"
 #include "builtin.h"
 #include "env.h"
 #include "eval.h"
+#include "fasl.h"
+#include "memory.h"
 #include "parser.h"
+#include "profile.h"
 #include "repl.h"
 #include "value.h"
 
-// Error jmp point
-jmp_buf repl_env;
+// Error jmp point, one per thread
+_Thread_local jmp_buf repl_env;
+
+_Thread_local int repl_quiet;
 
 #define HISTORY_FILE ".letlisp_history"
 
@@ -24,38 +30,65 @@ void repl_error(const char *fmt, ...) {
 
   va_start(ap, fmt);
 
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
+  if (!repl_quiet) {
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+  }
 
   va_end(ap);
   longjmp(repl_env, 1);
 }
 
-value repl_eval(FILE *in, env e) {
+// One top level form at a time, each is garbage once evaluated
+value repl_eval(reader in, env e) {
+  value result = value_new_nil();
+  value expr;
 
-  value expr = parse_all(in, e);
+  while ((expr = parse_expression(in))) {
+    result = eval(value_code(expr), e);
 
-  if (bool_isnil(expr, e))
-    return value_new_nil();
-
-  // Prepend a begin for idiomatic REPL behaviour
-  expr = value_new_cons(value_new_symbol("begin", e), expr);
+    reader_release(in);
+  }
 
-  return eval(expr, e);
+  return result;
 }
 
 value repl_eval_file(char *filename, env e) {
   value ret;
 
-  FILE *fp = fopen(filename, "r");
+  if (aot_is_shared(filename))
+    return aot_load(filename, e);
+
+  // Prefer an up to date compiled file
+  if (fasl_is_fasl(filename))
+    return fasl_load(filename, e);
+
+  char *compiled = fasl_fresh(filename);
+
+  if (compiled)
+    return fasl_load(compiled, e);
 
-  if (!fp)
+  reader in = reader_open_file(filename);
+
+  if (!in)
     repl_error("error: could not open file '%s'\n", filename);
 
-  ret = repl_eval(fp, e);
+  // Close the reader when an error unwinds past us, then pass it on
+  jmp_buf outer;
+
+  memcpy(outer, repl_env, sizeof(jmp_buf));
+
+  if (setjmp(repl_env) != 0) {
+    reader_close(in);
+    memcpy(repl_env, outer, sizeof(jmp_buf));
+    longjmp(repl_env, 1);
+  }
 
-  fclose(fp);
+  ret = repl_eval(in, e);
+
+  memcpy(repl_env, outer, sizeof(jmp_buf));
+  reader_close(in);
   return ret;
 }
 
@@ -66,9 +99,14 @@ void repl(env e) {
 
   // Loop
   for (;;) {
-    if (setjmp(repl_env) != 0)
+    if (setjmp(repl_env) != 0) {
       printf("Error recovered.\n");
 
+      // Frames of the failed expression are gone
+      profile_depth = 0;
+      frame_reset();
+    }
+
     // Read
     char *input_string;
 
@@ -80,15 +118,13 @@ void repl(env e) {
     if (*input_string)
       add_history(input_string);
 
-    FILE *input;
-
-    input = fmemopen(input_string, strlen(input_string), "r");
+    reader input = reader_open_string(input_string, strlen(input_string));
 
     // Eval and Print
     value_print(repl_eval(input, e));
     printf("\n");
 
-    fclose(input);
+    reader_close(input);
     free(input_string);
   }
 
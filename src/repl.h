@@ -5,9 +5,13 @@
 #include <stdio.h>
 
 #include "env.h"
+#include "reader.h"
 #include "value.h"
 
-extern jmp_buf repl_env;
+extern _Thread_local jmp_buf repl_env;
+
+// Errors unwind without a message while set
+extern _Thread_local int repl_quiet;
 
 // Return to repl prompt on error
 __attribute__((noreturn)) void repl_error(const char *fmt, ...);
@@ -16,7 +20,7 @@ __attribute__((noreturn)) void repl_error(const char *fmt, ...);
 void repl(env e);
 
 // eval and print last result
-value repl_eval(FILE *in, env e);
+value repl_eval(reader in, env e);
 
 // for loading
 value repl_eval_file(char *filename, env e);
@@ -0,0 +1,453 @@
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "memory.h"
+#include "profile.h"
+#include "repl.h"
+#include "thread.h"
+#include "trace.h"
+
+typedef struct green_s *green;
+
+typedef struct {
+  green head, tail;
+} green_queue;
+
+enum { GREEN_RUNNING, GREEN_READY, GREEN_BLOCKED, GREEN_DONE, GREEN_FAILED };
+
+struct green_s {
+  ucontext_t context;
+  value thunk;
+  env e;
+  value result;    // of the thunk, or the value a channel handed over
+  int state;
+  int deadlock;    // woken because every thread is blocked
+  char *stack;     // guard page first, NULL for the main program
+  void *sp;        // in the stack, everything in use is above it
+  green next;      // in the ready queue or one wait queue
+  green next_live; // every thread not done yet, both ways
+  green prev_live;
+  green_queue joiners;
+
+  // Thread locals of the evaluator while switched out
+  jmp_buf unwind;
+  int quiet;
+  frame_region frames;
+  size_t profile_depth;
+  const char **profile_frames; // the named ones of the shadow stack
+  size_t profile_room;
+  struct trace_ring *trace;
+};
+
+struct channel_s {
+  value head, tail; // buffered values, oldest first
+  long count, capacity;
+  green_queue senders, receivers;
+};
+
+/**
+ * Scheduler
+ *
+ * Not synchronized, threads belong to the OS thread running them.
+ */
+#define STACK_POOL 64 // stacks of finished threads kept for new ones
+
+static struct green_s main_thread;
+static void *main_bottom;
+
+static green current = NULL; // NULL until first used
+static green_queue ready;
+static green live;
+static green finished; // its stack is released once off it
+
+static char *stack_pool[STACK_POOL];
+static int stack_pool_count;
+
+static void queue_push(green_queue *q, green g) {
+  g->next = NULL;
+
+  if (q->tail)
+    q->tail->next = g;
+  else
+    q->head = g;
+
+  q->tail = g;
+}
+
+static green queue_pop(green_queue *q) {
+  green g = q->head;
+
+  if (g && !(q->head = g->next))
+    q->tail = NULL;
+
+  return g;
+}
+
+static void queue_remove(green_queue *q, green g) {
+  green prev = NULL;
+
+  for (green c = q->head; c; prev = c, c = c->next)
+    if (c == g) {
+      if (prev)
+        prev->next = g->next;
+      else
+        q->head = g->next;
+
+      if (q->tail == g)
+        q->tail = prev;
+
+      return;
+    }
+}
+
+static size_t stack_guard(void) { return sysconf(_SC_PAGESIZE); }
+
+static void *stack_bottom(green g) {
+  return g->stack ? g->stack + stack_guard() + THREAD_STACK : main_bottom;
+}
+
+static char *stack_new(void) {
+  if (stack_pool_count)
+    return stack_pool[--stack_pool_count];
+
+  char *stack = mmap(NULL, stack_guard() + THREAD_STACK,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                     -1, 0);
+
+  if (stack == MAP_FAILED)
+    repl_error("spawn: out of memory for thread stacks");
+
+  // Running off the end faults instead of corrupting the next mapping
+  mprotect(stack, stack_guard(), PROT_NONE);
+
+  return stack;
+}
+
+// Release the stack of a finished thread, once on another one
+static void stack_collect(void) {
+  if (!finished)
+    return;
+
+  char *stack = finished->stack;
+
+  finished = NULL;
+
+  if (stack_pool_count < STACK_POOL)
+    stack_pool[stack_pool_count++] = stack;
+  else
+    munmap(stack, stack_guard() + THREAD_STACK);
+}
+
+// Stacks the collector does not see, every thread switched out
+static void push_stacks(mem_push push) {
+  for (green g = live; g; g = g->next_live)
+    if (g != current)
+      push(g->sp, stack_bottom(g));
+}
+
+static void green_init(void) {
+  if (current)
+    return;
+
+  main_thread.state = GREEN_RUNNING;
+  main_bottom = mem_stack_main();
+  live = &main_thread;
+  current = &main_thread;
+  mem_stack_roots(push_stacks);
+}
+
+// The shadow stack of the OS thread is shared, each thread keeps a copy
+// of its own while switched out. The depth is 0 meanwhile so samples never
+// mix the names of two threads.
+static void profile_save(green self) {
+  size_t named =
+      profile_depth < PROFILE_FRAMES ? profile_depth : PROFILE_FRAMES;
+
+  if (named > self->profile_room) {
+    self->profile_frames =
+        gcx_realloc(self->profile_frames, named * sizeof(const char *));
+    self->profile_room = named;
+  }
+
+  memcpy(self->profile_frames, profile_frames, named * sizeof(const char *));
+  self->profile_depth = profile_depth;
+  profile_depth = 0;
+}
+
+static void profile_restore(green self) {
+  size_t named = self->profile_depth < PROFILE_FRAMES ? self->profile_depth
+                                                       : PROFILE_FRAMES;
+
+  memcpy(profile_frames, self->profile_frames, named * sizeof(const char *));
+  __atomic_signal_fence(__ATOMIC_RELEASE);
+  profile_depth = self->profile_depth;
+}
+
+// After a switch back to self
+static void green_resume(green self) {
+  stack_collect();
+  mem_stack_enter(stack_bottom(self));
+
+  memcpy(repl_env, self->unwind, sizeof(jmp_buf));
+  repl_quiet = self->quiet;
+  frames = self->frames;
+  profile_restore(self);
+  trace_ring_swap(self->trace);
+  self->state = GREEN_RUNNING;
+}
+
+// Run next until something switches back to the current thread
+static void green_switch(green next) {
+  green self = current;
+  char here;
+
+  memcpy(self->unwind, repl_env, sizeof(jmp_buf));
+  self->quiet = repl_quiet;
+  self->frames = frames;
+  profile_save(self);
+  self->trace = trace_ring_swap(NULL);
+  self->sp = &here;
+
+  current = next;
+  swapcontext(&self->context, &next->context);
+  green_resume(self);
+}
+
+// Thread to switch to when the current one stops, the main program with
+// deadlock set when none is ready
+static green green_next(void) {
+  green g = queue_pop(&ready);
+
+  if (g)
+    return g;
+
+  main_thread.deadlock = 1;
+  return &main_thread;
+}
+
+static void green_ready(green g) {
+  g->state = GREEN_READY;
+  queue_push(&ready, g);
+}
+
+// Wait in queue until woken, who is the builtin waiting
+static void green_block(green_queue *queue, const char *who) {
+  green self = current;
+
+  if (self == &main_thread && !ready.head)
+    repl_error("%s: every thread is blocked", who);
+
+  self->state = GREEN_BLOCKED;
+  queue_push(queue, self);
+  green_switch(green_next());
+
+  if (self->deadlock) {
+    self->deadlock = 0;
+    queue_remove(queue, self);
+    repl_error("%s: every thread is blocked", who);
+  }
+}
+
+static void green_start(void) {
+  green self = current;
+
+  stack_collect();
+  mem_stack_enter(stack_bottom(self));
+
+  repl_quiet = 0;
+  frames = (frame_region){.collected = 1};
+
+  if (setjmp(repl_env) == 0) {
+    self->result = eval_apply(self->thunk, value_new_nil(), self->e);
+    self->state = GREEN_DONE;
+  } else
+    self->state = GREEN_FAILED;
+
+  for (green g; (g = queue_pop(&self->joiners));)
+    green_ready(g);
+
+  if (self->next_live)
+    self->next_live->prev_live = self->prev_live;
+
+  if (self->prev_live)
+    self->prev_live->next_live = self->next_live;
+  else
+    live = self->next_live;
+
+  self->thunk = NULL;
+  self->e = NULL;
+  finished = self;
+  green_switch(green_next());
+}
+
+/**
+ * Builtins
+ */
+value builtin_spawn(value args, env e) {
+  if (args->type != TYPE_CONS || cdr(args)->type != TYPE_NIL ||
+      (car(args)->type != TYPE_CLOSURE && car(args)->type != TYPE_FUNCTION))
+    repl_error("spawn takes one procedure of no arguments");
+
+  green_init();
+
+  green g = gcx_malloc(sizeof(struct green_s));
+
+  // Scopes of a call may be in the frame region, gone once it returns
+  while (e->parent)
+    e = e->parent;
+
+  g->thunk = car(args);
+  g->e = e;
+  g->stack = stack_new();
+
+  getcontext(&g->context);
+  g->context.uc_stack.ss_sp = g->stack + stack_guard();
+  g->context.uc_stack.ss_size = THREAD_STACK;
+  g->context.uc_link = NULL;
+  makecontext(&g->context, green_start, 0);
+
+  g->sp = stack_bottom(g);
+  g->next_live = live;
+  live->prev_live = g;
+  live = g;
+  green_ready(g);
+
+  value v = value_alloc(TYPE_THREAD);
+
+  v->thread = g;
+  return v;
+}
+
+value builtin_yield(value args, env e) {
+  if (current && ready.head) {
+    green_ready(current);
+    green_switch(queue_pop(&ready));
+  }
+
+  return value_new_bool(1);
+}
+
+value builtin_join(value args, env e) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_THREAD)
+    repl_error("join takes a thread");
+
+  green g = car(args)->thread;
+
+  if (g == current)
+    repl_error("join: a thread can not join itself");
+
+  while (g->state != GREEN_DONE && g->state != GREEN_FAILED)
+    green_block(&g->joiners, "join");
+
+  if (g->state == GREEN_FAILED)
+    repl_error("join: the thread ended with an error");
+
+  return g->result;
+}
+
+value builtin_make_channel(value args, env e) {
+  long capacity = 0;
+
+  if (args->type == TYPE_CONS) {
+    value n = car(args);
+
+    if (n->type != TYPE_NUM_EXACT ||
+        mpz_cmp_ui(mpq_denref(n->num_exact), 1) != 0 ||
+        mpq_sgn(n->num_exact) < 0 ||
+        !mpz_fits_slong_p(mpq_numref(n->num_exact)))
+      repl_error("make-channel: capacity must be a count");
+
+    capacity = mpz_get_si(mpq_numref(n->num_exact));
+  }
+
+  struct channel_s *c = gcx_malloc(sizeof(struct channel_s));
+
+  c->head = c->tail = value_new_nil();
+  c->capacity = capacity;
+
+  value v = value_alloc(TYPE_CHANNEL);
+
+  v->channel = c;
+  return v;
+}
+
+static struct channel_s *channel_arg(value args, const char *who) {
+  if (args->type != TYPE_CONS || car(args)->type != TYPE_CHANNEL)
+    repl_error("%s takes a channel", who);
+
+  green_init();
+
+  return car(args)->channel;
+}
+
+static void channel_put(struct channel_s *c, value v) {
+  value cell = value_new_cons(v, value_new_nil());
+
+  if (c->count++)
+    cdr(c->tail) = cell;
+  else
+    c->head = cell;
+
+  c->tail = cell;
+}
+
+value builtin_channel_send(value args, env e) {
+  struct channel_s *c = channel_arg(args, "channel-send");
+
+  if (cdr(args)->type != TYPE_CONS)
+    repl_error("channel-send takes a channel and a value");
+
+  value v = cadr(args);
+  green receiver = queue_pop(&c->receivers);
+
+  if (receiver) {
+    receiver->result = v;
+    green_ready(receiver);
+  } else if (c->count < c->capacity)
+    channel_put(c, v);
+  else {
+    // The receiver taking it wakes us
+    current->result = v;
+    green_block(&c->senders, "channel-send");
+  }
+
+  return value_new_bool(1);
+}
+
+value builtin_channel_receive(value args, env e) {
+  struct channel_s *c = channel_arg(args, "channel-receive");
+  green sender;
+
+  if (c->count) {
+    value v = car(c->head);
+
+    c->head = cdr(c->head);
+
+    if (!--c->count)
+      c->tail = c->head;
+
+    // Room for one waiting sender
+    if ((sender = queue_pop(&c->senders))) {
+      channel_put(c, sender->result);
+      green_ready(sender);
+    }
+
+    return v;
+  }
+
+  if ((sender = queue_pop(&c->senders))) {
+    green_ready(sender);
+    return sender->result;
+  }
+
+  // The sender hands it over in our result
+  green_block(&c->receivers, "channel-receive");
+
+  return current->result;
+}
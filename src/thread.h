@@ -0,0 +1,39 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "env.h"
+#include "value.h"
+
+/**
+ * Green threads
+ *
+ * (spawn thunk) applies thunk in a thread of its own, (yield) lets the
+ * others run and (join thread) waits for one to finish, returning what its
+ * thunk returned. (make-channel [capacity]) makes a channel between threads,
+ * (channel-send channel value) waits for room in it, or for a receiver when
+ * capacity is 0, the default, and (channel-receive channel) waits for a
+ * value.
+ *
+ * Threads are cooperative, they only switch where they yield, join, send
+ * or receive, in first come first served order. All of them run on the OS
+ * thread that first spawned one, each on a stack of its own. Recursion is
+ * all there is to loop with, so a stack gets as much address space as the
+ * main one usually has, only what is used is mapped. Their scopes come from
+ * the collector, not the frame region of memory.h.
+ *
+ * An error ends the thread it happens in, joining it is an error too. When
+ * every thread is blocked the main program gets an error, threads still
+ * blocked or ready when it ends are dropped. Each thread has a shadow stack
+ * of its own for the profiler and a trace ring of its own, traces show
+ * threads as threads.
+ */
+#define THREAD_STACK (8 * 1024 * 1024)
+
+value builtin_spawn(value args, env e);
+value builtin_yield(value args, env e);
+value builtin_join(value args, env e);
+value builtin_make_channel(value args, env e);
+value builtin_channel_send(value args, env e);
+value builtin_channel_receive(value args, env e);
+
+#endif
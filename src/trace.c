@@ -0,0 +1,436 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "trace.h"
+
+int trace_enabled;
+
+static uint64_t trace_epoch;
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Rings
+ *
+ * One per thread that ever recorded an event, all of them are linked so a
+ * dump sees every thread. Only the owning thread writes to a ring.
+ */
+struct trace_ring {
+  struct trace_event *events;
+  uint64_t mask; // capacity - 1
+  uint64_t next; // events ever written
+  unsigned tid;
+  struct trace_ring *link;
+};
+
+static _Thread_local struct trace_ring *ring;
+static struct trace_ring *rings;
+static unsigned ring_count;
+static atomic_flag rings_lock = ATOMIC_FLAG_INIT;
+
+static inline void rings_acquire() {
+  while (atomic_flag_test_and_set_explicit(&rings_lock, memory_order_acquire))
+    sched_yield();
+}
+
+static inline void rings_release() {
+  atomic_flag_clear_explicit(&rings_lock, memory_order_release);
+}
+
+static void *trace_alloc(size_t size) {
+  void *ptr = malloc(size);
+
+  if (!ptr) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return ptr;
+}
+
+static struct trace_ring *ring_new() {
+  struct trace_ring *r = trace_alloc(sizeof(struct trace_ring));
+  const char *env = getenv("LETLISP_TRACE_EVENTS");
+  uint64_t cap = 1;
+  uint64_t want = env ? strtoull(env, NULL, 10) : 0;
+
+  if (!want)
+    want = TRACE_EVENTS;
+
+  // Round up to a power of two
+  while (cap < want)
+    cap *= 2;
+
+  r->events = trace_alloc(cap * sizeof(struct trace_event));
+  r->mask = cap - 1;
+  r->next = 0;
+
+  rings_acquire();
+  r->tid = ++ring_count;
+  r->link = rings;
+  rings = r;
+  rings_release();
+
+  return r;
+}
+
+void trace_event(const char *name, int kind) {
+  if (!ring)
+    ring = ring_new();
+
+  struct trace_event *ev = ring->events + (ring->next & ring->mask);
+
+  ev->ns = now_ns() - trace_epoch;
+  ev->name = name;
+  ev->depth = profile_depth;
+  ev->kind = kind;
+
+  ring->next++;
+}
+
+struct trace_ring *trace_ring_swap(struct trace_ring *r) {
+  struct trace_ring *previous = ring;
+
+  ring = r;
+  return previous;
+}
+
+int trace_start(void) {
+  if (trace_enabled)
+    return 0;
+
+  rings_acquire();
+
+  for (struct trace_ring *r = rings; r; r = r->link)
+    r->next = 0;
+
+  rings_release();
+
+  trace_epoch = now_ns();
+  trace_enabled = 1;
+
+  return 1;
+}
+
+void trace_stop(void) { trace_enabled = 0; }
+
+// Oldest event still in the ring
+static inline uint64_t ring_first(struct trace_ring *r) {
+  return r->next > r->mask + 1 ? r->next - (r->mask + 1) : 0;
+}
+
+/**
+ * Calls
+ *
+ * Entry and exit events are paired back into calls by depth. Frames whose
+ * exit never came, because an error unwound them, end when an outer frame
+ * ends or a sibling starts. Frames whose entry was overwritten are skipped.
+ */
+struct trace_frame {
+  const char *name;
+  uint64_t start;
+  uint64_t children; // time spent in calls made by this one
+};
+
+typedef void (*trace_call_fn)(void *ctx, struct trace_frame *stack,
+                              size_t depth, uint64_t total, uint64_t self);
+
+typedef struct {
+  struct trace_frame *stack;
+  size_t size, cap;
+  trace_call_fn emit;
+  void *ctx;
+} trace_walk;
+
+static void walk_close(trace_walk *w, uint64_t ns) {
+  struct trace_frame *f = w->stack + w->size - 1;
+  uint64_t total = ns - f->start;
+
+  w->emit(w->ctx, w->stack, w->size, total, total - f->children);
+
+  if (--w->size > 0)
+    w->stack[w->size - 1].children += total;
+}
+
+static void walk_ring(trace_walk *w, struct trace_ring *r) {
+  uint64_t last = 0;
+
+  w->size = 0;
+
+  for (uint64_t i = ring_first(r); i < r->next; i++) {
+    struct trace_event *ev = r->events + (i & r->mask);
+    size_t depth = ev->depth;
+
+    last = ev->ns;
+
+    if (ev->kind == TRACE_BEGIN) {
+      while (w->size >= depth)
+        walk_close(w, ev->ns);
+
+      if (depth > w->cap) {
+        w->cap = depth * 2;
+        w->stack = realloc(w->stack, w->cap * sizeof(struct trace_frame));
+      }
+
+      // Callers whose entries were overwritten
+      while (w->size + 1 < depth)
+        w->stack[w->size++] =
+            (struct trace_frame){.name = "<unknown>", .start = ev->ns};
+
+      w->stack[w->size++] = (struct trace_frame){.name = ev->name,
+                                                 .start = ev->ns};
+      continue;
+    }
+
+    while (w->size > depth)
+      walk_close(w, ev->ns);
+
+    if (w->size == depth && depth > 0 &&
+        w->stack[depth - 1].name == ev->name)
+      walk_close(w, ev->ns);
+  }
+
+  // Calls still running when tracing stopped
+  while (w->size > 0)
+    walk_close(w, last);
+}
+
+static void walk_all(trace_call_fn emit, void *ctx) {
+  trace_walk w = {.emit = emit, .ctx = ctx};
+
+  rings_acquire();
+
+  for (struct trace_ring *r = rings; r; r = r->link)
+    walk_ring(&w, r);
+
+  rings_release();
+  free(w.stack);
+}
+
+/**
+ * Report
+ */
+struct trace_call {
+  const char *name;
+  uint64_t ns;
+};
+
+typedef struct {
+  struct trace_call *calls;
+  size_t count, cap;
+} trace_calls;
+
+static void collect_call(void *ctx, struct trace_frame *stack, size_t depth,
+                         uint64_t total, uint64_t self) {
+  trace_calls *c = ctx;
+
+  if (c->count == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 1024;
+    c->calls = realloc(c->calls, c->cap * sizeof(struct trace_call));
+  }
+
+  c->calls[c->count++] =
+      (struct trace_call){.name = stack[depth - 1].name, .ns = total};
+}
+
+static int by_name_time(const void *a, const void *b) {
+  const struct trace_call *x = a, *y = b;
+  int order = strcmp(x->name, y->name);
+
+  if (order)
+    return order;
+
+  return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+struct trace_summary {
+  const char *name;
+  size_t calls;
+  uint64_t total, p50, p99, max;
+};
+
+static int by_total(const void *a, const void *b) {
+  const struct trace_summary *x = a, *y = b;
+
+  return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+void trace_report(FILE *out) {
+  trace_calls c = {0};
+
+  walk_all(collect_call, &c);
+
+  // Durations of each procedure end up sorted next to each other
+  qsort(c.calls, c.count, sizeof(struct trace_call), by_name_time);
+
+  struct trace_summary *sums =
+      trace_alloc((c.count + 1) * sizeof(struct trace_summary));
+  size_t count = 0;
+
+  for (size_t i = 0; i < c.count;) {
+    size_t run = i;
+    uint64_t total = 0;
+
+    for (; run < c.count && strcmp(c.calls[run].name, c.calls[i].name) == 0;
+         run++)
+      total += c.calls[run].ns;
+
+    size_t n = run - i;
+
+    sums[count++] = (struct trace_summary){.name = c.calls[i].name,
+                                           .calls = n,
+                                           .total = total,
+                                           .p50 = c.calls[i + n / 2].ns,
+                                           .p99 = c.calls[i + n * 99 / 100].ns,
+                                           .max = c.calls[run - 1].ns};
+    i = run;
+  }
+
+  qsort(sums, count, sizeof(struct trace_summary), by_total);
+
+  fprintf(out, "\n;; trace: %zu calls\n", c.count);
+  fprintf(out, ";;    calls   total-ms    mean-us     p50-us     p99-us     "
+               "max-us  procedure\n");
+
+  for (size_t i = 0; i < count; i++)
+    fprintf(out, ";; %8zu %10.3f %10.3f %10.3f %10.3f %10.3f  %s\n",
+            sums[i].calls, sums[i].total / 1e6,
+            sums[i].total / 1e3 / sums[i].calls, sums[i].p50 / 1e3,
+            sums[i].p99 / 1e3, sums[i].max / 1e3, sums[i].name);
+
+  free(sums);
+  free(c.calls);
+}
+
+/**
+ * Folded stacks, weighted by self time in nanoseconds
+ */
+struct trace_stack {
+  char *path;
+  uint64_t ns;
+};
+
+typedef struct {
+  struct trace_stack *stacks;
+  size_t count, cap;
+} trace_stacks;
+
+static void collect_stack(void *ctx, struct trace_frame *stack, size_t depth,
+                          uint64_t total, uint64_t self) {
+  trace_stacks *s = ctx;
+  size_t size = 1;
+
+  for (size_t i = 0; i < depth; i++)
+    size += strlen(stack[i].name) + 1;
+
+  char *path = trace_alloc(size);
+  char *p = path;
+
+  for (size_t i = 0; i < depth; i++) {
+    if (i)
+      *p++ = ';';
+
+    p = stpcpy(p, stack[i].name);
+  }
+
+  if (s->count == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->stacks = realloc(s->stacks, s->cap * sizeof(struct trace_stack));
+  }
+
+  s->stacks[s->count++] = (struct trace_stack){.path = path, .ns = self};
+}
+
+static int by_path(const void *a, const void *b) {
+  return strcmp(((const struct trace_stack *)a)->path,
+                ((const struct trace_stack *)b)->path);
+}
+
+int trace_write_folded(const char *filename) {
+  FILE *out = fopen(filename, "w");
+
+  if (!out)
+    return 0;
+
+  trace_stacks s = {0};
+
+  walk_all(collect_stack, &s);
+  qsort(s.stacks, s.count, sizeof(struct trace_stack), by_path);
+
+  for (size_t i = 0; i < s.count;) {
+    size_t run = i;
+    uint64_t ns = 0;
+
+    for (; run < s.count && strcmp(s.stacks[run].path, s.stacks[i].path) == 0;
+         run++)
+      ns += s.stacks[run].ns;
+
+    fprintf(out, "%s %llu\n", s.stacks[i].path, (unsigned long long)ns);
+
+    for (; i < run; i++)
+      free(s.stacks[i].path);
+  }
+
+  free(s.stacks);
+
+  return !ferror(out) & !fclose(out);
+}
+
+/**
+ * Chrome trace event format, loads in chrome://tracing and Perfetto
+ */
+static void write_json_string(FILE *out, const char *text) {
+  fputc('"', out);
+
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\')
+      fputc('\\', out);
+
+    fputc(*text, out);
+  }
+
+  fputc('"', out);
+}
+
+int trace_write_chrome(const char *filename) {
+  FILE *out = fopen(filename, "w");
+
+  if (!out)
+    return 0;
+
+  int pid = getpid();
+  const char *sep = "\n";
+
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+  rings_acquire();
+
+  for (struct trace_ring *r = rings; r; r = r->link)
+    for (uint64_t i = ring_first(r); i < r->next; i++) {
+      struct trace_event *ev = r->events + (i & r->mask);
+
+      fprintf(out, "%s{\"name\": ", sep);
+      write_json_string(out, ev->name);
+      fprintf(out, ", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %u}",
+              ev->kind == TRACE_BEGIN ? 'B' : 'E', ev->ns / 1e3, pid, r->tid);
+      sep = ",\n";
+    }
+
+  rings_release();
+
+  fprintf(out, "\n]}\n");
+
+  return !ferror(out) & !fclose(out);
+}
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Call tracing
+ *
+ * While enabled every closure and builtin application records an entry and
+ * an exit event with a timestamp and its shadow stack depth. Events go to
+ * a ring buffer of the calling thread, when it is full the oldest events
+ * are overwritten. Recorded events can be summarized or exported as a
+ * Chrome trace or as folded stacks weighted by self time.
+ */
+enum { TRACE_BEGIN, TRACE_END };
+
+struct trace_event {
+  uint64_t ns; // since tracing started
+  const char *name;
+  uint32_t depth; // shadow stack depth inside the call
+  uint32_t kind;
+};
+
+struct trace_ring;
+
+// Default ring size per thread, LETLISP_TRACE_EVENTS overrides it
+#define TRACE_EVENTS (256 * 1024)
+
+extern int trace_enabled;
+
+void trace_event(const char *name, int kind);
+
+static inline void trace_enter(const char *name) {
+  if (trace_enabled)
+    trace_event(name, TRACE_BEGIN);
+}
+
+static inline void trace_leave(const char *name) {
+  if (trace_enabled)
+    trace_event(name, TRACE_END);
+}
+
+// Makes r the ring of this thread, NULL for a new one at its next event,
+// and returns the one before. Green threads switch rings, see thread.h
+struct trace_ring *trace_ring_swap(struct trace_ring *r);
+
+// Clears all rings, 0 if tracing was already on
+int trace_start(void);
+void trace_stop(void);
+
+// Calls, total time and latency percentiles per procedure
+void trace_report(FILE *out);
+
+// Both return 0 if filename can not be written
+int trace_write_chrome(const char *filename);
+int trace_write_folded(const char *filename);
+
+#endif
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,19 +10,72 @@
 #include "memory.h"
 #include "value.h"
 
-int is_special(const char *sym);
-int bool_isnil(value value, env e);
-
 /**
  * LISP values
  */
+static size_t alloc_counts[TYPE_COUNT];
+
+// Relaxed, the counts order nothing
+static inline void alloc_count(valueType type) {
+  __atomic_fetch_add(&alloc_counts[type], 1, __ATOMIC_RELAXED);
+}
+
+size_t value_alloc_count(valueType type) {
+  return __atomic_load_n(&alloc_counts[type], __ATOMIC_RELAXED);
+}
+
+static const char *value_type_names[TYPE_COUNT] = {
+    "cons",    "exact",   "inexact", "symbol", "nil",    "function",
+    "special", "closure", "bool",    "string", "thread", "channel"};
+
+const char *value_type_name(valueType type) {
+  if (type >= TYPE_COUNT)
+    return "unknown";
+
+  return value_type_names[type];
+}
+
+// The header and the member of the union a type uses
+#define VALUE_SIZE(member)                                                     \
+  (offsetof(struct value_s, member) + sizeof(((struct value_s *)0)->member))
+
+static const size_t value_sizes[TYPE_COUNT] = {
+    [TYPE_CONS] = VALUE_SIZE(cons),
+    [TYPE_NUM_EXACT] = VALUE_SIZE(num_exact),
+    [TYPE_NUM_INEXACT] = VALUE_SIZE(num_inexact),
+    [TYPE_SYMBOL] = VALUE_SIZE(sym),
+    [TYPE_NIL] = sizeof(struct value_s),
+    [TYPE_FUNCTION] = VALUE_SIZE(fn_calls),
+    [TYPE_SPECIAL] = VALUE_SIZE(sym),
+    [TYPE_CLOSURE] = VALUE_SIZE(clo),
+    [TYPE_BOOL] = VALUE_SIZE(boolean),
+    [TYPE_STRING] = VALUE_SIZE(string),
+    [TYPE_THREAD] = VALUE_SIZE(thread),
+    [TYPE_CHANNEL] = VALUE_SIZE(channel)};
+
+_Static_assert(offsetof(struct code_s, cons.car) ==
+                       offsetof(struct value_s, cons.car) &&
+                   offsetof(struct code_s, cons.cdr) ==
+                       offsetof(struct value_s, cons.cdr),
+               "a cons of code starts like a cons");
+
+size_t value_size(valueType type) { return value_sizes[type]; }
+
 value value_alloc(valueType type) {
-  value v = gcx_malloc(sizeof(struct value_s));
+  value v = gcx_malloc(value_sizes[type]);
+
+  alloc_count(type);
 
   v->type = type;
   return v;
 }
 
+void value_print_stats(FILE *out) {
+  for (int i = 0; i < TYPE_COUNT; i++)
+    fprintf(out, "alloc-%s: %zu\n", value_type_names[i],
+            value_alloc_count(i));
+}
+
 /**
  * new_string
  *
@@ -54,45 +110,107 @@ value value_new_closure(value params, value body, env e) {
   v->clo.params = params;
   v->clo.body = body;
   v->clo.e = e;
+  v->clo.name = NULL;
   return v;
 }
 
-value value_new_special(const char *text) {
-  value v = value_alloc(TYPE_SPECIAL);
+/**
+ * Symbol table
+ *
+ * All symbols are interned, so symbols with the same name are eq?. Special
+ * forms are interned as their TYPE_SPECIAL value. Open addressing with
+ * linear probing, one spinlock so any thread can intern.
+ */
+static value *symbols = NULL;
+static size_t symbols_cap = 0;
+static size_t symbols_count = 0;
+static atomic_flag symbols_lock = ATOMIC_FLAG_INIT;
+
+static inline void symbols_acquire() {
+  while (atomic_flag_test_and_set_explicit(&symbols_lock, memory_order_acquire))
+    sched_yield();
+}
 
-  v->sym = (char *)text;
+static inline void symbols_release() {
+  atomic_flag_clear_explicit(&symbols_lock, memory_order_release);
+}
 
-  return v;
+// FNV-1a
+static inline uint32_t symbol_hash(const char *text, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+
+  return hash;
 }
 
-value value_new_symbol_nolookup(const char *text) {
-  value v = value_alloc(TYPE_SYMBOL);
+// Slot holding name, or the empty slot where it goes
+static value *symbol_slot(value *table, size_t cap, const char *text,
+                          size_t len) {
+  size_t i = symbol_hash(text, len) & (cap - 1);
 
-  v->sym = strdup(text);
+  while (table[i] && (strncmp(table[i]->sym, text, len) != 0 ||
+                      table[i]->sym[len] != '\0'))
+    i = (i + 1) & (cap - 1);
 
-  /* fprintf(stderr, "New symbol %s: ( %s , %p)\n",
-     text,
-     v->sym,
-     v);
-   */
+  return table + i;
+}
 
-  return v;
+static void symbols_grow() {
+  size_t cap = symbols_cap ? symbols_cap * 2 : 1024;
+  value *table = gcx_malloc(cap * sizeof(value));
+
+  memset(table, 0, cap * sizeof(value));
+
+  for (size_t i = 0; i < symbols_cap; i++)
+    if (symbols[i])
+      *symbol_slot(table, cap, symbols[i]->sym, strlen(symbols[i]->sym)) =
+          symbols[i];
+
+  symbols = table;
+  symbols_cap = cap;
 }
 
-value value_new_symbol(const char *text, env e) {
+static value symbol_insert(const char *text, size_t len, value special) {
+  symbols_acquire();
+
+  // Keep the load under 2/3
+  if (3 * (symbols_count + 1) > 2 * symbols_cap)
+    symbols_grow();
 
-  value v = env_exists(e, text);
+  value *slot = symbol_slot(symbols, symbols_cap, text, len);
 
-  if (!bool_isnil(v, e)) {
-    // fprintf(stderr,"Reusing symbol %s: ( %s, %p )\n", text, car(v)->sym,
-    // car(v));
-    return car(v);
+  if (!*slot)
+    symbols_count++;
+
+  if (special) {
+    *slot = special;
+  } else if (!*slot) {
+    *slot = value_alloc(TYPE_SYMBOL);
+    (*slot)->sym = strndup(text, len);
   }
 
-  // All special forms are already added
-  assert(!is_special(text));
+  value v = *slot;
 
-  return value_new_symbol_nolookup(text);
+  symbols_release();
+  return v;
+}
+
+value value_intern(const char *text, size_t len) {
+  return symbol_insert(text, len, NULL);
+}
+
+value value_new_symbol(const char *text) {
+  return symbol_insert(text, strlen(text), NULL);
+}
+
+value value_new_special(const char *text) {
+  value v = value_alloc(TYPE_SPECIAL);
+
+  v->sym = (char *)text;
+
+  return symbol_insert(text, strlen(text), v);
 }
 
 value value_new_cons(value car, value cdr) {
@@ -103,6 +221,41 @@ value value_new_cons(value car, value cdr) {
   return v;
 }
 
+value value_new_code(value car, value cdr) {
+  value v = gcx_malloc(sizeof(struct code_s));
+
+  alloc_count(TYPE_CONS);
+
+  v->type = TYPE_CONS;
+  v->code = 1;
+  car(v) = car;
+  cdr(v) = cdr;
+  return v;
+}
+
+static int is_quote(value v) {
+  return v->type == TYPE_SPECIAL && strcmp(v->sym, "quote") == 0;
+}
+
+value value_code(value form) {
+  if (form->type != TYPE_CONS || form->code)
+    return form;
+
+  int quoted = is_quote(car(form));
+  value head = value_new_nil();
+  value *tail = &head;
+
+  // Along the spine here, down the elements by recursion
+  for (; form->type == TYPE_CONS; form = cdr(form)) {
+    *tail = value_new_code(quoted ? car(form) : value_code(car(form)),
+                           value_new_nil());
+    tail = &cdr(*tail);
+  }
+
+  *tail = form;
+  return head;
+}
+
 value value_new_exact(mpq_ptr number) {
   value v = value_alloc(TYPE_NUM_EXACT);
 
@@ -111,10 +264,12 @@ value value_new_exact(mpq_ptr number) {
   return v;
 }
 
-value value_new_function(function f) {
+value value_new_function(const char *name, function f) {
   value v = value_alloc(TYPE_FUNCTION);
 
   v->fn = f;
+  v->fn_name = name;
+  v->fn_calls = 0;
   return v;
 }
 
@@ -135,6 +290,7 @@ void value_print(value v) {
     break;
 
   case TYPE_SYMBOL:
+  case TYPE_SPECIAL:
     printf("%s", v->sym);
     break;
   case TYPE_STRING:
@@ -169,10 +325,17 @@ void value_print(value v) {
 
   case TYPE_CLOSURE:
   case TYPE_FUNCTION:
-  case TYPE_SPECIAL:
     printf("<function>");
     break;
 
+  case TYPE_THREAD:
+    printf("<thread>");
+    break;
+
+  case TYPE_CHANNEL:
+    printf("<channel>");
+    break;
+
   default:
     printf("<unknown>");
   }
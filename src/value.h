@@ -2,6 +2,7 @@
 #define VALUE_H
 
 #include <gmp.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -23,18 +24,23 @@ typedef enum {
   TYPE_SPECIAL,
   TYPE_CLOSURE,
   TYPE_BOOL,
-  TYPE_STRING
+  TYPE_STRING,
+  TYPE_THREAD,
+  TYPE_CHANNEL,
+  TYPE_COUNT // Keep last
 } valueType;
 
 typedef struct {
-  value params; // list of symbols
-  value body;   // list of expressions
-  env e;        // captured environment
+  value params;     // list of symbols
+  value body;       // list of expressions
+  env e;            // captured environment
+  const char *name; // set by define, NULL while anonymous
 } closure;
 
 // Value Struct
 struct value_s {
   valueType type;
+  int code; // a cons of code, a struct code_s, see value_new_code
   union {
     struct {
       value car;
@@ -44,9 +50,15 @@ struct value_s {
     mpq_ptr num_exact;
     char *sym;
     char *string;
-    function fn;
+    struct {
+      function fn;
+      const char *fn_name;
+      unsigned long fn_calls; // while eval_stats is enabled
+    };
     closure clo;
     int boolean;
+    struct green_s *thread;    // thread.c
+    struct channel_s *channel; // thread.c
   };
 };
 
@@ -58,18 +70,62 @@ struct value_s {
 #define cdar(v) (cdr(car(v)))
 #define cddr(v) (cdr(cdr(v)))
 
+/**
+ * Code
+ *
+ * Values are allocated no bigger than their type needs, a cons holds just
+ * car and cdr. The conses of code the evaluator runs have room for two
+ * caches next to them: the global binding cell of a variable reference in
+ * car, see env_lookup_site, and the analysis of the special form the cons
+ * is the argument list of, see eval.c. Lists read as data are copied into code once, when a
+ * top level form is evaluated, see value_code. Code made by folding and
+ * inlining is made as code right away.
+ */
+struct code_s {
+  struct {
+    valueType type;
+    int code;
+    value car;
+    value cdr;
+  } cons;
+  value site_cell;
+  value form_info;
+};
+
+// The caches of v, NULL if it is not a cons of code
+static inline struct code_s *code_of(value v) {
+  return v->code ? (struct code_s *)v : NULL;
+}
+
+// A cons of code
+value value_new_code(value car, value cdr);
+
+// form as code, lists evaluated are copied into conses of code, quoted
+// data is left as it is. Code already made is shared.
+value value_code(value form);
+
 // Value functions
 value value_alloc(valueType type);
+
+// Bytes allocated for a value of type
+size_t value_size(valueType type);
 value value_new_string(char *str);
 value value_new_bool(int b);
 value value_new_closure(value params, value body, env e);
-value value_new_symbol(const char *text, env e);
+value value_new_symbol(const char *text);
+value value_intern(const char *text, size_t len);
 value value_new_special(const char *text);
 value value_new_cons(value car, value cdr);
 value value_new_exact(mpq_ptr exact);
-value value_new_function(function f);
+value value_new_function(const char *name, function f);
 value value_new_nil();
 
+// Allocations of type since startup, counted by every thread
+size_t value_alloc_count(valueType type);
+
+const char *value_type_name(valueType type);
+void value_print_stats(FILE *out);
+
 // Utils until I write better
 void value_print(value v);
 
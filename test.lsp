@@ -58,3 +58,100 @@
 (if (not (= 10 (let ((a 1) (b 2) (c 5)) (* a b c)))) (print "Failed: let multiple bindings"))
 (if (not (= 7 (let ((x 3)) (let ((y 4)) (+ x y))))) (print "Failed: nested let"))
 (if (not (= 6 (let ((x 3)) (let ((x 6)) x)))) (print "Failed: let shadowing"))
+
+;; symbols
+(if (not (eq? 'unbound-symbol 'unbound-symbol)) (print "Failed: symbols are interned"))
+(if (not (eq? 'lambda (car '(lambda)))) (print "Failed: special forms are interned"))
+
+;; global redefinition
+(define test-global 1)
+(define (test-global-ref) test-global)
+(if (not (= 1 (test-global-ref))) (print "Failed: global reference"))
+(define test-global 2)
+(if (not (= 2 (test-global-ref))) (print "Failed: global reference after redefine"))
+(if (not (= 2 ((lambda (test-global) (test-global-ref)) 5))) (print "Failed: global reference is lexical"))
+
+;; closures
+(define (test-adder n) (lambda (x) (+ x n)))
+(if (not (= 7 ((test-adder 3) 4))) (print "Failed: closure captures parameter"))
+(define (test-nest a) (let ((b 2)) (lambda (c) (lambda () (+ a (* b c))))))
+(if (not (= 7 (((test-nest 1) 3)))) (print "Failed: nested closures"))
+(define (test-internal)
+  (define (ev? n) (if (= n 0) #t (od? (- n 1))))
+  (define (od? n) (if (= n 0) #f (ev? (- n 1))))
+  (ev? 10))
+(if (not (eq? #t (test-internal))) (print "Failed: mutually recursive internal defines"))
+(define (test-redefine x) (define g (lambda () x)) (define x 9) (g))
+(if (not (= 9 (test-redefine 1))) (print "Failed: closure sees later define"))
+
+;; constant folding
+(define (test-fold) (* 60 60 24))
+(if (not (= 86400 (test-fold))) (print "Failed: folded constant"))
+(define (test-fold-if) (if (< 1 2) 'yes 'no))
+(if (not (eq? 'yes (test-fold-if))) (print "Failed: folded if"))
+(define (test-fold-let x) (let ((k (+ 1 2))) (* k x)))
+(if (not (= 6 (test-fold-let 2))) (print "Failed: folded let constant"))
+(define (test-fold-div) (/ 1 0))
+(if (not (= 2 ((lambda (/) (/ 1 0)) (lambda (a b) 2)))) (print "Failed: shadowed builtin is not folded"))
+
+;; inlining
+(define (test-sq x) (* x x))
+(define (test-inline y) (+ (test-sq y) (test-sq 3)))
+(if (not (= 13 (test-inline 2))) (print "Failed: inlined call"))
+(define (test-inline-shadow *) (test-sq 3))
+(if (not (= 9 (test-inline-shadow +))) (print "Failed: inlined body keeps its globals"))
+(define (test-sq x) (+ x x))
+(if (not (= 10 (test-inline 2))) (print "Failed: inlined call after redefine"))
+
+;; native code
+(define (test-jit-fib n) (if (< n 2) n (+ (test-jit-fib (- n 1)) (test-jit-fib (- n 2)))))
+(if (not (= 6765 (test-jit-fib 20))) (print "Failed: compiled recursion"))
+(define (test-jit-fact n) (if (= n 0) 1 (* n (test-jit-fact (- n 1)))))
+(if (not (= 265252859812191058636308480000000 (test-jit-fact 30)))
+    (print "Failed: compiled arithmetic past machine words"))
+(define (test-jit-def n) (define m (* n 2)) (+ m 1))
+(define (test-jit-defs n acc) (if (= n 0) acc (test-jit-defs (- n 1) (+ acc (test-jit-def n)))))
+(if (not (= 40400 (test-jit-defs 200 0))) (print "Failed: compiled body with a define"))
+(define (test-jit-add a b) (+ a b))
+(define (test-jit-adds n) (if (= n 0) (test-jit-add 5 3) (begin (test-jit-add n n) (test-jit-adds (- n 1)))))
+(if (not (= 8 (test-jit-adds 200))) (print "Failed: compiled builtin call"))
+(define test-plus +)
+(define + -)
+(if (not (= 2 (test-jit-add 5 3))) (print "Failed: compiled builtin call after redefine"))
+(define + test-plus)
+(if (not (= 8 (test-jit-add 5 3))) (print "Failed: compiled builtin call after restore"))
+
+;; libraries
+(define test-special-sym 'lambda)
+(define-library (test lib)
+  (export test-lib-sq (rename test-lib-down test-lib-count))
+  (begin (define (test-lib-sq x) (* x x))
+         (define (test-lib-loop n) (if (= n 0) 'done (test-lib-loop (- n 1))))
+         (define (test-lib-down n) (test-lib-loop n))))
+(if (not (eq? test-special-sym 'lambda)) (print "Failed: special form names read before a library"))
+(import (test lib))
+(define (test-lib-loop n) 'importer)
+(define (test-lib-use n) (test-lib-count n))
+(if (not (eq? 'done (test-lib-use 3))) (print "Failed: imported procedure keeps its library"))
+(import (prefix (only (test lib) test-lib-sq) test-my-))
+(if (not (= 16 (test-my-test-lib-sq 4))) (print "Failed: import with prefix"))
+
+;; green threads
+(define test-chan (make-channel))
+(define (test-produce n) (if (= n 0) 'done (begin (channel-send test-chan n) (test-produce (- n 1)))))
+(define test-producer (spawn (lambda () (test-produce 3))))
+(define (test-consume n acc) (if (= n 0) acc (test-consume (- n 1) (+ acc (channel-receive test-chan)))))
+(if (not (= 6 (test-consume 3 0))) (print "Failed: values passed over a channel"))
+(if (not (eq? 'done (join test-producer))) (print "Failed: join returns what the thread returned"))
+(define test-order (make-channel 4))
+(define (test-step name) (lambda () (channel-send test-order name) (yield) (channel-send test-order name)))
+(join (spawn (lambda () (define a (spawn (test-step 'a))) (define b (spawn (test-step 'b))) (join a) (join b))))
+(define (test-taken n) (if (= n 0) '() (cons (channel-receive test-order) (test-taken (- n 1)))))
+(define test-steps (test-taken 4))
+(if (not (and (eq? 'a (car test-steps)) (eq? 'b (car (cdr test-steps))) (eq? 'a (car (cdr (cdr test-steps))))))
+    (print "Failed: threads take turns at yield"))
+(define (test-spawn-builtin x) (spawn eval-stats))
+(define test-stats-thread (test-spawn-builtin 7))
+(define (test-clobber y) (+ y 1))
+(test-clobber (test-clobber 2))
+(if (not (pair? (join test-stats-thread))) (print "Failed: spawn a builtin inside a procedure"))